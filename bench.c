@@ -0,0 +1,193 @@
+/*
+	bench.c
+	Performance benchmark over the shipped machine descriptions.
+
+	For each machine: description parse time, step() and post_step() rate,
+	encipher() and decipher() throughput on random plaintext in the machine
+	alphabet, and the latency of single encipher() calls as percentiles.
+	Results are written as JSON, for comparing runs across changes.
+
+	The default set ends with a generated enigma-like machine with a
+	BIG_ALPHABET letter alphabet of CJK characters, as a stress test for
+	long alphabets.
+
+	bench [-o result.json] [machine-description ...]
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "enigma.h"
+
+#define PARSE_RUNS 20
+#define STEP_RUNS 10000000
+#define TEXT_LEN 1000000
+#define LATENCY_RUNS 200000
+#define BIG_ALPHABET 20000
+
+static const char *default_machines[] = {"enigma-I", "enigma-m3", "enigma-m4", "enigma-G312", "fialka-m125"};
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* A random permutation of 0..n-1 */
+static void shuffle(int *p, int n) {
+	for (int i = 0; i < n; ++i) p[i] = i;
+	for (int i = n - 1; i > 0; --i) {
+		int j = rand() % (i + 1), t = p[i];
+		p[i] = p[j];
+		p[j] = t;
+	}
+}
+
+/*
+	Write a description of an enigma-like machine with an alphabet of al CJK
+	characters to a temporary file: reflector, three stepping wheels, no plugboard.
+	Returns the file name.
+*/
+static char *big_machine(int al) {
+	static char name[] = "/tmp/enigma-bench-XXXXXX";
+	int fd = mkstemp(name);
+	FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!f) feil("cannot write the generated machine\n");
+	wchar_t *a = malloc((al + 1) * sizeof(wchar_t)), *wr = malloc((al + 1) * sizeof(wchar_t));
+	int *p = malloc(al * sizeof(int));
+	for (int i = 0; i < al; ++i) a[i] = 0x4E00 + i;
+	a[al] = wr[al] = 0;
+	srand(2);
+	fprintf(f, "ciphermachine \"Random %i\"\nalphabet \"%ls\"\nwheelslots 4\nstepping notches\n", al, a);
+	fprintf(f, "slot 4\n\tfast\n\tnotch push 3\nslot 3\n\tnotch push 2 3\nslot 1\n\tnonrotating\n");
+	fprintf(f, "for slots 2 - 4\n");
+	for (int w = 1; w <= 3; ++w) {
+		shuffle(p, al);
+		for (int i = 0; i < al; ++i) wr[i] = a[p[i]];
+		fprintf(f, "wheel W%i\n\twiring \"%ls\"\n\tnotch \"%lc\"\n", w, wr, a[rand() % al]);
+	}
+	/* Reflector: swap the letters pairwise, in random pairs */
+	shuffle(p, al);
+	for (int i = 0; i + 1 < al; i += 2) {
+		wr[p[i]] = a[p[i + 1]];
+		wr[p[i + 1]] = a[p[i]];
+	}
+	fprintf(f, "for slot 1\nreflector R\n\twiring \"%ls\"\n", wr);
+	fclose(f);
+	free(p);
+	free(wr);
+	free(a);
+	return name;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Keypresses per second for encipher() or decipher() over the text */
+static double char_rate(machine *m, bool enciphering, const wchar_t *text, size_t len) {
+	machine *c = machine_clone(m);
+	volatile wchar_t sink = 0;
+	double t0 = now();
+	for (size_t i = 0; i < len; ++i) sink = enciphering ? encipher(c, text[i]) : decipher(c, text[i]);
+	double t = now() - t0;
+	(void)sink;
+	free_clone(c);
+	return len / t;
+}
+
+static void bench_machine(FILE *f, const char *name, const char *file, bool first) {
+	/* Parse time, median of several runs */
+	double parse[PARSE_RUNS];
+	machine *m = NULL;
+	for (int i = 0; i < PARSE_RUNS; ++i) {
+		double t0 = now();
+		m = getdescr((char *)file);
+		parse[i] = now() - t0;
+		if (!m) feil("Unuseable machine description\n");
+	}
+	qsort(parse, PARSE_RUNS, sizeof(double), cmp_double);
+	step_cleanup(m);
+
+	machine *c = machine_clone(m);
+	double t0 = now();
+	for (int i = 0; i < STEP_RUNS; ++i) step(c);
+	double step_rate = STEP_RUNS / (now() - t0);
+	t0 = now();
+	for (int i = 0; i < STEP_RUNS; ++i) post_step(c);
+	double post_step_rate = STEP_RUNS / (now() - t0);
+	free_clone(c);
+
+	/* Random plaintext, the same for every run */
+	srand(1);
+	wchar_t *text = malloc(TEXT_LEN * sizeof(wchar_t));
+	for (size_t i = 0; i < TEXT_LEN; ++i) text[i] = m->alphabet[rand() % m->alphabet_len];
+	double enc_rate = char_rate(m, true, text, TEXT_LEN);
+	double dec_rate = char_rate(m, false, text, TEXT_LEN);
+
+	/* Single keypress latency. The clock overhead is included */
+	double *lat = malloc(LATENCY_RUNS * sizeof(double));
+	c = machine_clone(m);
+	volatile wchar_t sink = 0;
+	for (int i = 0; i < LATENCY_RUNS; ++i) {
+		double t = now();
+		sink = encipher(c, text[i]);
+		lat[i] = now() - t;
+	}
+	(void)sink;
+	free_clone(c);
+	qsort(lat, LATENCY_RUNS, sizeof(double), cmp_double);
+
+	fprintf(f, "%s\n    {\"machine\": \"%s\", \"slots\": %i, \"alphabet_len\": %i,\n", first ? "" : ",",
+	        name, m->wheelslots, m->alphabet_len);
+	fprintf(f, "     \"parse_us\": %.1f,\n", parse[PARSE_RUNS / 2] * 1e6);
+	fprintf(f, "     \"step_per_s\": %.0f, \"post_step_per_s\": %.0f,\n", step_rate, post_step_rate);
+	fprintf(f, "     \"encipher_per_s\": %.0f, \"decipher_per_s\": %.0f,\n", enc_rate, dec_rate);
+	fprintf(f, "     \"latency_ns\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"p99.9\": %.0f, \"max\": %.0f}}",
+	        lat[LATENCY_RUNS / 2] * 1e9, lat[LATENCY_RUNS * 9 / 10] * 1e9, lat[LATENCY_RUNS * 99 / 100] * 1e9,
+	        lat[LATENCY_RUNS * 999 / 1000] * 1e9, lat[LATENCY_RUNS - 1] * 1e9);
+	free(lat);
+	free(text);
+}
+
+int main(int argc, char *argv[]) {
+	if (setlocale(LC_ALL, "") == NULL) feil("Bad locale, please configure your computer correctly. Install the locale package, and/or set the LANG environment variable.\n");
+	const char *outfile = NULL;
+	const char **machines = default_machines;
+	int n = sizeof(default_machines) / sizeof(default_machines[0]);
+	bool big = true;
+	int i = 1;
+	if (argc > 2 && !strcmp(argv[1], "-o")) {
+		outfile = argv[2];
+		i = 3;
+	}
+	if (i < argc) {
+		machines = (const char **)argv + i;
+		n = argc - i;
+		big = false;
+	}
+	FILE *f = outfile ? fopen(outfile, "w") : stdout;
+	if (!f) feil("cannot open the output file\n");
+	fprintf(f, "{\"benchmark\": \"enigma\", \"results\": [");
+	for (int k = 0; k < n; ++k) {
+		bench_machine(f, machines[k], machines[k], !k);
+		fflush(f);
+	}
+	if (big) {
+		char name[32], *file = big_machine(BIG_ALPHABET);
+		snprintf(name, sizeof(name), "random-%i", BIG_ALPHABET);
+		bench_machine(f, name, file, false);
+		unlink(file);
+	}
+	fprintf(f, "\n]}\n");
+	if (f != stdout) fclose(f);
+	return 0;
+}
@@ -0,0 +1,449 @@
+/*
+	bombe.c
+	Known-plaintext (crib) search, after the Turing-Welchman bombe.
+
+	The crib and the ciphertext under it form a menu: a graph on the letters,
+	with an edge p-c for every crib position i where p enciphers to c.
+	Everything between the plugboard and the reflector is the scrambler S_i,
+	and a plugboard swap st() must satisfy S_i(st(p)) = st(c).
+	Guessing st(t) for the best connected letter t, the edges give st() of
+	its neighbours, and so on through the menu. Swaps go both ways, so
+	st(a) = b also gives st(b) = a (Welchman's diagonal board).
+	A guess that ends with some letter swapped to two others is impossible.
+	A start position where some guess survives is a stop.
+
+	Most guesses die on the first closed loop of the menu, so each guess is
+	first run along a spanning tree of the menu, checking the loops as they
+	close. Only the survivors get the full diagonal board treatment.
+
+	The scramblers for every rotor state of a wheel order are composed in
+	one table up front, from the wheels' rotated tables. Each start position
+	is then stepped through the crib, looking up its scramblers by state.
+	Ring settings only offset the start position, except where they decide
+	when a fast wheel pushes the next one. Those rings are tried too, the
+	others are taken as the first letter. Wheel orders are spread over
+	threads with run_pool().
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <pthread.h>
+
+#include "enigma.h"
+
+/* Biggest scrambler table, in rotor states */
+#define BOMBE_MAX_STATES (1 << 22)
+
+/* Stops printed in full */
+#define BOMBE_SHOW 50
+
+/* A step of the spanning tree walk: st(to) = S_pos(st(from)), or a loop check */
+typedef struct {
+	int from, to, pos;
+	bool check;
+} menu_op;
+
+/* The menu for one crib offset, as adjacency lists */
+typedef struct {
+	int offset;
+	int test;			/* Letter with the most edges, st() is guessed for this one */
+	int *first;		/* Edges of letter a: first[a] .. first[a+1]-1 */
+	int *to;			/* Other end of the edge */
+	int *pos;			/* Crib position of the edge */
+	menu_op *ops;	/* Spanning tree walk from test */
+	int nops;
+} menu;
+
+typedef struct {
+	int offset;
+	int order;
+	int *rot;			/* Start rotations */
+	int *ring;		/* Ring settings */
+	int *stecker;	/* Plugboard partner of each letter, -1 if unknown */
+} stop;
+
+typedef struct {
+	machine *c;
+	symbol *table;	/* Scrambler for every state, states x alphabet_len */
+	int *state;			/* State at each crib position, for each ring setting tried */
+	const symbol **row;	/* Scrambler at each crib position */
+	int *stack;
+	uint64_t *live;
+	unsigned long long tried;
+} bombe_thread;
+
+typedef struct {
+	machine *m;
+	int n, al;
+	const symbol *text;
+	size_t len;
+	const symbol *crib;
+	int crib_len;
+	menu *menus;
+	int nmenus;
+	int first_offset, window;	/* Message positions covered by the menus */
+	wheel **orders;
+	int norders;
+	int *stepping;
+	int nstepping;
+	int *turnover;	/* Fast slots that push others, their rings are tried */
+	int nturnover;
+	long rings;			/* Ring combinations for the turnover slots */
+	int inner;			/* Slots 0 .. inner-1 form the scrambler */
+	bool plugboard;
+	long states;
+	bombe_thread *t;
+	pthread_mutex_t lock;
+	stop *stops;
+	int nstops;
+} bombe;
+
+
+/*
+	Compose the scrambler for all rotations of slots j .. inner-1.
+	prev maps through slots 0 .. j-1 and back, for rotor state 'state' so far.
+	Stepping slots count like an odometer, the last one fastest.
+	A state is the rotations less the ring settings.
+*/
+static void compose(bombe *b, const wheel **order, int j, long state, const symbol *prev, symbol *table) {
+	int al = b->al;
+	wheelslot *sl = &b->m->slot[j];
+	int rots = sl->step ? al : 1;
+	symbol map[al];
+	for (int r = 0; r < rots; ++r) {
+		int row = sl->step ? r : (sl->rot - sl->ringstellung + al) % al;
+		long st = sl->step ? state * al + r : state;
+		const symbol *e = order[j]->rot_encode + row * al, *d = order[j]->rot_decode + row * al;
+		symbol *out = j == b->inner - 1 ? table + st * al : map;
+		if (j == 0) memcpy(out, e, al * sizeof(symbol));
+		else for (int x = 0; x < al; ++x) out[x] = d[prev[e[x]]];
+		if (j < b->inner - 1) compose(b, order, j + 1, st, map, table);
+	}
+}
+
+static inline int machine_state(bombe *b, machine *c) {
+	int st = 0;
+	for (int i = 0; i < b->nstepping; ++i) {
+		wheelslot *sl = &c->slot[b->stepping[i]];
+		int off = sl->rot - sl->ringstellung;
+		st = st * b->al + (off < 0 ? off + b->al : off);
+	}
+	return st;
+}
+
+/* Follow a guess through the whole menu, with the diagonal board */
+static bool closure(bombe *b, bombe_thread *t, menu *mn, int v, int *stecker) {
+	int al = b->al;
+	uint64_t *live = t->live;
+	memset(live, 0, al * sizeof(uint64_t));
+	int *sp = t->stack;
+	*sp++ = mn->test;
+	*sp++ = v;
+	while (sp > t->stack) {
+		int y = *--sp, a = *--sp;
+		if (live[a] & (1ULL << y)) continue;
+		live[a] |= 1ULL << y;
+		if (live[a] & (live[a] - 1)) return false; /* Two partners */
+		*sp++ = y;
+		*sp++ = a;
+		for (int e = mn->first[a]; e < mn->first[a + 1]; ++e) {
+			*sp++ = mn->to[e];
+			*sp++ = t->row[mn->pos[e]][y];
+		}
+	}
+	for (int a = 0; a < al; ++a) stecker[a] = live[a] ? __builtin_ctzll(live[a]) : -1;
+	return true;
+}
+
+/*
+	Try every guess for st(test), with the scramblers in t->row.
+	Returns true if one survives, with the plugboard partners it implies.
+*/
+static bool menu_test(bombe *b, bombe_thread *t, menu *mn, int *stecker) {
+	int al = b->al;
+	const symbol **row = t->row;
+	if (!b->plugboard) {
+		/* Nothing to guess, the scrambler must do it all */
+		for (int i = 0; i < b->crib_len; ++i) if (row[i][b->crib[i]] != b->text[mn->offset + i]) return false;
+		for (int a = 0; a < al; ++a) stecker[a] = a;
+		return true;
+	}
+	int val[al];
+	for (int v = 0; v < al; ++v) {
+		val[mn->test] = v;
+		int k = 0;
+		for (; k < mn->nops; ++k) {
+			menu_op *op = &mn->ops[k];
+			int x = row[op->pos][val[op->from]];
+			if (!op->check) val[op->to] = x;
+			else if (x != val[op->to]) break;
+		}
+		if (k == mn->nops && closure(b, t, mn, v, stecker)) return true;
+	}
+	return false;
+}
+
+static void add_stop(bombe *b, int offset, int order, const wheelslot *start, const int *stecker) {
+	pthread_mutex_lock(&b->lock);
+	b->stops = realloc(b->stops, (b->nstops + 1) * sizeof(stop));
+	stop *s = &b->stops[b->nstops++];
+	s->offset = offset;
+	s->order = order;
+	s->rot = malloc(2 * b->n * sizeof(int));
+	s->ring = s->rot + b->n;
+	for (int i = 0; i < b->n; ++i) {
+		s->rot[i] = start[i].rot;
+		s->ring[i] = start[i].ringstellung;
+	}
+	s->stecker = malloc(b->al * sizeof(int));
+	memcpy(s->stecker, stecker, b->al * sizeof(int));
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* One wheel order, all start positions, turnover rings and crib offsets */
+static void run_order(void *data, int thread, long order) {
+	bombe *b = data;
+	bombe_thread *t = &b->t[thread];
+	machine *c = t->c;
+	const wheel **o = (const wheel **)b->orders + order * b->n;
+	if (!o[0]->reflector) return;
+	compose(b, o, 0, 0, NULL, t->table);
+
+	int al = b->al, stecker[al], rings = 0;
+	wheelslot start[b->n];
+	for (long p = 0; p < b->states; ++p) for (long rc = 0; rc < b->rings; ++rc) {
+		for (int i = 0; i < b->n; ++i) {
+			wheelslot *sl = &c->slot[i];
+			sl->w = (wheel *)o[i];
+			sl->ringstellung = sl->step ? 0 : b->m->slot[i].ringstellung;
+			sl->rot = b->m->slot[i].rot;
+		}
+		for (long i = b->nstepping, q = p; i--; q /= al) c->slot[b->stepping[i]].rot = q % al;
+		for (long i = b->nturnover, q = rc; i--; q /= al) {
+			wheelslot *sl = &c->slot[b->turnover[i]];
+			sl->ringstellung = q % al;
+			sl->rot = (sl->rot + sl->ringstellung) % al;
+		}
+		memcpy(start, c->slot, b->n * sizeof(wheelslot));
+		if (b->first_offset) machine_seek(c, b->first_offset);
+		else {
+			for (int i = 0; i < b->n; ++i) c->slot[i].movement = (b->m->steptype == T_PIN_BLOCKING);
+			post_step(c);
+		}
+
+		/* State at each message position, right after the keypress stepped */
+		if (!rc) rings = 0;
+		int *state = t->state + rings * b->window;
+		for (int k = 0; k < b->window; ++k) {
+			step(c);
+			state[k] = machine_state(b, c);
+		}
+		/* Several ring settings may give the same states, test those once */
+		bool seen = false;
+		for (int r = 0; r < rings && !seen; ++r) seen = !memcmp(t->state + r * b->window, state, b->window * sizeof(int));
+		if (seen) continue;
+		++rings;
+
+		for (int i = 0; i < b->nmenus; ++i) {
+			menu *mn = &b->menus[i];
+			const int *st = state + mn->offset - b->first_offset;
+			for (int k = 0; k < b->crib_len; ++k) t->row[k] = t->table + (long)st[k] * al;
+			if (menu_test(b, t, mn, stecker)) add_stop(b, mn->offset, order, start, stecker);
+		}
+		t->tried += b->nmenus;
+	}
+}
+
+/* The menu for the crib at 'offset'. false if the crib can't go there */
+static bool make_menu(bombe *b, int offset, menu *mn) {
+	int al = b->al, L = b->crib_len;
+	for (int i = 0; i < L; ++i) if (b->crib[i] == b->text[offset + i]) return false; /* Reflector */
+	int degree[al];
+	memset(degree, 0, sizeof(degree));
+	for (int i = 0; i < L; ++i) {
+		++degree[b->crib[i]];
+		++degree[b->text[offset + i]];
+	}
+	mn->offset = offset;
+	mn->first = malloc((al + 1) * sizeof(int));
+	mn->to = malloc(2 * L * sizeof(int));
+	mn->pos = malloc(2 * L * sizeof(int));
+	mn->test = 0;
+	mn->first[0] = 0;
+	for (int a = 0; a < al; ++a) {
+		mn->first[a + 1] = mn->first[a] + degree[a];
+		if (degree[a] > degree[mn->test]) mn->test = a;
+	}
+	int fill[al];
+	memcpy(fill, mn->first, al * sizeof(int));
+	for (int i = 0; i < L; ++i) {
+		int p = b->crib[i], c = b->text[offset + i];
+		mn->to[fill[p]] = c;
+		mn->pos[fill[p]++] = i;
+		mn->to[fill[c]] = p;
+		mn->pos[fill[c]++] = i;
+	}
+
+	/* Spanning tree walk, breadth first. Every other edge closes a loop */
+	mn->ops = malloc(L * sizeof(menu_op));
+	mn->nops = 0;
+	bool reached[al], used[L];
+	memset(reached, 0, sizeof(reached));
+	memset(used, 0, sizeof(used));
+	int queue[al], head = 0, tail = 0;
+	queue[tail++] = mn->test;
+	reached[mn->test] = true;
+	while (head < tail) {
+		int a = queue[head++];
+		for (int e = mn->first[a]; e < mn->first[a + 1]; ++e) {
+			int i = mn->pos[e], c = mn->to[e];
+			if (used[i]) continue;
+			used[i] = true;
+			mn->ops[mn->nops++] = (menu_op){a, c, i, reached[c]};
+			if (!reached[c]) {
+				reached[c] = true;
+				queue[tail++] = c;
+			}
+		}
+	}
+	return true;
+}
+
+static void print_stop(bombe *b, stop *s, machine *c, wheel *plug, symbol *plain) {
+	machine *m = b->m;
+	wprintf(L"offset %i  wheels", s->offset);
+	for (int i = 0; i < b->n; ++i) if (m->slot[i].type == T_WHEEL) wprintf(L" %ls", b->orders[s->order * b->n + i]->name);
+	wprintf(L"  positions ");
+	for (int i = 0; i < b->nstepping; ++i) wprintf(L"%lc", m->alphabet[s->rot[b->stepping[i]]]);
+	wprintf(L"  rings ");
+	for (int i = 0; i < b->nstepping; ++i) wprintf(L"%lc", m->alphabet[s->ring[b->stepping[i]]]);
+	if (b->plugboard) {
+		wprintf(L"  steckers");
+		for (int a = 0; a < b->al; ++a) if (s->stecker[a] > a) wprintf(L" %lc%lc", m->alphabet[a], m->alphabet[s->stecker[a]]);
+	}
+	/* Decipher with what is known, other letters unplugged */
+	for (int i = 0; i < b->n; ++i) {
+		c->slot[i].w = b->orders[s->order * b->n + i];
+		c->slot[i].rot = s->rot[i];
+		c->slot[i].ringstellung = s->ring[i];
+	}
+	if (b->plugboard) {
+		identity_map(m, plug);
+		for (int a = 0; a < b->al; ++a) if (s->stecker[a] >= 0) plug->encode[a] = plug->decode[a] = s->stecker[a];
+		wheel_tables(m, plug);
+		c->slot[m->wheelslots - 1].w = plug;
+	}
+	step_cleanup(c);
+	decipher_block(c, b->text, plain, b->len);
+	wprintf(L"\n    ");
+	for (size_t i = 0; i < b->len && i < 70; ++i) wprintf(L"%lc", m->alphabet[plain[i]]);
+	wprintf(L"\n");
+}
+
+static int stop_order(const void *x, const void *y) {
+	const stop *a = x, *b = y;
+	if (a->offset != b->offset) return a->offset - b->offset;
+	if (a->order != b->order) return a->order - b->order;
+	return a < b ? -1 : a > b;
+}
+
+/*
+	Find the stops for 'cribtext' in the ciphertext in 'cipherfile', at message
+	position 'at', or at every position where it fits if 'at' is negative.
+	The machine needs a reflector in slot 1. A plugboard must be the last slot.
+*/
+void bombe_search(machine *m, const char *cipherfile, const char *cribtext, int at, int threads) {
+	bombe b;
+	memset(&b, 0, sizeof(b));
+	b.m = m;
+	b.n = m->wheelslots;
+	b.al = m->alphabet_len;
+	b.text = read_symbols(m, cipherfile, &b.len);
+	if (!b.text) feil("cannot read the ciphertext\n");
+	wchar_t *wcrib = mbstowcsdup(cribtext);
+	if (!wcrib) feil("bad crib\n");
+	symbol *crib = malloc((wcslen(wcrib) + 1) * sizeof(symbol));
+	b.crib_len = fold_symbols(m, wcrib, crib);
+	b.crib = crib;
+	free(wcrib);
+	if (!b.crib_len || (size_t)b.crib_len > b.len) feil("the crib must be shorter than the ciphertext\n");
+	if (at >= 0 && (size_t)(at + b.crib_len) > b.len) feil("the crib goes past the end of the ciphertext\n");
+	if (b.al > 64) feil("the bombe handles alphabets of up to 64 letters\n");
+	if (!b.n || !m->slot[0].w->reflector) feil("the bombe needs a machine with a reflector\n");
+
+	b.inner = b.n;
+	for (int i = 0; i < b.n; ++i) if (m->slot[i].type == T_PAIRSWAP) {
+		if (i != b.n - 1) feil("the bombe needs the plugboard in the last slot\n");
+		b.plugboard = true;
+		b.inner = b.n - 1;
+	}
+	for (int i = 0; i < b.n; ++i) if (m->slot[i].type == T_REWIRABLE) feil("the bombe can't handle rewirable wheels\n");
+	b.stepping = malloc(b.n * sizeof(int));
+	b.turnover = malloc(b.n * sizeof(int));
+	b.states = b.rings = 1;
+	for (int i = 0; i < b.inner; ++i) if (m->slot[i].step) {
+		wheelslot *sl = &m->slot[i];
+		b.stepping[b.nstepping++] = i;
+		b.states *= b.al;
+		if (b.states > BOMBE_MAX_STATES) feil("too many rotor positions for the bombe\n");
+		bool pushes = false;
+		for (int j = 0; j < sl->affect_slots; ++j) pushes |= sl->affect_slot[j] != i;
+		if (sl->fast && pushes && m->steptype == T_NOTCH_ENABLING) {
+			b.turnover[b.nturnover++] = i;
+			b.rings *= b.al;
+		}
+	}
+	b.orders = wheel_orders(m, &b.norders);
+	wheel *w = m->wheel_list;
+	do {
+		if (!w->rot_encode) wheel_tables(m, w);
+		w = w->next_in_set;
+	} while (w != m->wheel_list);
+
+	/* Menus */
+	int from = at >= 0 ? at : 0, to = at >= 0 ? at : (int)b.len - b.crib_len;
+	b.menus = malloc((to - from + 1) * sizeof(menu));
+	for (int off = from; off <= to; ++off) if (make_menu(&b, off, &b.menus[b.nmenus])) ++b.nmenus;
+	if (!b.nmenus) feil("the crib fits nowhere, a reflector never maps a letter to itself\n");
+	b.first_offset = b.menus[0].offset;
+	b.window = b.menus[b.nmenus - 1].offset + b.crib_len - b.first_offset;
+
+	threads = pool_threads(threads);
+	bombe_thread t[threads];
+	b.t = t;
+	pthread_mutex_init(&b.lock, NULL);
+	for (int i = 0; i < threads; ++i) {
+		memset(&t[i], 0, sizeof(bombe_thread));
+		t[i].c = machine_clone(m);
+		t[i].table = malloc(b.states * b.al * sizeof(symbol));
+		t[i].state = malloc(b.rings * b.window * sizeof(int));
+		t[i].row = malloc(b.crib_len * sizeof(symbol *));
+		/* Every (letter, partner) is expanded once, pushing its partner and menu neighbours */
+		t[i].stack = malloc(2 * (b.al * (b.al + 2 * b.crib_len) + 1) * sizeof(int));
+		t[i].live = malloc(b.al * sizeof(uint64_t));
+	}
+	fprintf(stderr, "%i wheel orders, %ld start positions and %ld turnover rings each, %i crib offsets, %i threads\n",
+	        b.norders, b.states, b.rings, b.nmenus, threads);
+
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	run_pool(threads, b.norders, run_order, &b);
+	unsigned long long tried = 0;
+	for (int i = 0; i < threads; ++i) tried += t[i].tried;
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	fprintf(stderr, "%llu positions in %.2f s, %.0f positions/s, %i stops\n",
+	        tried, secs, secs > 0 ? tried / secs : 0.0, b.nstops);
+
+	qsort(b.stops, b.nstops, sizeof(stop), stop_order);
+	/* The clone's private plugboard */
+	wheel *plug = t[0].c->slot[b.n - 1].w;
+	symbol *plain = malloc(b.len * sizeof(symbol));
+	for (int i = 0; i < b.nstops && i < BOMBE_SHOW; ++i) print_stop(&b, &b.stops[i], t[0].c, plug, plain);
+	if (b.nstops > BOMBE_SHOW) wprintf(L"... and %i more stops\n", b.nstops - BOMBE_SHOW);
+}
@@ -0,0 +1,362 @@
+/*
+	cache.c
+	Compiled machine descriptions, for fast startup and cheap sharing.
+
+	A parsed machine is packed into one relocatable blob: alphabet, wheels
+	with their wirings, rotated tables, notches and allowed slots, and the
+	slots with the default wheel order. Pointers are stored as offsets from
+	the start of the blob, so it can be mapped anywhere.
+
+	Every description is used in this form. Freshly parsed ones are packed
+	in memory by compact_descr(), and the parser's many small allocations
+	freed. The wheels are then one array, in wheel_list order.
+
+	enigma description --compile writes the blob to description.cache.
+	getdescr() maps the cache instead of parsing, when the cache is the same
+	version and was compiled from the description as it is now. The
+	description's mtime and size are checked first; if they changed, a
+	checksum of its contents decides. The cache carries a checksum of its
+	own as well, a damaged cache is ignored rather than trusted.
+
+	The mapping is private and writable, so plugboards can be rewired
+	without touching the file.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "enigma.h"
+
+#define CACHE_VERSION 2
+static const char cache_magic[8] = "ENIGMAC";
+
+/* The source description the cache was compiled from */
+typedef struct {
+	int64_t mtime_sec, mtime_nsec;
+	int64_t size;
+	uint64_t hash;
+} cache_source;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;						/* Of the whole file */
+	uint32_t symbol_size, wchar_size;	/* The cache is only for this build */
+	cache_source source;
+	int32_t alphabet_len, steptype, wheelslots, wheels, longest_wheelname;
+	uint32_t name, alphabet;	/* Offsets of wchar_t strings */
+	uint32_t slot, wheel;			/* Offsets of the slot and wheel records */
+	uint64_t hash;					/* Of the whole file except this field, see blob_hash() */
+} cache_header;
+
+typedef struct {
+	uint32_t name, encode, decode, rot_encode, notch, allow_slot;	/* Offsets, 0 for none */
+	int32_t name_len;
+	bool reflector;
+} cache_wheel;
+
+typedef struct {
+	int32_t w;	/* Wheel number, in wheel_list order */
+	int32_t rot, ringstellung, step, type, affect_slots, pin_offset;
+	uint32_t affect_slot;
+	bool fast, movement;
+} cache_slot;
+
+/* Growing buffer for writing the cache */
+typedef struct {
+	char *buf;
+	size_t len, size;
+} blob;
+
+/* Append n bytes, 8-byte aligned. Returns the offset */
+static uint32_t put(blob *b, const void *data, size_t n) {
+	size_t off = (b->len + 7) & ~(size_t)7;
+	if (off + n > b->size) {
+		b->size = 2 * (off + n);
+		b->buf = realloc(b->buf, b->size);
+	}
+	memset(b->buf + b->len, 0, off - b->len);
+	if (data) memcpy(b->buf + off, data, n);
+	else memset(b->buf + off, 0, n);
+	b->len = off + n;
+	return off;
+}
+
+static uint32_t put_wcs(blob *b, const wchar_t *ws) {
+	return ws ? put(b, ws, (wcslen(ws) + 1) * sizeof(wchar_t)) : 0;
+}
+
+/* FNV-1a, continuing from h */
+static uint64_t hash_more(uint64_t h, const unsigned char *p, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_bytes(const unsigned char *p, size_t n) {
+	return hash_more(14695981039346656037ULL, p, n);
+}
+
+/* Checksum of a blob, the hash field is last in the header and left out */
+static uint64_t blob_hash(const char *base, size_t size) {
+	uint64_t h = hash_bytes((const unsigned char *)base, offsetof(cache_header, hash));
+	return hash_more(h, (const unsigned char *)base + sizeof(cache_header), size - sizeof(cache_header));
+}
+
+/* Hash of the file's contents, false if it can't be read */
+static bool hash_file(int fd, size_t size, uint64_t *hash) {
+	if (!size) {
+		*hash = hash_bytes(NULL, 0);
+		return true;
+	}
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) return false;
+	*hash = hash_bytes(p, size);
+	munmap(p, size);
+	return true;
+}
+
+static bool source_info(const char *filename, cache_source *s, bool hash) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	bool ok = !fstat(fd, &st);
+	if (ok) {
+		s->mtime_sec = st.st_mtim.tv_sec;
+		s->mtime_nsec = st.st_mtim.tv_nsec;
+		s->size = st.st_size;
+		if (hash) ok = hash_file(fd, st.st_size, &s->hash);
+	}
+	close(fd);
+	return ok;
+}
+
+/* Where the cache for a description goes */
+char *cache_name(const char *filename) {
+	char *c = malloc(strlen(filename) + sizeof(".cache"));
+	strcpy(c, filename);
+	strcat(c, ".cache");
+	return c;
+}
+
+/* Pack a machine description into a blob. src is the description file, if any */
+static blob make_blob(machine *m, const cache_source *src) {
+	int al = m->alphabet_len, n = m->wheelslots;
+	blob b = {NULL, 0, 0};
+	cache_header h;
+	memset(&h, 0, sizeof(h));
+	put(&b, NULL, sizeof(h));
+	memcpy(h.magic, cache_magic, sizeof(h.magic));
+	h.version = CACHE_VERSION;
+	h.symbol_size = sizeof(symbol);
+	h.wchar_size = sizeof(wchar_t);
+	if (src) h.source = *src;
+	h.alphabet_len = al;
+	h.steptype = m->steptype;
+	h.wheelslots = n;
+	h.longest_wheelname = m->longest_wheelname;
+	h.name = put_wcs(&b, m->name);
+	h.alphabet = put_wcs(&b, m->alphabet);
+
+	wheel *w = m->wheel_list;
+	if (w) do {
+		++h.wheels;
+		w = w->next_in_set;
+	} while (w != m->wheel_list);
+	cache_wheel cw[h.wheels];
+	w = m->wheel_list;
+	for (int i = 0; i < h.wheels; ++i, w = w->next_in_set) {
+		if (!w->rot_encode) wheel_tables(m, w);
+		cw[i] = (cache_wheel){
+			.name = put_wcs(&b, w->name),
+			.encode = put(&b, w->encode, al * sizeof(symbol)),
+			.decode = put(&b, w->decode, al * sizeof(symbol)),
+			.rot_encode = w->rot_encode ? put(&b, w->rot_encode, 2 * al * al * sizeof(symbol)) : 0,
+			.notch = w->notch ? put(&b, w->notch, al * sizeof(bool)) : 0,
+			.allow_slot = w->allow_slot ? put(&b, w->allow_slot, n * sizeof(bool)) : 0,
+			.name_len = w->name_len,
+			.reflector = w->reflector
+		};
+	}
+	h.wheel = put(&b, cw, sizeof(cw));
+
+	cache_slot cs[n];
+	memset(cs, 0, sizeof(cs));
+	for (int i = 0; i < n; ++i) {
+		wheelslot *sl = &m->slot[i];
+		cs[i].w = -1;
+		w = m->wheel_list;
+		for (int k = 0; k < h.wheels; ++k, w = w->next_in_set) if (w == sl->w) cs[i].w = k;
+		cs[i].rot = sl->rot;
+		cs[i].ringstellung = sl->ringstellung;
+		cs[i].step = sl->step;
+		cs[i].type = sl->type;
+		cs[i].affect_slots = sl->affect_slots;
+		cs[i].pin_offset = sl->pin_offset;
+		cs[i].affect_slot = sl->affect_slots ? put(&b, sl->affect_slot, sl->affect_slots * sizeof(int)) : 0;
+		cs[i].fast = sl->fast;
+		cs[i].movement = sl->movement;
+	}
+	h.slot = put(&b, cs, sizeof(cs));
+	h.size = b.len;
+	memcpy(b.buf, &h, sizeof(h));
+	h.hash = blob_hash(b.buf, b.len);
+	memcpy(b.buf, &h, sizeof(h));
+	return b;
+}
+
+/* Parse 'filename' and write its cache. Returns false on failure */
+bool compile_descr(char *filename) {
+	cache_source src;
+	machine *m = parse_descr(filename);
+	if (!m || !source_info(filename, &src, true)) return false;
+	blob b = make_blob(m, &src);
+
+	/* Write a new file and rename it, so a running reader never sees half a cache */
+	char *cache = cache_name(filename), *tmp = malloc(strlen(cache) + sizeof(".tmp"));
+	strcpy(tmp, cache);
+	strcat(tmp, ".tmp");
+	FILE *f = fopen(tmp, "wb");
+	bool ok = f && fwrite(b.buf, b.len, 1, f) == 1;
+	if (f && fclose(f)) ok = false;
+	ok = ok && !rename(tmp, cache);
+	if (!ok) unlink(tmp);
+	free(tmp);
+	free(cache);
+	free(b.buf);
+	return ok;
+}
+
+/* Pointer into the mapped cache, NULL for offset 0 */
+static inline void *at(char *base, uint32_t off) {
+	return off ? base + off : NULL;
+}
+
+/*
+	The machine in a blob. The machine, its wheels and slots are one allocation,
+	the rest points into the blob
+*/
+static machine *blob_machine(char *base) {
+	cache_header h;
+	memcpy(&h, base, sizeof(h));
+	int al = h.alphabet_len, n = h.wheelslots;
+	machine *m = calloc(1, sizeof(machine) + h.wheels * sizeof(wheel) + n * sizeof(wheelslot));
+	m->name = at(base, h.name);
+	m->alphabet = at(base, h.alphabet);
+	m->alphabet_len = al;
+	m->steptype = h.steptype;
+	m->wheelslots = n;
+	m->longest_wheelname = h.longest_wheelname;
+
+	cache_wheel *cw = at(base, h.wheel);
+	wheel *w = (wheel *)(m + 1);
+	for (int i = 0; i < h.wheels; ++i) {
+		w[i].name = at(base, cw[i].name);
+		w[i].name_len = cw[i].name_len;
+		w[i].reflector = cw[i].reflector;
+		w[i].next_in_set = &w[(i + 1) % h.wheels];
+		w[i].encode = at(base, cw[i].encode);
+		w[i].decode = at(base, cw[i].decode);
+		w[i].rot_encode = at(base, cw[i].rot_encode);
+		w[i].rot_decode = w[i].rot_encode ? w[i].rot_encode + al * al : NULL;
+		w[i].notch = at(base, cw[i].notch);
+		w[i].allow_slot = at(base, cw[i].allow_slot);
+	}
+	m->wheel_list = h.wheels ? w : NULL;
+
+	cache_slot *cs = at(base, h.slot);
+	m->slot = (wheelslot *)(w + h.wheels);
+	for (int i = 0; i < n; ++i) {
+		wheelslot *sl = &m->slot[i];
+		zero_slot(sl);
+		sl->w = cs[i].w >= 0 ? &w[cs[i].w] : NULL;
+		sl->rot = cs[i].rot;
+		sl->ringstellung = cs[i].ringstellung;
+		sl->step = cs[i].step;
+		sl->type = cs[i].type;
+		sl->affect_slots = cs[i].affect_slots;
+		sl->affect_slot = at(base, cs[i].affect_slot);
+		sl->pin_offset = cs[i].pin_offset;
+		sl->fast = cs[i].fast;
+		sl->movement = cs[i].movement;
+	}
+	m->utf8 = utf8_map(m);
+	step_cleanup(m);
+	return m;
+}
+
+/* The parser's allocations */
+static void free_parsed(machine *m) {
+	wheel *w = m->wheel_list;
+	if (w) do {
+		wheel *next = w->next_in_set;
+		free(w->name);
+		free(w->encode);
+		free(w->decode);
+		free(w->rot_encode);
+		free(w->notch);
+		free(w->allow_slot);
+		free(w);
+		w = next;
+	} while (w != m->wheel_list);
+	for (int i = 0; i < m->wheelslots; ++i) free(m->slot[i].affect_slot);
+	free((wchar_t *)m->name);
+	free((wchar_t *)m->alphabet);
+	free(m->utf8);
+	free(m->run);
+	free(m->run_maps);
+	free(m->enc_path);
+	free(m->slot);
+	free(m);
+}
+
+/* Pack a freshly parsed machine into a blob in memory, and free the parsed one */
+machine *compact_descr(machine *m) {
+	blob b = make_blob(m, NULL);
+	machine *c = blob_machine(b.buf);
+	free_parsed(m);
+	return c;
+}
+
+/*
+	The machine from the cache for 'filename', or NULL if there is no
+	cache or it is out of date. The machine is ready to use, like one from
+	parse_descr() with the default wheel order.
+*/
+machine *load_cached_descr(const char *filename) {
+	char *cache = cache_name(filename);
+	int fd = open(cache, O_RDONLY);
+	free(cache);
+	if (fd < 0) return NULL;
+	cache_header h;
+	struct stat st;
+	bool ok = read(fd, &h, sizeof(h)) == sizeof(h) && !memcmp(h.magic, cache_magic, sizeof(h.magic)) &&
+	          h.version == CACHE_VERSION && h.symbol_size == sizeof(symbol) && h.wchar_size == sizeof(wchar_t) &&
+	          !fstat(fd, &st) && st.st_size == h.size;
+	cache_source src;
+	if (ok) ok = source_info(filename, &src, false);
+	if (ok && (src.mtime_sec != h.source.mtime_sec || src.mtime_nsec != h.source.mtime_nsec || src.size != h.source.size)) {
+		/* Touched or copied, the cache is still good if the contents are the same */
+		ok = source_info(filename, &src, true) && src.size == h.source.size && src.hash == h.source.hash;
+	}
+	char *base = ok ? mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (base == MAP_FAILED) return NULL;
+	/* Offsets in a damaged blob could point anywhere, parse instead */
+	if (blob_hash(base, h.size) != h.hash) {
+		munmap(base, h.size);
+		return NULL;
+	}
+	return blob_machine(base);
+}
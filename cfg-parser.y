@@ -10,36 +10,38 @@
 #include <wchar.h>
 #include "enigma.h"
 
-extern int yylineno;
+#include "cfg-parser.h"
+#include "cfg-lexer.h"
 
-/*  Prototyper */
-int yylex(machine *m);
-
-/* Temporary variables: */
-wheelslot tmpslot;
-int tmp_ints = 0;
-int tmp_int[MAX_INT_SET];
-bool *tmp_slotlimit;
+/* The reentrant scanner gets its own state, it finds the parse state in its extra data */
+#ifndef yylex
+#define yylex cfglex
+#endif
+#define SCANNER ps->scanner
 
 /* Helper functions */
 
 
 /* Read the machine alphabet into the data structure */
-/* Validate, avoid duplicate letters 
-   Return 0 on success, or position of first duplicate */
-void read_alphabet(machine *m, const wchar_t *a) {
+/* Validate, avoid duplicate letters. 
+   The lookup tables keep the first position of a duplicate, so one pass finds them */
+void read_alphabet(parse_state *ps, const wchar_t *a) {
+	machine *m = ps->m;
+	size_t len = wcslen(a);
+	if (len > MAX_ALPHABET) {
+		yyerror(ps, "the alphabet has %zu characters, the limit is %i.\n", len, MAX_ALPHABET);
+		return;
+	}
 	m->alphabet = a;
-	int l, p;
-  for (; *a; ++a) {
-		l = lookup(*a, m->alphabet);
-		p = a-m->alphabet; 
+	m->alphabet_len = len;
+	m->utf8 = utf8_map(m);
+	for (int p = 0; p < m->alphabet_len; ++p) {
+		int l = alphabet_index(m, a[p]);
 		if (l != p) {
-			yyerror(m, "the alphabet has a duplicate in positions %i and %i.\n", l+1, p+1);
+			yyerror(ps, "the alphabet has a duplicate in positions %i and %i.\n", l+1, p+1);
 			return;
 		}
 	}
-	m->alphabet_len = p + 1;
-	return;
 }
 
 
@@ -55,49 +57,54 @@ void zero_slot(wheelslot *s) {
 	s->ringstellung = 0;
 	s->w = NULL;
 	s->pin_offset = 0;
+	s->run = -1;
 }
 
 /* Create & initialize wheelslots */
-void set_wheelslots(machine *m, int slots) {
+void set_wheelslots(parse_state *ps, int slots) {
+	machine *m = ps->m;
 	m->wheelslots = slots;
 	m->slot = malloc(slots * sizeof(wheelslot));
 	for (int i = m->wheelslots; i--;) zero_slot(&m->slot[i]);
-	zero_slot(&tmpslot);
+	zero_slot(&ps->tmpslot);
 	/* By default, any wheel can be put in any slot: */
-	tmp_slotlimit = malloc(slots * sizeof(bool));
-	for (int i = 0; i < slots; ++i) tmp_slotlimit[i] = true;
+	ps->tmp_slotlimit = malloc(slots * sizeof(bool));
+	for (int i = 0; i < slots; ++i) ps->tmp_slotlimit[i] = true;
 }
 
 
 /* Store temporary slot into machine description */
-void set_slot(machine *m, int slotnr) {
+void set_slot(parse_state *ps, int slotnr) {
+	machine *m = ps->m;
 	if (slotnr && slotnr <= m->wheelslots) {
-		memcpy(&m->slot[slotnr-1], &tmpslot, sizeof(wheelslot));
-	} else yyerror(m, "invalid slot number '%i', this machine has slots 1-%i\n", slotnr, m->wheelslots);
-	zero_slot(&tmpslot);
+		memcpy(&m->slot[slotnr-1], &ps->tmpslot, sizeof(wheelslot));
+	} else yyerror(ps, "invalid slot number '%i', this machine has slots 1-%i\n", slotnr, m->wheelslots);
+	zero_slot(&ps->tmpslot);
 }
 
 
 /* Sanity check before reading wheel descriptions */
-void wheel_precheck(machine *m) {
-	if (!m->alphabet) yyerror(m, "please specify the machine alhpabet before the code wheels.\n");
-	if (!m->wheelslots) yyerror(m, "wheels in a machine with 0 slots for them?\n");
+void wheel_precheck(parse_state *ps) {
+	machine *m = ps->m;
+	if (!m->alphabet) yyerror(ps, "please specify the machine alhpabet before the code wheels.\n");
+	if (!m->wheelslots) yyerror(ps, "wheels in a machine with 0 slots for them?\n");
 }
 
 
 /* Set up tmp_slotlimit from tmp_int */
-void set_restrictions(machine *m) {
+void set_restrictions(parse_state *ps) {
+	machine *m = ps->m;
 	bool warned = false;
 	/* Drop previously allowed slots */
-	for (int i = 0; i < m->wheelslots; ++i) tmp_slotlimit[i] = false;
+	for (int i = 0; i < m->wheelslots; ++i) ps->tmp_slotlimit[i] = false;
 	/* Allow the specified slots */
-	while (tmp_ints) {
-		--tmp_ints; 
-		if (tmp_int[tmp_ints] < 1 || tmp_int[tmp_ints] > m->wheelslots) {
-			if (!warned) yyerror(m, "slot number %i not in the 1-%i range\n", tmp_int[tmp_ints], m->wheelslots);
+	while (ps->tmp_ints) {
+		--ps->tmp_ints; 
+		if (ps->tmp_int[ps->tmp_ints] < 1 || ps->tmp_int[ps->tmp_ints] > m->wheelslots) {
+			if (!warned) yyerror(ps, "slot number %i not in the 1-%i range\n", ps->tmp_int[ps->tmp_ints], m->wheelslots);
 			warned = true; /* Avoid long series of error messages */
 		} else {
-			tmp_slotlimit[tmp_int[tmp_ints]-1] = true;
+			ps->tmp_slotlimit[ps->tmp_int[ps->tmp_ints]-1] = true;
 		}
 	}
 }
@@ -106,7 +113,8 @@ void set_restrictions(machine *m) {
 /* 
 	Make a new wheel, link it in. Most of the initialization happens later
 */
-void new_wheel(machine *m) {
+void new_wheel(parse_state *ps) {
+	machine *m = ps->m;
 	wheel *w = malloc(sizeof(wheel));
 	w->next_in_set = m->wheel_list;
 	m->wheel_list = w;
@@ -115,13 +123,14 @@ void new_wheel(machine *m) {
 
   /*Fill encode/decode with invalid indices, so the error checking
 	  during parisng will work right. */
-  int mapsize = sizeof(int)*m->alphabet_len;
+  int mapsize = sizeof(symbol)*m->alphabet_len;
 	w->encode = malloc(mapsize);
 	memset(w->encode, 255, mapsize);
 	w->decode = malloc(mapsize);
 	memset(w->decode, 255, mapsize);
 
 	w->notch = NULL;
+	w->rot_encode = w->rot_decode = NULL;
 }
 
 
@@ -129,10 +138,11 @@ void new_wheel(machine *m) {
 		Returns: true when all is ok, false if the name was taken 
 		Also make the next wheel to be filled out.
 */
-void name_wheel(machine *m, wchar_t *name, bool reflector) {
+void name_wheel(parse_state *ps, wchar_t *name, bool reflector) {
+	machine *m = ps->m;
 	wheel *w = wheel_lookup(m, name);
   if (w) {
-		yyerror(m, "cannot have two wheels both named %s\n", name);
+		yyerror(ps, "cannot have two wheels both named %s\n", name);
 		return;
 	}
 	w = m->wheel_list;
@@ -142,32 +152,37 @@ void name_wheel(machine *m, wchar_t *name, bool reflector) {
 	if (w->name_len > m->longest_wheelname) m->longest_wheelname = w->name_len;
 	int arrsiz = sizeof(bool) * m->wheelslots;
 	w->allow_slot = malloc(arrsiz);
-	memcpy(w->allow_slot, tmp_slotlimit, arrsiz);
+	memcpy(w->allow_slot, ps->tmp_slotlimit, arrsiz);
 
-	new_wheel(m);
+	new_wheel(ps);
 }
 
 
 /* Set up wiring for the last wheel created
    a character string specifies how the alphabet gets scrambled */
-void wheel_wiring(machine *m, wchar_t *wr) {
+void wheel_wiring(parse_state *ps, wchar_t *wr) {
+	machine *m = ps->m;
 	wheel *w = m->wheel_list;
 	int i;
 	for (i = 0; wr[i]; ++i) {
-		int nr = lookup(wr[i], m->alphabet);
+		if (i == m->alphabet_len) {
+			yyerror(ps, "wheel maps more letters than the machine alphabet have\n");
+			return;
+		}
+		int nr = alphabet_index(m, wr[i]);
 		if (nr == -1) {
-		yyerror(m, "attempt to wire letter «%lc» which is not in the machine alphabet\n", wr[i]);
+		yyerror(ps, "attempt to wire letter «%lc» which is not in the machine alphabet\n", wr[i]);
 			return;
 		}
 		/* now set up the connection */
     w->encode[i] = nr;
-		if (w->decode[nr] > -1) {
-			yyerror(m, "wheel maps several letters to «%lc»\n", m->alphabet[nr]);
+		if (w->decode[nr] != NO_SYMBOL) {
+			yyerror(ps, "wheel maps several letters to «%lc»\n", m->alphabet[nr]);
 			return;
 		}
 		w->decode[nr] = i;
 	}
-	if (i < m->alphabet_len) yyerror(m, "wheel don't map all of the machine alphabet\n");
+	if (i < m->alphabet_len) yyerror(ps, "wheel don't map all of the machine alphabet\n");
 	free(wr);
 }
 
@@ -175,48 +190,50 @@ void wheel_wiring(machine *m, wchar_t *wr) {
    Useful because some machines are documented using number mappings instead of symbols
    The first letter in the machine alphabet is "1", the second is "2" and so on.
 */
-void wheel_wiring_ints(machine *m) {
+void wheel_wiring_ints(parse_state *ps) {
+	machine *m = ps->m;
 	wheel *w = m->wheel_list;
 	/* Some sanity checks first: */
-	if (tmp_ints < m->alphabet_len) {
-		yyerror(m, "wheel don't map all of the machine alphabet\n");
-		tmp_ints = 0;
+	if (ps->tmp_ints < m->alphabet_len) {
+		yyerror(ps, "wheel don't map all of the machine alphabet\n");
+		ps->tmp_ints = 0;
 		return;
 	}
 
-	if (tmp_ints > m->alphabet_len) {
-		yyerror(m, "attempt to map more letters than the machine alphabet have?\n");
-		tmp_ints = 0;
+	if (ps->tmp_ints > m->alphabet_len) {
+		yyerror(ps, "attempt to map more letters than the machine alphabet have?\n");
+		ps->tmp_ints = 0;
 		return;
 	}
 
 	do {
-		--tmp_ints;
-		int nr = tmp_int[tmp_ints] - 1;
+		--ps->tmp_ints;
+		int nr = ps->tmp_int[ps->tmp_ints] - 1;
 		if (nr < 0 || nr >= m->alphabet_len) {
-			yyerror(m, "attempt to wire letter numbered %i, which is out of the 1-%i range.\n", nr+1, m->alphabet_len);
+			yyerror(ps, "attempt to wire letter numbered %i, which is out of the 1-%i range.\n", nr+1, m->alphabet_len);
 			continue;
 		}
-		w->encode[tmp_ints] = nr;
-		if (w->decode[nr] > -1) {
-			yyerror(m, "wheel maps several positions to position %i\n", nr+1);
+		w->encode[ps->tmp_ints] = nr;
+		if (w->decode[nr] != NO_SYMBOL) {
+			yyerror(ps, "wheel maps several positions to position %i\n", nr+1);
 			continue;
 		} 
-		w->decode[nr] = tmp_ints;
-	} while(tmp_ints);
+		w->decode[nr] = ps->tmp_ints;
+	} while(ps->tmp_ints);
 }
 
 /* Like wheel_wiring, but separate mappings for encipher & decipher */
-void wiring_encipher_decipher(machine *m, wchar_t *ench, wchar_t *dech) {
+void wiring_encipher_decipher(parse_state *ps, wchar_t *ench, wchar_t *dech) {
+	machine *m = ps->m;
 	int i;
 	wheel *w = m->wheel_list;
-	for (i = 0; ench[i] && dech[i]; ++i) {
-		int e = lookup(ench[i], m->alphabet), d = lookup(dech[i], m->alphabet);
-		if (e == -1 || d == -1) yyerror(m, "attempt to wire letters «%lc» and «%lc», one of which isn't in the machine alphabet\n", ench[i], dech[i]);
+	for (i = 0; ench[i] && dech[i] && i < m->alphabet_len; ++i) {
+		int e = alphabet_index(m, ench[i]), d = alphabet_index(m, dech[i]);
+		if (e == -1 || d == -1) yyerror(ps, "attempt to wire letters «%lc» and «%lc», one of which isn't in the machine alphabet\n", ench[i], dech[i]);
 		w->encode[i] = e;
 		w->decode[i] = d;
 	}
-	if (i < m->alphabet_len) yyerror(m, "wheel don't map all of the machine alphabet\n");
+	if (i < m->alphabet_len) yyerror(ps, "wheel don't map all of the machine alphabet\n");
 	free(ench);
 	free(dech);
 }
@@ -226,18 +243,19 @@ void wiring_encipher_decipher(machine *m, wchar_t *ench, wchar_t *dech) {
    identical as they both fith in the same datastructure.
 	 Notches/pins indicated by a string, noting the characters where such features are located.
 */
-void wheel_notches(machine *m, wchar_t *ws) {
+void wheel_notches(parse_state *ps, wchar_t *ws) {
+	machine *m = ps->m;
 	wheel *w = m->wheel_list;
 	if (w->notch) {
-		yyerror(m, "Wheel cannot have a second set of notches/pins.\n");
+		yyerror(ps, "Wheel cannot have a second set of notches/pins.\n");
 		return;
 	}
 	w->notch = calloc(m->alphabet_len, sizeof(bool));
 
   for (wchar_t *n = ws; *n; n++) {
-		int l = lookup(*n, m->alphabet);
+		int l = alphabet_index(m, *n);
 		if (l == -1) {
-			yyerror(m, "notch/pin at character '%lc' which is not in the machine alphabet?", *n);
+			yyerror(ps, "notch/pin at character '%lc' which is not in the machine alphabet?", *n);
 			return;
 		}
 		w->notch[l] = true;
@@ -246,84 +264,108 @@ void wheel_notches(machine *m, wchar_t *ws) {
 }
 
 /* Code-wheel notches/advance-blocking pins, specified using a list of integer positions */
-void wheel_notches_ints(machine *m) {
+void wheel_notches_ints(parse_state *ps) {
+	machine *m = ps->m;
 	/* Sanity checks */
-	if (tmp_ints > m->alphabet_len) {
-		yyerror(m, "More notches/pins than rotational positions?");
-		tmp_ints = 0;
+	if (ps->tmp_ints > m->alphabet_len) {
+		yyerror(ps, "More notches/pins than rotational positions?");
+		ps->tmp_ints = 0;
 		return;
 	}
 	wheel *w = m->wheel_list;
 	if (w->notch) {
-		yyerror(m, "Wheel cannot have a second set of notches/pins.\n");
+		yyerror(ps, "Wheel cannot have a second set of notches/pins.\n");
 		return;
 	}
 	w->notch = calloc(m->alphabet_len, sizeof(bool));
 
 	do {
-		--tmp_ints;
-		int l = tmp_int[tmp_ints] - 1;
+		--ps->tmp_ints;
+		int l = ps->tmp_int[ps->tmp_ints] - 1;
 		if (l < 0 || l >= m->alphabet_len) {
-			yyerror(m, "notch/pin number (%i) outside the 1-%i range.\n", l+1, m->alphabet_len);
+			yyerror(ps, "notch/pin number (%i) outside the 1-%i range.\n", l+1, m->alphabet_len);
 			continue;
 		}
 		w->notch[l] = true;
-	} while(tmp_ints);
+	} while(ps->tmp_ints);
 }
 
 /* Read an int belonging to a set of ints, put in tmp storage */
 /* Users of the set must zero out tmp_ints afterwards */
-void collect_an_int(machine *m, int x) {
-	if (tmp_ints >= MAX_INT_SET) {
-		yyerror(m, "more than %i integers on a line, program limitation.\n", MAX_INT_SET);
+void collect_an_int(parse_state *ps, int x) {
+	if (ps->tmp_ints >= MAX_INT_SET) {
+		yyerror(ps, "more than %i integers on a line, program limitation.\n", MAX_INT_SET);
 		return;
 	}
-	tmp_int[tmp_ints++] = x; 
+	ps->tmp_int[ps->tmp_ints++] = x; 
 }
 
 /* Read an integer range (such as 5-12) into a set of ints, put in tmp storage */
 /* Users of the set must zero out tmp_ints afterwards */
-void collect_int_range(machine *m, int from, int to) {
+void collect_int_range(parse_state *ps, int from, int to) {
 	if (from > to) {
-		yyerror(m, "invalid range, from %i up to %i?\n", from, to);
+		yyerror(ps, "invalid range, from %i up to %i?\n", from, to);
 		return;
 	}
-	if (tmp_ints + to - from >= MAX_INT_SET) {
-		yyerror(m, "too big range, program limitation\n");
+	if (ps->tmp_ints + to - from >= MAX_INT_SET) {
+		yyerror(ps, "too big range, program limitation\n");
 		return;
 	}
-	for (int i = from; i <= to; ++i) tmp_int[tmp_ints++] = i;
+	for (int i = from; i <= to; ++i) ps->tmp_int[ps->tmp_ints++] = i;
 }
 
 /* Register which slot(s) to spin when a notch comes up, or which to block when a pin appear */
 /* The info is already collected in the temporary integer set,
    put it in the temporary slot structure 
 	 Also reset the tmp_ints counter to 0 */
-void slot_affect_slots(machine *m) {
+void slot_affect_slots(parse_state *ps) {
+	machine *m = ps->m;
 	/* Is this an additional set of ints? */
-	if (tmpslot.affect_slot) {
-		tmpslot.affect_slot = realloc(tmpslot.affect_slot, sizeof(int) * (tmpslot.affect_slots + tmp_ints));
-	} else tmpslot.affect_slot = malloc(sizeof(int) * tmp_ints);
+	if (ps->tmpslot.affect_slot) {
+		ps->tmpslot.affect_slot = realloc(ps->tmpslot.affect_slot, sizeof(int) * (ps->tmpslot.affect_slots + ps->tmp_ints));
+	} else ps->tmpslot.affect_slot = malloc(sizeof(int) * ps->tmp_ints);
 	do {
-		if (tmp_int[--tmp_ints] > m->wheelslots) {
-			yyerror(m, "attempt to affect slot %i in a machine with only %i slots.\n", tmp_int[tmp_ints], m->wheelslots);
+		if (ps->tmp_int[--ps->tmp_ints] > m->wheelslots) {
+			yyerror(ps, "attempt to affect slot %i in a machine with only %i slots.\n", ps->tmp_int[ps->tmp_ints], m->wheelslots);
 		}  
-		tmpslot.affect_slot[tmpslot.affect_slots++] = tmp_int[tmp_ints]-1;
-	} while (tmp_ints);
+		ps->tmpslot.affect_slot[ps->tmpslot.affect_slots++] = ps->tmp_int[ps->tmp_ints]-1;
+	} while (ps->tmp_ints);
 }
 
 /* Get & validate a slot's pin/notch offset */
-void read_pin_offset(machine *m, int off) {
+void read_pin_offset(parse_state *ps, int off) {
+	machine *m = ps->m;
 	if (off >= m->alphabet_len) {
-		yyerror(m, "pin offset of %i shouldn't exceed the alphabet length (%i)\n", off, m->alphabet_len);
+		yyerror(ps, "pin offset of %i shouldn't exceed the alphabet length (%i)\n", off, m->alphabet_len);
 		return;
 	}
-	tmpslot.pin_offset = off;
+	ps->tmpslot.pin_offset = off;
 }
 
 %}
 
-%param {machine *m}
+%define api.pure full
+%parse-param {parse_state *ps}
+%lex-param {void *SCANNER}
+
+%code requires {
+#include "enigma.h"
+
+/* State while parsing one description. Nothing is global, so several
+   descriptions may be parsed at once, in different threads */
+typedef struct _parse_state {
+	machine *m;
+	void *scanner;		/* The flex scanner */
+	wheelslot tmpslot;
+	int tmp_ints;
+	int tmp_int[MAX_INT_SET];
+	bool *tmp_slotlimit;
+} parse_state;
+}
+
+%code provides {
+void yyerror(parse_state *ps, const char *s, ...);
+}
 
 %union {
 	int i;
@@ -345,7 +387,7 @@ void read_pin_offset(machine *m, int off) {
 
 machine:     
 	MACHINE WSTRING machine_details opt_slot_setup wheelset {
-		m->name = $2;
+		ps->m->name = $2;
 	}
 	;
 
@@ -355,10 +397,10 @@ machine_details:
 	;
 
 machine_detail:
-	ALPHABET WSTRING { read_alphabet(m,  $2); }      /* io-alphabet for this machine */
-	| WHEELSLOTS INTEGER { set_wheelslots(m, $2); }  /* # of wheel slots */
-	| STEPPING NOTCHES { m->steptype = T_NOTCH_ENABLING; } /* notch-based stepping */
-	| STEPPING PINS    { m->steptype = T_PIN_BLOCKING; }   /* stepping with blocking pins */
+	ALPHABET WSTRING { read_alphabet(ps,  $2); }      /* io-alphabet for this machine */
+	| WHEELSLOTS INTEGER { set_wheelslots(ps, $2); }  /* # of wheel slots */
+	| STEPPING NOTCHES { ps->m->steptype = T_NOTCH_ENABLING; } /* notch-based stepping */
+	| STEPPING PINS    { ps->m->steptype = T_PIN_BLOCKING; }   /* stepping with blocking pins */
 	;
 
 
@@ -397,7 +439,7 @@ slot_setup:
 
 /* Setup for one particular slot */
 slot:
-	SLOT INTEGER slot_details { set_slot(m, $2); }
+	SLOT INTEGER slot_details { set_slot(ps, $2); }
 	| SLOT INTEGER 
 	;
 
@@ -408,15 +450,15 @@ slot_details:
 	;
 
 slot_detail:	
-	FAST					{ tmpslot.fast = true; }
-	| REVERSE			{ tmpslot.step = m->alphabet_len - tmpslot.step;}
-	| NONROTATING	{ tmpslot.step = 0; }
-	| NOTCHES PUSH integers { slot_affect_slots(m); }
-	| PINS BLOCKS integers { slot_affect_slots(m); }
-	| REWIRABLE { tmpslot.type = T_REWIRABLE; }
-	|	PLUGBOARD { tmpslot.type = T_PAIRSWAP; }
-	| PINS OFFSET INTEGER { read_pin_offset(m, $3); }
-	| NOTCHES OFFSET INTEGER { read_pin_offset(m, $3); }
+	FAST					{ ps->tmpslot.fast = true; }
+	| REVERSE			{ ps->tmpslot.step = ps->m->alphabet_len - ps->tmpslot.step;}
+	| NONROTATING	{ ps->tmpslot.step = 0; }
+	| NOTCHES PUSH integers { slot_affect_slots(ps); }
+	| PINS BLOCKS integers { slot_affect_slots(ps); }
+	| REWIRABLE { ps->tmpslot.type = T_REWIRABLE; }
+	|	PLUGBOARD { ps->tmpslot.type = T_PAIRSWAP; }
+	| PINS OFFSET INTEGER { read_pin_offset(ps, $3); }
+	| NOTCHES OFFSET INTEGER { read_pin_offset(ps, $3); }
 	;
 
 /* one or more positive integers (or integer ranges) 
@@ -432,19 +474,19 @@ int_or_range:
 	| int_range
 	;
 
-one_int: INTEGER {collect_an_int(m, $1); } ;
+one_int: INTEGER {collect_an_int(ps, $1); } ;
 
-int_range: INTEGER '-' INTEGER {collect_int_range(m, $1, $3); } ;
+int_range: INTEGER '-' INTEGER {collect_int_range(ps, $1, $3); } ;
 
 /* The set of scrambler wheels */
-wheelset:    {wheel_precheck(m);new_wheel(m);}
+wheelset:    {wheel_precheck(ps);new_wheel(ps);}
 	wheel_or_restriction 
 	| wheelset wheel_or_restriction
 	;
 
 wheel_or_restriction:
 	wheel
-	| restriction {set_restrictions(m); }
+	| restriction {set_restrictions(ps); }
 	;
 
 /* Restriction (in what slots(s) can the wheel(s) following be used? */
@@ -456,9 +498,9 @@ restriction:
 
 /* One code wheel */
 wheel: 
-	WHEEL NAME wheel_spec 			{	name_wheel(m, $2, false); }
-	| REFLECTOR NAME wheel_spec	{ name_wheel(m, $2, true); }
-	| MAPPING NAME wheel_spec   { name_wheel(m, $2, false); } 
+	WHEEL NAME wheel_spec 			{	name_wheel(ps, $2, false); }
+	| REFLECTOR NAME wheel_spec	{ name_wheel(ps, $2, true); }
+	| MAPPING NAME wheel_spec   { name_wheel(ps, $2, false); } 
 	;
 
 wheel_spec: 
@@ -468,30 +510,45 @@ wheel_spec:
 
 /* Connectors & wiring for a wheel */
 wiring:
-	WIRING WSTRING { wheel_wiring(m, $2); }
-	| WIRING integers { wheel_wiring_ints(m); }
-	| ENCIPHER WSTRING DECIPHER WSTRING { wiring_encipher_decipher(m, $2, $4); }
-	| DECIPHER WSTRING ENCIPHER WSTRING { wiring_encipher_decipher(m, $4, $2); }
+	WIRING WSTRING { wheel_wiring(ps, $2); }
+	| WIRING integers { wheel_wiring_ints(ps); }
+	| ENCIPHER WSTRING DECIPHER WSTRING { wiring_encipher_decipher(ps, $2, $4); }
+	| DECIPHER WSTRING ENCIPHER WSTRING { wiring_encipher_decipher(ps, $4, $2); }
 	;
 
 /* wheel specific stepping features, such as 
    notches or advance-blocking pins */
 stepping: 
-	NOTCHES WSTRING { wheel_notches(m, $2); }
-	| NOTCHES integers {wheel_notches_ints(m); }
-	| PINS WSTRING { wheel_notches(m, $2); }
-	| PINS integers { wheel_notches_ints(m); }
+	NOTCHES WSTRING { wheel_notches(ps, $2); }
+	| NOTCHES integers {wheel_notches_ints(ps); }
+	| PINS WSTRING { wheel_notches(ps, $2); }
+	| PINS integers { wheel_notches_ints(ps); }
 	;
 
 
 %%
 
-void yyerror(machine *m, const char *s, ...) {
+void yyerror(parse_state *ps, const char *s, ...) {
 	va_list ap;
 	va_start(ap, s);
-	m->broken_description = true;
-  fprintf(stderr, "Line: %i, ", yylineno);
+	ps->m->broken_description = true;
+  fprintf(stderr, "Line: %i, ", cfgget_lineno(ps->scanner));
 	vfprintf(stderr, s, ap);
 	va_end(ap);
 	return;
 }
+
+
+/* Parse a machine description held in memory. Check broken_description afterwards */
+machine *parse_machine(const char *text, size_t len) {
+	parse_state ps;
+	memset(&ps, 0, sizeof(ps));
+	ps.m = calloc(1, sizeof(machine));
+	if (cfglex_init_extra(&ps, &ps.scanner)) feil("cannot set up the description scanner\n");
+	cfg_scan_bytes(text, len, ps.scanner);
+	cfgset_lineno(1, ps.scanner);	/* The new buffer's line count is not set up */
+	yyparse(&ps);
+	cfglex_destroy(ps.scanner);
+	free(ps.tmp_slotlimit);
+	return ps.m;
+}
@@ -0,0 +1,321 @@
+/*
+	emit.c
+	--emit-c writes a C engine for one machine description. Alphabet length,
+	slots, stepping rules and wheel wirings become constants, and the
+	stepping and the signal path are written out slot by slot, so the
+	compiler sees no loops over slots and no flags to test.
+
+	The key stays variable: wheel choice, rotations, ring settings and the
+	wiring of plugboards and other rewirable slots, starting out as the
+	description's default. Neighbouring slots that never turn while typing
+	are folded into one map when the key is set, like the slot runs of
+	build_paths().
+	Wheels have a table for each rotation as wheel_tables() makes them, for
+	alphabets up to ROT_TABLE_MAX. Longer alphabets, and rotating rewirable
+	slots, use compare and subtract instead of division.
+
+	The generated file has a main() for (de)ciphering stdin to stdout,
+	leave it out with -DEMITTED_NO_MAIN to use the engine from other code.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "enigma.h"
+
+/* A run of slots that don't turn, composed into one map by emitted_settle() */
+typedef struct {
+	int first, last;
+	bool reflecting;	/* Starts at slot 0 with a reflector: the map goes there and back */
+} emitrun;
+
+typedef struct {
+	machine *m;
+	FILE *f;
+	int *wiring;			/* Index among the rewirable slots, -1 for wheel slots */
+	int *run_of;			/* Run of each slot, -1 for slots that turn */
+	emitrun *run;
+	int runs;
+	bool reflecting;
+	bool rot_tables;	/* Per rotation tables for the wheel slots */
+} emitter;
+
+/* Wheels in the description, wheel_list is an array */
+static int wheel_count(machine *m) {
+	int n = 0;
+	wheel *w = m->wheel_list;
+	do ++n; while ((w = w->next_in_set) != m->wheel_list);
+	return n;
+}
+
+static void emit_row(FILE *f, const symbol *s, int al) {
+	fwprintf(f, L"{");
+	for (int i = 0; i < al; ++i) fwprintf(f, L"%s%i", i ? "," : "", s[i]);
+	fwprintf(f, L"}");
+}
+
+/* The mapping of slot i, as an expression on emitted_key *k */
+static void emit_map(emitter *e, int i, bool decode) {
+	if (e->wiring[i] < 0) fwprintf(e->f, L"wheel_%s[k->wheel[%i]]", decode ? "decode" : "encode", i);
+	else fwprintf(e->f, L"k->wire_%s[%i]", decode ? "decode" : "encode", e->wiring[i]);
+}
+
+/* One turning slot of a signal path */
+static void emit_stage(emitter *e, int i, bool decode) {
+	if (e->rot_tables && e->wiring[i] < 0) {
+		fwprintf(e->f, L"\t\tl = wheel_rot_%s[k->wheel[%i]][o%i][l];\n", decode ? "decode" : "encode", i, i);
+		return;
+	}
+	fwprintf(e->f, L"\t\tl = through(");
+	emit_map(e, i, decode);
+	fwprintf(e->f, L", o%i, l);\n", i);
+}
+
+/* Right to left through slots hi..lo, like path_forward() */
+static void emit_forward(emitter *e, int hi, int lo) {
+	for (int i = hi; i >= lo; --i) {
+		int r = e->run_of[i];
+		if (r < 0) emit_stage(e, i, false);
+		else {
+			fwprintf(e->f, L"\t\tl = k->run_fwd[%i][l];\n", r);
+			i = e->run[r].first;
+		}
+	}
+}
+
+/* Left to right through slots lo..hi, like path_backward() */
+static void emit_backward(emitter *e, int lo, int hi) {
+	for (int i = lo; i <= hi; ++i) {
+		int r = e->run_of[i];
+		if (r < 0) emit_stage(e, i, true);
+		else {
+			fwprintf(e->f, L"\t\tl = k->run_back[%i][l];\n", r);
+			i = e->run[r].last;
+		}
+	}
+}
+
+/* One of emitted_encipher() and emitted_decipher() */
+static void emit_path(emitter *e, bool enciphering) {
+	machine *m = e->m;
+	int n = m->wheelslots;
+	FILE *f = e->f;
+	fwprintf(f, L"void emitted_%s(emitted_key *k, const uint16_t *in, uint16_t *out, size_t n) {\n", enciphering ? "encipher" : "decipher");
+	fwprintf(f, L"\tfor (size_t c = 0; c < n; ++c) {\n\t\tturn(k);\n");
+	for (int i = 0; i < n; ++i) if (e->run_of[i] < 0) fwprintf(f, L"\t\tint o%i = offset(k, %i);\n", i, i);
+	fwprintf(f, L"\t\tint l = in[c];\n");
+	if (!e->reflecting) {
+		if (enciphering) emit_forward(e, n - 1, 0);
+		else emit_backward(e, 0, n - 1);
+	} else {
+		/* The reflecting run has the encipher map as run_fwd, the decipher map as run_back */
+		int lo = e->run_of[0] >= 0 ? e->run[e->run_of[0]].last + 1 : 1;
+		emit_forward(e, n - 1, lo);
+		if (e->run_of[0] >= 0) fwprintf(f, L"\t\tl = k->run_%s[%i][l];\n", enciphering ? "fwd" : "back", e->run_of[0]);
+		else emit_stage(e, 0, !enciphering);
+		emit_backward(e, lo, n - 1);
+	}
+	fwprintf(f, L"\t\tout[c] = l;\n\t}\n}\n\n");
+}
+
+/* Composing the runs, in emitted_settle() */
+static void emit_compose(emitter *e) {
+	FILE *f = e->f;
+	for (int r = 0; r < e->runs; ++r) {
+		emitrun *run = &e->run[r];
+		for (int back = 0; back < 2; ++back) {
+			fwprintf(f, L"\tfor (int l = 0; l < AL; ++l) {\n\t\tint x = l;\n");
+			if (run->reflecting) {
+				for (int i = run->last; i > 0; --i) fwprintf(f, L"\t\tx = slot_map(k, %i, false, x);\n", i);
+				fwprintf(f, L"\t\tx = slot_map(k, 0, %s, x);\n", back ? "true" : "false");
+				for (int i = 1; i <= run->last; ++i) fwprintf(f, L"\t\tx = slot_map(k, %i, true, x);\n", i);
+			} else if (!back) {
+				for (int i = run->last; i >= run->first; --i) fwprintf(f, L"\t\tx = slot_map(k, %i, false, x);\n", i);
+			} else {
+				for (int i = run->first; i <= run->last; ++i) fwprintf(f, L"\t\tx = slot_map(k, %i, true, x);\n", i);
+			}
+			fwprintf(f, L"\t\tk->run_%s[%i][l] = x;\n\t}\n", back ? "back" : "fwd", r);
+		}
+	}
+}
+
+/* Write a C engine for the machine, with its current settings as the default key */
+void emit_c(machine *m, FILE *f) {
+	int al = m->alphabet_len, n = m->wheelslots, wheels = wheel_count(m), wirings = 0;
+	bool pins = m->steptype == T_PIN_BLOCKING;
+	/* Without a stepping line notches do nothing, only fast slots turn */
+	bool stepping = m->steptype != T_NONE;
+	int wiring[n], run_of[n];
+	emitrun run[n];
+	emitter e = {m, f, wiring, run_of, run, 0, n && m->slot[0].w->reflector, al <= ROT_TABLE_MAX};
+	for (int i = 0; i < n; ++i) wiring[i] = m->slot[i].type == T_WHEEL ? -1 : wirings++;
+
+	/* The path depends on a reflector in slot 0, it must not depend on the wheel choice */
+	for (int w = 0; w < wheels; ++w) {
+		wheel *wh = &m->wheel_list[w];
+		if (n && wh->allow_slot[0] && wh->reflector != e.reflecting) feil("--emit-c needs the wheels for the first slot to be all reflectors, or none\n");
+	}
+	/* Slots that can turn while typing. On a notch machine a slot no notch pushes never does */
+	bool moving[n];
+	for (int i = 0; i < n; ++i) moving[i] = m->slot[i].step && (m->slot[i].fast || pins);
+	for (int i = 0; i < n; ++i) if (stepping && m->slot[i].step) for (int j = m->slot[i].affect_slots; j--; ) {
+		int a = m->slot[i].affect_slot[j];
+		moving[a] = m->slot[a].step;
+	}
+	/* Tables only for what the machine uses */
+	bool notches = false, turning_wheels = false;
+	for (int i = 0; i < n; ++i) {
+		notches |= stepping && m->slot[i].step && m->slot[i].affect_slots;
+		turning_wheels |= moving[i] && wiring[i] < 0;
+	}
+	e.rot_tables &= turning_wheels;
+	for (int i = 0; i < n; ++i) {
+		run_of[i] = -1;
+		if (moving[i]) continue;
+		emitrun *r = &run[e.runs];
+		r->first = r->last = i;
+		r->reflecting = e.reflecting && i == 0;
+		while (r->last + 1 < n && !moving[r->last + 1]) ++r->last;
+		for (int j = r->first; j <= r->last; ++j) run_of[j] = e.runs;
+		++e.runs;
+		i = r->last;
+	}
+
+	fwprintf(f, L"/*\n\tGenerated by enigma --emit-c from the description of \"%ls\".\n", m->name);
+	fwprintf(f, L"\tAlphabet: %ls\n\n", m->alphabet);
+	fwprintf(f, L"\tgcc -O2 -std=gnu11 -o engine engine.c\n\tengine [-d] < in > out\n\n");
+	fwprintf(f, L"\tenciphers (or with -d deciphers) stdin to stdout with the description's\n");
+	fwprintf(f, L"\tdefault key. With -DEMITTED_NO_MAIN, use emitted_encipher() and\n");
+	fwprintf(f, L"\temitted_decipher() on alphabet indices. Call emitted_settle() after\n");
+	fwprintf(f, L"\tsetting a key, as after step_cleanup().\n*/\n\n");
+	fwprintf(f, L"#include <stdbool.h>\n#include <stdint.h>\n#include <stddef.h>\n#include <wchar.h>\n\n");
+	fwprintf(f, L"#define AL %i\t\t/* Alphabet length */\n#define SLOTS %i\n#define WHEELS %i\n", al, n, wheels);
+	fwprintf(f, L"#define WIRINGS %i\t/* Rewirable slots */\n#define RUNS %i\t\t/* Runs of slots that don't turn */\n\n", wirings, e.runs);
+
+	fwprintf(f, L"const wchar_t emitted_alphabet[AL] = {");
+	for (int i = 0; i < al; ++i) fwprintf(f, L"%s0x%x", i ? "," : "", (unsigned)m->alphabet[i]);
+	fwprintf(f, L"};\n\n/* By position in the description's wheel set */\n");
+	for (int d = 0; d < 2; ++d) {
+		fwprintf(f, L"static const uint16_t wheel_%s[WHEELS][AL] = {\n", d ? "decode" : "encode");
+		for (int w = 0; w < wheels; ++w) {
+			fwprintf(f, L"\t");
+			emit_row(f, d ? m->wheel_list[w].decode : m->wheel_list[w].encode, al);
+			if (!d && m->wheel_list[w].name) fwprintf(f, L",\t/* %ls */\n", m->wheel_list[w].name);
+			else fwprintf(f, L",\n");
+		}
+		fwprintf(f, L"};\n\n");
+	}
+	/* As wheel_tables(), indexed by [wheel][rotation - ring setting][letter] */
+	if (e.rot_tables) for (int d = 0; d < 2; ++d) {
+		fwprintf(f, L"static const uint8_t wheel_rot_%s[WHEELS][AL][AL] = {\n", d ? "decode" : "encode");
+		for (int w = 0; w < wheels; ++w) {
+			const symbol *map = d ? m->wheel_list[w].decode : m->wheel_list[w].encode;
+			fwprintf(f, L"\t{\n");
+			for (int k = 0; k < al; ++k) {
+				fwprintf(f, L"\t\t{");
+				for (int l = 0; l < al; ++l) fwprintf(f, L"%s%i", l ? "," : "", (map[(l + k) % al] - k + al) % al);
+				fwprintf(f, L"},\n");
+			}
+			fwprintf(f, L"\t},\n");
+		}
+		fwprintf(f, L"};\n\n");
+	}
+	if (notches) {
+		fwprintf(f, L"/* Notches, or blocking pins */\nstatic const bool wheel_notch[WHEELS][AL] = {\n");
+		for (int w = 0; w < wheels; ++w) {
+			const bool *notch = m->wheel_list[w].notch;
+			fwprintf(f, L"\t{");
+			for (int i = 0; i < al; ++i) fwprintf(f, L"%s%i", i ? "," : "", notch && notch[i]);
+			fwprintf(f, L"},\n");
+		}
+		fwprintf(f, L"};\n\n");
+	}
+	fwprintf(f, L"/* Index among the rewirable slots, -1 for wheel slots */\nstatic const int slot_wiring[SLOTS] = {");
+	for (int i = 0; i < n; ++i) fwprintf(f, L"%s%i", i ? "," : "", wiring[i]);
+	fwprintf(f, L"};\n\n");
+
+	fwprintf(f, L"typedef struct {\n\tuint16_t wheel[SLOTS];\t\t/* Position in the wheel set, for wheel slots */\n");
+	fwprintf(f, L"\tint rot[SLOTS], ring[SLOTS];\n\tbool movement[SLOTS];\n");
+	fwprintf(f, L"\tuint16_t wire_encode[WIRINGS][AL], wire_decode[WIRINGS][AL];\t/* Rewirable slots, in slot order */\n");
+	fwprintf(f, L"\tuint16_t run_fwd[RUNS][AL], run_back[RUNS][AL];\t/* Set by emitted_settle() */\n");
+	fwprintf(f, L"} emitted_key;\n\n");
+
+	fwprintf(f, L"const emitted_key emitted_default = {\n\t.wheel = {");
+	for (int i = 0; i < n; ++i) fwprintf(f, L"%s%i", i ? "," : "", wiring[i] < 0 ? (int)(m->slot[i].w - m->wheel_list) : 0);
+	fwprintf(f, L"},\n\t.rot = {");
+	for (int i = 0; i < n; ++i) fwprintf(f, L"%s%i", i ? "," : "", m->slot[i].rot);
+	fwprintf(f, L"},\n\t.ring = {");
+	for (int i = 0; i < n; ++i) fwprintf(f, L"%s%i", i ? "," : "", m->slot[i].ringstellung);
+	for (int d = 0; d < 2; ++d) {
+		fwprintf(f, L"},\n\t.wire_%s = {", d ? "decode" : "encode");
+		for (int i = 0; i < n; ++i) if (wiring[i] >= 0) {
+			emit_row(f, d ? m->slot[i].w->decode : m->slot[i].w->encode, al);
+			fwprintf(f, L",");
+		}
+	}
+	fwprintf(f, L"}\n};\n\n");
+
+	fwprintf(f, L"static inline int offset(const emitted_key *k, int i) {\n\tint off = k->rot[i] - k->ring[i];\n");
+	fwprintf(f, L"\treturn off < 0 ? off + AL : off;\n}\n\n");
+	fwprintf(f, L"/* Through one slot turned off steps: (map[(l + off) %% AL] - off) %% AL */\n");
+	fwprintf(f, L"static inline int through(const uint16_t *map, int off, int l) {\n\tint i = l + off;\n");
+	fwprintf(f, L"\tif (i >= AL) i -= AL;\n\tint x = map[i] - off;\n\treturn x < 0 ? x + AL : x;\n}\n\n");
+	fwprintf(f, L"static inline int slot_map(const emitted_key *k, int i, bool decode, int l) {\n\tint w = slot_wiring[i];\n");
+	fwprintf(f, L"\tif (w < 0) return through(decode ? wheel_decode[k->wheel[i]] : wheel_encode[k->wheel[i]], offset(k, i), l);\n");
+	fwprintf(f, L"\treturn through(decode ? k->wire_decode[w] : k->wire_encode[w], offset(k, i), l);\n}\n\n");
+
+	/* post_step(), for the slots with notches or pins that act on something. No branches, pins come up at random */
+	fwprintf(f, L"static inline void post_step(emitted_key *k) {\n");
+	if (!notches) fwprintf(f, L"\t(void)k;\n");
+	for (int i = n; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (!stepping || !s->step || !s->affect_slots) continue;
+		fwprintf(f, L"\t{\n\t\tint p = k->rot[%i]", i);
+		if (s->pin_offset) fwprintf(f, L" + %i;\n\t\tif (p >= AL) p -= AL", s->pin_offset);
+		fwprintf(f, L";\n\t\tbool up = wheel_notch[");
+		if (wiring[i] < 0) fwprintf(f, L"k->wheel[%i]", i);
+		else fwprintf(f, L"%i", (int)(s->w - m->wheel_list));
+		fwprintf(f, L"][p];\n");
+		for (int j = s->affect_slots; j--; ) fwprintf(f, L"\t\tk->movement[%i] %s;\n", s->affect_slot[j], pins ? "&= !up" : "|= up");
+		fwprintf(f, L"\t}\n");
+	}
+	fwprintf(f, L"}\n\n");
+
+	/* turn_wheels() */
+	fwprintf(f, L"static inline void turn(emitted_key *k) {\n");
+	for (int i = n; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (!moving[i]) continue;
+		if (s->fast) fwprintf(f, L"\tk->rot[%i] += %i;\n", i, s->step);
+		else if (s->step == 1) fwprintf(f, L"\tk->rot[%i] += k->movement[%i];\n", i, i);
+		else fwprintf(f, L"\tk->rot[%i] += k->movement[%i] * %i;\n", i, i, s->step);
+		fwprintf(f, L"\tif (k->rot[%i] >= AL) k->rot[%i] -= AL;\n\tk->movement[%i] = %s;\n", i, i, i, pins ? "true" : "false");
+	}
+	fwprintf(f, L"\tpost_step(k);\n}\n\n");
+
+	fwprintf(f, L"/* Movement flags and composed runs for the key, after setting it */\nvoid emitted_settle(emitted_key *k) {\n");
+	fwprintf(f, L"\tfor (int i = 0; i < SLOTS; ++i) k->movement[i] = %s;\n\tpost_step(k);\n", pins ? "true" : "false");
+	emit_compose(&e);
+	fwprintf(f, L"}\n\n");
+
+	emit_path(&e, true);
+	emit_path(&e, false);
+
+	fwprintf(f, L"/* Alphabet index of c, -1 if not in the alphabet */\nint emitted_index(wchar_t c) {\n\tswitch (c) {\n");
+	for (int i = 0; i < al; ++i) fwprintf(f, L"\tcase 0x%x: return %i;\n", (unsigned)m->alphabet[i], i);
+	fwprintf(f, L"\tdefault: return -1;\n\t}\n}\n\n");
+
+	/* Characters outside the alphabet pass through, and don't step the machine */
+	fwprintf(f, L"#ifndef EMITTED_NO_MAIN\n#include <stdio.h>\n#include <string.h>\n#include <locale.h>\n\n");
+	fwprintf(f, L"int main(int argc, char *argv[]) {\n\tbool enciphering = argc < 2 || strcmp(argv[1], \"-d\");\n");
+	fwprintf(f, L"\tif (!setlocale(LC_ALL, \"\")) return 1;\n\temitted_key k = emitted_default;\n\temitted_settle(&k);\n");
+	fwprintf(f, L"\twchar_t line[4096];\n\tuint16_t sym[4096];\n\tsize_t pos[4096];\n");
+	fwprintf(f, L"\twhile (fgetws(line, 4096, stdin)) {\n\t\tsize_t n = 0;\n");
+	fwprintf(f, L"\t\tfor (size_t i = 0; line[i]; ++i) {\n\t\t\tint l = emitted_index(line[i]);\n");
+	fwprintf(f, L"\t\t\tif (l >= 0) {\n\t\t\t\tsym[n] = l;\n\t\t\t\tpos[n++] = i;\n\t\t\t}\n\t\t}\n");
+	fwprintf(f, L"\t\tif (enciphering) emitted_encipher(&k, sym, sym, n);\n\t\telse emitted_decipher(&k, sym, sym, n);\n");
+	fwprintf(f, L"\t\tfor (size_t i = 0; i < n; ++i) line[pos[i]] = emitted_alphabet[sym[i]];\n");
+	fwprintf(f, L"\t\tfputws(line, stdout);\n\t}\n\treturn 0;\n}\n#endif\n");
+}
@@ -10,24 +10,17 @@
 	© 2015 Helge Hafting, licenced under the GPL
 */
 
-/*
-  Necessary define, or ncurses won't provide get_wch() with gcc -std=gnu11 
-  or c99/c11 for that matter. Strangely, the #define is not necessary 
-	without c99...
-*/
-#define _XOPEN_SOURCE_EXTENDED 1
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <locale.h> 
 #include <wctype.h>
 #include <wchar.h>
-#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "enigma.h"
-#include "cfg-parser.h"
-extern FILE *yyin;
 
 /* Give error message and abort immediately */
 void feil(char *m) {
@@ -37,15 +30,6 @@ void feil(char *m) {
 
 /* Helper functions */
 
-/* 
-	Cuts off the first part of a wide string
-  Zero out the rest, as other code needs that.                 
-*/
-void leftcut(wchar_t *ws, int cutaway, int keep) {
-	wmemmove(ws, ws+cutaway, keep);
-	wmemset(ws+keep, 0, cutaway);
-}
-
 /* Allocates a new wide string, fills it from a plain string
    returns the wide string, or 0 on failure. */
 wchar_t *mbstowcsdup(const char *s) {
@@ -60,21 +44,6 @@ wchar_t *mbstowcsdup(const char *s) {
 }
 
 
-/* Lookup a characters position in a wide string 
-   A hash table lookup has lower complexity, but most 
-   alphabets are so short that the linear lookup is faster than
-   a good hash function anyway.  
-   (Unless you make a rotor with the entire Chinese character set...)
-*/
-int lookup(const wchar_t wc, const wchar_t *ws) {
-	const wchar_t *wx = ws;
-	for(;;) {
-		if (!*wx) return -1;
-		if (*wx == wc) return wx - ws;
-		++wx;
-	} 
-}
-
 /* Functions used to build the machine description */
 
 /* 
@@ -106,16 +75,10 @@ void circularize(wheel *w0) {
 	w->next_in_set = w0;
 }
 
-/* Open the machine description file & parse it */
-machine *getdescr(char *filename) {
-  FILE *f = fopen(filename, "r");
-	if (!f) feil("file error\n");
-  machine *m = calloc(1, sizeof(machine));
-
+/* Parse a machine description held in memory, and make it ready for use */
+machine *descr_from_text(const char *text, size_t len) {
   //Parse the machine description
-	yyin = f;
-  yyparse(m);
-  fclose(f);
+  machine *m = parse_machine(text, len);
 	if (m->broken_description) {
 		free(m);
 		return NULL;
@@ -133,9 +96,129 @@ machine *getdescr(char *filename) {
 	/* set a default wheel order, so the machine is instantly useable */
 	default_wheelorder(m);	
 
+	/* Pack it, so it is cheap to share and clone */
+	return compact_descr(m);
+}
+
+/* Open the machine description file & parse it. NULL if it cannot be read or parsed */
+machine *parse_descr(char *filename) {
+  FILE *f = fopen(filename, "r");
+	if (!f) return NULL;
+	size_t len = 0, size = 4096;
+	char *text = malloc(size);
+	for (size_t r; text && (r = fread(text + len, 1, size - len, f)); ) {
+		len += r;
+		if (len == size) {
+			char *more = realloc(text, size *= 2);
+			if (!more) free(text);
+			text = more;
+		}
+	}
+  fclose(f);
+	if (!text) return NULL;
+	machine *m = descr_from_text(text, len);
+	free(text);
 	return m;
 }
 
+/* The machine from its compiled cache if that is up to date, else parsed */
+machine *getdescr(char *filename) {
+	machine *m = load_cached_descr(filename);
+	return m ? m : parse_descr(filename);
+}
+
+
+/* 
+	A copy of the machine with its own slots and signal paths, for use in
+	another thread. The code wheels are shared, so they must not be rewired 
+	while copies are in use. Plugboards and other rewirable slots get private
+	copies of their wheels, so each clone can be rewired on its own.
+	The machine, slots and private wheels are one allocation.
+*/
+machine *machine_clone(machine *m) {
+	int n = m->wheelslots, al = m->alphabet_len, own = 0;
+	for (int i = 0; i < n; ++i) own += m->slot[i].type != T_WHEEL;
+	size_t wsize = sizeof(wheel) + 2 * al * sizeof(symbol) + (al <= ROT_TABLE_MAX ? 2 * al * al * sizeof(symbol) : 0);
+	wsize = (wsize + 7) & ~(size_t)7;
+	machine *c = malloc(sizeof(machine) + n * sizeof(wheelslot) + own * wsize);
+	*c = *m;
+	c->slot = (wheelslot *)(c + 1);
+	memcpy(c->slot, m->slot, n * sizeof(wheelslot));
+	char *p = (char *)(c->slot + n);
+	for (int i = 0; i < n; ++i) {
+		wheelslot *sl = &c->slot[i];
+		if (sl->type == T_WHEEL) continue;
+		wheel *w = (wheel *)p;
+		*w = *sl->w;
+		w->encode = (symbol *)(w + 1);
+		w->decode = w->encode + al;
+		w->rot_encode = w->rot_decode = NULL;
+		memcpy(w->encode, sl->w->encode, al * sizeof(symbol));
+		memcpy(w->decode, sl->w->decode, al * sizeof(symbol));
+		if (al <= ROT_TABLE_MAX) {
+			w->rot_encode = w->decode + al;
+			w->rot_decode = w->rot_encode + al * al;
+			if (sl->w->rot_encode) memcpy(w->rot_encode, sl->w->rot_encode, 2 * al * al * sizeof(symbol));
+			else wheel_tables(m, w);
+		}
+		sl->w = w;
+		p += wsize;
+	}
+	c->run = NULL;
+	c->steps = NULL;
+	c->step_count = 0;
+	build_paths(c);
+	return c;
+}
+
+void free_clone(machine *c) {
+	step_table_free(c->steps);
+	free(c->run);
+	free(c->run_maps);
+	free(c->enc_path);
+	free(c);
+}
+
+
+/* Wheel orders, see wheel_orders() */
+static void find_orders(machine *m, wheel **cur, int slot, bool reuse, wheel ***orders, int *count) {
+	int n = m->wheelslots;
+	if (slot == n) {
+		*orders = realloc(*orders, (*count + 1) * n * sizeof(wheel *));
+		memcpy(*orders + (*count)++ * n, cur, n * sizeof(wheel *));
+		return;
+	}
+	if (m->slot[slot].type != T_WHEEL) {
+		cur[slot] = m->slot[slot].w;
+		find_orders(m, cur, slot + 1, reuse, orders, count);
+		return;
+	}
+	wheel *w = m->wheel_list;
+	do {
+		bool used = false;
+		for (int i = 0; i < slot && !reuse; ++i) used |= cur[i] == w && m->slot[i].type == T_WHEEL;
+		if (w->allow_slot[slot] && !used) {
+			cur[slot] = w;
+			find_orders(m, cur, slot + 1, reuse, orders, count);
+		}
+		w = w->next_in_set;
+	} while (w != m->wheel_list);
+}
+
+/*
+	All ways to fill the T_WHEEL slots with wheels they allow, each wheel used
+	once if there are enough of them. Returns *count arrays of wheelslots
+	wheels. Other slots keep their current wheel.
+*/
+wheel **wheel_orders(machine *m, int *count) {
+	wheel *cur[m->wheelslots];
+	wheel **orders = NULL;
+	*count = 0;
+	find_orders(m, cur, 0, false, &orders, count);
+	if (!*count) find_orders(m, cur, 0, true, &orders, count);
+	return orders;
+}
+
 
 /* Code wheel functions */
 
@@ -145,6 +228,33 @@ void identity_map(machine *m, wheel *w) {
 }
 
 
+/* 
+	Precompute the wheel's mappings for every rotation, so the signal path needs
+	no modulo arithmetic. Built when the wheel is first put in a slot, 
+	and again if the wheel is rewired. 
+	The tables grow with the square of the alphabet, so long alphabets go 
+	without, and slot_encode() computes the mapping instead.
+*/
+void wheel_tables(machine *m, wheel *w) {
+	int al = m->alphabet_len;
+	if (al > ROT_TABLE_MAX) return;
+	if (!w->rot_encode) {
+		w->rot_encode = malloc(2 * al * al * sizeof(symbol));
+		w->rot_decode = w->rot_encode + al * al;
+	}
+	for (int k = 0; k < al; ++k) {
+		symbol *e = w->rot_encode + k * al, *d = w->rot_decode + k * al;
+		for (int l = 0, i = k; l < al; ++l) {
+			/* i is (l + k) % al */
+			int x = w->encode[i] - k, y = w->decode[i] - k;
+			e[l] = x < 0 ? x + al : x;
+			d[l] = y < 0 ? y + al : y;
+			if (++i == al) i = 0;
+		}
+	}
+}
+
+
 /* Lookup a wheel by name, or return 0 */
 wheel *wheel_lookup(machine *m, wchar_t *name) {
 	for (wheel *w = m->wheel_list; w; w = w->next_in_set) {
@@ -155,93 +265,480 @@ wheel *wheel_lookup(machine *m, wchar_t *name) {
 }
 
 
-/* 
-	Workaround for a stupid bug. (curses 5.9, linux 64 bit, march 2015) 
-	refresh() and friends do not display ANYTHING until after the first getch()
-	Very dumb, as I want to set up the screen and THEN wait for input.
-	curses is apparently INCAPABLE of doing this. It HAS TO have a single getch()
-	before I can display anything in windows. Incredibly annoying.
-	I don't want to start the UI with black screen until the first keypress, 
-	so the ugly solution is a single nodelay getch() before the main loop :-(
-
-  Even worse - the bug re-appear when I resize rxvt. 
-	(run rxvt locally, ssh to another host to run this software)
-	Whenever I make the rxvt smaller, the display is black until the first getch
-	Doesn't happen if I extend the rxvt. How do such odd bugs happen :-(
-*/
-
-void curses_bug_workaround() {
-	nodelay(stdscr,true);getch();nodelay(stdscr,false);
-}
-
 /*
-	ncurses-based user interface
-	Shows typed text as well as encoded/decoded text
-	Shows the code wheels and how they move	
+	Compile pin-blocking stepping into bit masks, when the machine has at most
+	64 slots and letters. Each slot gets the rotations where a pin is up,
+	with the pin offset applied, and the slots those pins block. 
+	Redone by step_cleanup(), as wheels and slots may have changed.
 */
+static void pin_masks(machine *m) {
+	int al = m->alphabet_len, n = m->wheelslots;
+	m->pin_masks = m->steptype == T_PIN_BLOCKING && al <= 64 && n <= 64;
+	if (!m->pin_masks) return;
+	m->pin_slots = m->step_slots = m->fast_slots = 0;
+	for (int i = 0; i < n; ++i) {
+		wheelslot *s = &m->slot[i];
+		s->pins = s->blocks = 0;
+		if (!s->step) continue;
+		m->step_slots |= 1ULL << i;
+		if (s->fast) m->fast_slots |= 1ULL << i;
+		if (!s->w->notch) continue;
+		for (int r = 0; r < al; ++r) if (s->w->notch[(r + s->pin_offset) % al]) s->pins |= 1ULL << r;
+		for (int j = s->affect_slots; j--; ) s->blocks |= 1ULL << s->affect_slot[j];
+		if (s->pins && s->blocks) m->pin_slots |= 1ULL << i;
+	}
+}
 
-/* Draw the rotating part of one wheel */
-void draw_wheel_rot(machine *m, ui_info *ui, int slotnum) {
-	wheelslot *sl = &m->slot[slotnum];
-	int x = slotnum*4 + 2;
-	/* The center column with numbers */
-	wattrset(ui->w_wheels, ui->attr_wheel_plain);
-	int y0 = (ui->layout == 0) ? m->wheelslots + 5 : m->longest_wheelname + 5;
-	for (int i = 1; i <=2; ++i) {
-		mvwprintw(ui->w_wheels, y0-i, x, "%lc", m->alphabet[(sl->rot+i) % m->alphabet_len]);
-		mvwprintw(ui->w_wheels, y0+i, x, "%lc", m->alphabet[(m->alphabet_len+sl->rot-i) % m->alphabet_len]);
-	}
-	/* The one number showing the current setting */
-	wattrset(ui->w_wheels, ui->attr_wheel_activ);
-	mvwprintw(ui->w_wheels, y0, x, "%lc", m->alphabet[sl->rot]);
-	/* Wheel sides. Possibly selected. Notch/block-pins, ring setting mark */
-	wattrset(ui->w_wheels, slotnum == ui->chosen_wheel ? ui->attr_wheelside_activ : ui->attr_wheelside_plain);
-	int al = m->alphabet_len;
-	if (sl->w->notch) for (int i = -2; i <= 2; ++i) {
-		/* Normal wheel side, or notch mark */
-		wchar_t l = sl->w->notch[(sl->rot-i+al) % al] ? L'-' : L' '; 
-		/* Normal wheel side, or ring setting mark */
-		wchar_t r = sl->ringstellung == (sl->rot - i + al) % al ? L'*' : L' '; 
-		mvwprintw(ui->w_wheels, y0 + i, x-1, "%lc", l);
-		mvwprintw(ui->w_wheels, y0 + i, x+1, "%lc", r);
+/* Slots blocked by the pins that are up */
+static inline uint64_t pins_blocked(machine *m) {
+	uint64_t blocked = 0;
+	for (uint64_t p = m->pin_slots; p; p &= p - 1) {
+		wheelslot *s = &m->slot[__builtin_ctzll(p)];
+		blocked |= -(s->pins >> s->rot & 1) & s->blocks;
 	}
+	return blocked;
+}
+
+/* post_step() with the masks. Any slot not blocked moves */
+static inline void pin_post_step(machine *m) {
+	uint64_t blocked = m->blocked = pins_blocked(m);
+	for (int i = m->wheelslots; i--; ) m->slot[i].movement = !(blocked >> i & 1);
 }
 
 /* Check if any wheels reached a notch position, set 'movement' for indicated slot(s) 
    or check if a blocking pin came up, and clear 'movement' for indicated slot(s)
 */
 void post_step(machine *m) {
+	STAT_START(t);
+	if (m->steps) step_table_sync(m);
+	if (m->pin_masks) {
+		pin_post_step(m);
+		STAT_STOP(ST_POST_STEP, t);
+		return;
+	}
 	for (int i = m->wheelslots; i--; ) {
 		wheelslot *s = &m->slot[i];
 		if (!s->step  || !s->w->notch) continue; /* Meaningless for nonrotating slot/featureless wheel */
-		if (s->w->notch[(s->rot + s->pin_offset) % m->alphabet_len]) for (int j = s->affect_slots; j--; ) {
+		int pos = s->rot + s->pin_offset;
+		if (pos >= m->alphabet_len) pos -= m->alphabet_len;
+		if (s->w->notch[pos]) for (int j = s->affect_slots; j--; ) {
 			m->slot[s->affect_slot[j]].movement = (m->steptype == T_NOTCH_ENABLING);
 		}
 	}
+	STAT_STOP(ST_POST_STEP, t);
+}
+
+/* Mapping through one slot, with rotation and ring setting. That is 
+   (w->encode[(l+rot-ring) % al] - rot + ring) % al, precomputed by wheel_tables() */
+static inline int slot_table_row(machine *m, wheelslot *sl) {
+	int off = sl->rot - sl->ringstellung;
+	return (off < 0 ? off + m->alphabet_len : off) * m->alphabet_len;
+}
+
+/* The same without tables, for long alphabets */
+static inline int slot_map(machine *m, wheelslot *sl, const symbol *map, int l) {
+	int al = m->alphabet_len, off = sl->rot - sl->ringstellung;
+	if (off < 0) off += al;
+	int i = l + off;
+	if (i >= al) i -= al;
+	int x = map[i] - off;
+	return x < 0 ? x + al : x;
+}
+
+static inline int slot_encode(machine *m, wheelslot *sl, int l) {
+	if (!sl->w->rot_encode) return slot_map(m, sl, sl->w->encode, l);
+	return sl->w->rot_encode[slot_table_row(m, sl) + l];
+}
+
+static inline int slot_decode(machine *m, wheelslot *sl, int l) {
+	if (!sl->w->rot_decode) return slot_map(m, sl, sl->w->decode, l);
+	return sl->w->rot_decode[slot_table_row(m, sl) + l];
+}
+
+/*
+	Estimate how often the wheel in each slot moves, in moves per alphabet_len
+	keypresses. Fast slots move every time, and so does anything on a pin-blocking
+	machine. A notched wheel pushes the slots it affects as often as a notch 
+	passes by, a fast single-notch wheel pushes once per revolution.
+	A wheel pushing itself (enigma double stepping) is not counted.
+*/
+static void estimate_movement(machine *m, double *moves) {
+	int al = m->alphabet_len;
+	for (int i = m->wheelslots; i--; ) {
+		wheelslot *s = &m->slot[i];
+		moves[i] = s->step && (s->fast || m->steptype == T_PIN_BLOCKING) ? al : 0;
+	}
+	if (m->steptype != T_NOTCH_ENABLING) return;
+	double pushed[m->wheelslots];
+	for (int pass = m->wheelslots; pass--; ) {
+		for (int i = m->wheelslots; i--; ) pushed[i] = 0;
+		for (int i = m->wheelslots; i--; ) {
+			wheelslot *s = &m->slot[i];
+			if (!s->step || !s->w->notch || !moves[i]) continue;
+			int notches = 0;
+			for (int j = al; j--; ) notches += s->w->notch[j];
+			for (int j = s->affect_slots; j--; ) if (s->affect_slot[j] != i) pushed[s->affect_slot[j]] += moves[i] * notches / al;
+		}
+		for (int i = m->wheelslots; i--; ) {
+			wheelslot *s = &m->slot[i];
+			if (s->step && !s->fast) moves[i] = pushed[i];
+		}
+	}
+}
+
+/* One level of a run: the maps through slots first..j */
+static void compose_level(machine *m, slotrun *r, int j) {
+	int al = m->alphabet_len;
+	wheelslot *sl = &m->slot[j];
+	int *fwd = r->levels + 2 * (j - r->first) * al, *back = fwd + al;
+	if (j == r->first) {
+		for (int x = al; x--; ) {
+			fwd[x] = slot_encode(m, sl, x);
+			back[x] = slot_decode(m, sl, x);
+		}
+		return;
+	}
+	int *pfwd = fwd - 2 * al, *pback = pfwd + al;
+	for (int x = al; x--; ) {
+		if (r->reflecting) {
+			int l = slot_encode(m, sl, x);
+			fwd[x] = slot_decode(m, sl, pfwd[l]);
+			back[x] = slot_decode(m, sl, pback[l]);
+		} else {
+			fwd[x] = pfwd[slot_encode(m, sl, x)];
+			back[x] = slot_decode(m, sl, pback[x]);
+		}
+	}
+}
+
+/* Compose the maps for a run of slots, from the lowest turned slot and up */
+static void compose_run(machine *m, slotrun *r) {
+	for (int j = r->dirty; j <= r->last; ++j) compose_level(m, r, j);
+	r->dirty = INT_MAX;
+}
+
+static void recompose_runs(machine *m) {
+	STAT_START(t);
+	for (int i = m->runs; i--; ) if (m->run[i].dirty != INT_MAX) compose_run(m, &m->run[i]);
+	m->runs_dirty = false;
+	STAT_STOP(ST_RECOMPOSE, t);
+}
+
+/* Add right-to-left stages for slots hi..lo to a path */
+static void path_forward(machine *m, pathstage *p, int *stages, int hi, int lo) {
+	for (int i = hi; i >= lo; --i) {
+		wheelslot *sl = &m->slot[i];
+		pathstage *st = &p[(*stages)++];
+		st->slot = i;
+		st->decode = false;
+		st->map = sl->run >= 0 ? m->run[sl->run].fwd : NULL;
+		if (sl->run >= 0) i = m->run[sl->run].first;
+	}
+}
+
+/* Add left-to-right stages for slots lo..hi to a path */
+static void path_backward(machine *m, pathstage *p, int *stages, int lo, int hi) {
+	for (int i = lo; i <= hi; ++i) {
+		wheelslot *sl = &m->slot[i];
+		pathstage *st = &p[(*stages)++];
+		st->slot = i;
+		st->decode = true;
+		st->map = sl->run >= 0 ? m->run[sl->run].back : NULL;
+		if (sl->run >= 0) i = m->run[sl->run].last;
+	}
 }
 
-/* Cleanup when the user has turned wheels manually */
+/*
+	Set up the signal paths used by encipher() and decipher().
+	Most slots don't move on every keypress. On an enigma, only the fast wheel
+	does. Neighbouring slots that seldom move are grouped in runs, and the mapping
+	through each run is composed into a single table. With a reflector, the run
+	next to it covers the way in and out again. A 5-slot enigma then needs the
+	fast wheel twice, the reflecting run and the plugboard run, both ways.
+	turn_wheels() marks a run dirty when one of its wheels turns, 
+	it is then recomposed before the next use. 
+	Recomposing a level costs about as much as alphabet_len keypresses through 
+	that slot, so slots moving more often than that are left out of the runs.
+*/
+void build_paths(machine *m) {
+	int n = m->wheelslots, al = m->alphabet_len;
+	if (!m->run) {
+		m->run = malloc(n * sizeof(slotrun));
+		m->run_maps = malloc(2 * n * al * sizeof(int));
+		m->enc_path = malloc(4 * n * sizeof(pathstage));
+		m->dec_path = m->enc_path + 2 * n;
+	}
+	double moves[n];
+	estimate_movement(m, moves);
+
+	/* Tables for newly installed wheels */
+	for (int i = 0; i < n; ++i) if (!m->slot[i].w->rot_encode) wheel_tables(m, m->slot[i].w);
+
+	/* Group the slots into runs */
+	m->runs = 0;
+	for (int i = 0; i < n; ++i) m->slot[i].run = -1;
+	bool reflector = n && m->slot[0].w->reflector;
+	int lo = 0; /* First slot not reflecting */
+	for (int i = 0; i < n; ++i) {
+		if (moves[i] > 1) continue;
+		slotrun *r = &m->run[m->runs];
+		r->first = r->last = i;
+		r->reflecting = reflector && i == 0;
+		while (r->last + 1 < n && moves[r->last + 1] <= 1) ++r->last;
+		for (int j = r->first; j <= r->last; ++j) m->slot[j].run = m->runs;
+		r->levels = m->run_maps + 2 * i * al;
+		r->fwd = r->levels + 2 * (r->last - r->first) * al;
+		r->back = r->fwd + al;
+		r->dirty = r->first;
+		++m->runs;
+		if (r->reflecting) lo = r->last + 1;
+		i = r->last;
+	}
+	if (reflector && !lo) lo = 1; /* Moving reflector, not part of a run */
+
+	/* The paths, right to left then back again if there is a reflector */
+	m->enc_stages = m->dec_stages = 0;
+	if (!reflector) {
+		path_forward(m, m->enc_path, &m->enc_stages, n - 1, 0);
+		path_backward(m, m->dec_path, &m->dec_stages, 0, n - 1);
+	} else {
+		path_forward(m, m->enc_path, &m->enc_stages, n - 1, lo);
+		path_forward(m, m->dec_path, &m->dec_stages, n - 1, lo);
+		pathstage *e = &m->enc_path[m->enc_stages++];
+		pathstage *d = &m->dec_path[m->dec_stages++];
+		e->slot = d->slot = 0;
+		e->decode = false;
+		d->decode = true;
+		e->map = m->slot[0].run >= 0 ? m->run[0].fwd : NULL;
+		d->map = m->slot[0].run >= 0 ? m->run[0].back : NULL;
+		path_backward(m, m->enc_path, &m->enc_stages, lo, n - 1);
+		path_backward(m, m->dec_path, &m->dec_stages, lo, n - 1);
+	}
+	m->runs_dirty = true;
+}
+
+/* Cleanup when the user has turned wheels manually, 
+   or changed wheels, ring settings or wiring */
 void step_cleanup(machine *m) {
 	bool init_movenext = (m->steptype == T_PIN_BLOCKING);
 	for (int i = m->wheelslots; i--; ) m->slot[i].movement = init_movenext;
+	pin_masks(m);
+	m->step_states = step_table_size(m);
+	if (!m->steps) m->step_count = 0;
 	post_step(m);
+	build_paths(m);
 }
 
-/* Step the machine / turn wheels. Update the UI if a window is provided. 
+/* Turn the wheel in slot i one step */
+static inline void turn_slot(machine *m, int i) {
+	wheelslot *s = &m->slot[i];
+	s->rot += s->step;
+	if (s->rot >= m->alphabet_len) s->rot -= m->alphabet_len;
+	if (s->run >= 0) {
+		slotrun *r = &m->run[s->run];
+		if (i < r->dirty) r->dirty = i;
+		m->runs_dirty = true;
+	}
+}
+
+/* Step the machine / turn wheels.
    Go through all slots:
 	 Turn the wheel if the slot is  "fast" or has "movement",
-   also, reset 'movement' according to stepping type */
-void step(machine *m, ui_info *ui) {
+   also, reset 'movement' according to stepping type 
+   With pin masks, the slots to turn are the rotating ones not blocked.
+   With a step table, it says which slots turn and what comes next.
+   Inlined into the block functions */
+static inline void turn_wheels(machine *m) {
+	STAT_START(t0);
+	if (m->steps) {
+		stepentry e = m->steps->entry[m->step_state];
+		m->step_state = e.next;
+		for (uint32_t t = e.turned; t; t &= t - 1) turn_slot(m, __builtin_ctz(t));
+		if (e.moving & STEP_MOVING_CHANGED) for (uint32_t t = m->steps->mask; t; t &= t - 1) {
+			int i = __builtin_ctz(t);
+			m->slot[i].movement = e.moving >> i & 1;
+		}
+		STAT_STOP(ST_STEP_TABLE, t0);
+		return;
+	}
+	if (m->pin_masks) {
+		for (uint64_t t = m->fast_slots | (m->step_slots & ~m->blocked); t; t &= t - 1) turn_slot(m, __builtin_ctzll(t));
+		pin_post_step(m);
+		STAT_STOP(ST_STEP_PINS, t0);
+		return;
+	}
 	for (int i = m->wheelslots; i--; ) {
 		wheelslot *s = &m->slot[i];
 		if (!s->step) continue;
-		if (s->fast || s->movement) { 
-			s->rot = (s->rot + s->step) % m->alphabet_len;
-			if (ui) draw_wheel_rot(m, ui, i);
-		}
+		if (s->fast || s->movement) turn_slot(m, i);
 		s->movement = (m->steptype == T_PIN_BLOCKING);
 	}
 	post_step(m);
+	/* Enough keypresses with these wheels to pay for a step table */
+	if (m->step_states && ++m->step_count >= m->step_states) {
+		m->steps = step_table_new(m);
+		m->step_state = m->step_count = 0;
+		step_table_sync(m);
+	}
+	STAT_STOP(ST_STEP_SLOTS, t0);
+}
+
+void step(machine *m) {
+	turn_wheels(m);
+}
+
+
+/* 
+	Helpers for machine_seek() and period.c. A group is a set of rotating slots
+	that push or block each other, different groups move independently. 
+	group[i] is the group of slot i, -1 for nonrotating slots.
+*/
+
+/* How many keypresses ahead will only turn the group's fast wheels?
+   Returns ULLONG_MAX if nothing else will ever move. */
+static unsigned long long quiet_steps(machine *m, const int *group, int g) {
+	if (m->steptype == T_PIN_BLOCKING) return 0;
+	int al = m->alphabet_len;
+	unsigned long long quiet = ULLONG_MAX;
+	for (int i = m->wheelslots; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (group[i] != g) continue;
+		if (!s->fast) {
+			if (s->movement) return 0;
+			continue;
+		}
+		/* When does this fast wheel push something? */
+		bool pushes = false;
+		for (int j = s->affect_slots; j--; ) {
+			wheelslot *a = &m->slot[s->affect_slot[j]];
+			if (a->step && !a->fast) pushes = true;
+		}
+		if (!pushes || !s->w->notch) continue;
+		int pos = (s->rot + s->pin_offset) % al;
+		for (unsigned long long k = 1; k <= al && k < quiet; ++k) {
+			pos = (pos + s->step) % al;
+			if (s->w->notch[pos]) quiet = k;
+		}
+	}
+	return quiet;
+}
+
+/* Like post_step(), for one group */
+static void group_post_step(machine *m, const int *group, int g) {
+	for (int i = m->wheelslots; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (group[i] != g || !s->w->notch) continue;
+		if (s->w->notch[(s->rot + s->pin_offset) % m->alphabet_len]) for (int j = s->affect_slots; j--; ) {
+			m->slot[s->affect_slot[j]].movement = (m->steptype == T_NOTCH_ENABLING);
+		}
+	}
+}
+
+/* Turn the group's fast wheels k keypresses ahead, at most quiet_steps() */
+static void quiet_turn(machine *m, const int *group, int g, unsigned long long k) {
+	int al = m->alphabet_len;
+	for (int i = m->wheelslots; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (group[i] != g) continue;
+		if (s->fast) s->rot = (s->rot + (k % al) * s->step) % al;
+		s->movement = false;
+	}
+	group_post_step(m, group, g);
+}
+
+/* Set the group's movement from its rotations, like step_cleanup() does */
+void group_settle(machine *m, const int *group, int g) {
+	for (int i = m->wheelslots; i--; ) if (group[i] == g) m->slot[i].movement = (m->steptype == T_PIN_BLOCKING);
+	group_post_step(m, group, g);
+}
+
+/* Like turn_wheels(), for one group */
+void group_turn(machine *m, const int *group, int g) {
+	int al = m->alphabet_len;
+	for (int i = m->wheelslots; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (group[i] != g) continue;
+		if (s->fast || s->movement) {
+			s->rot += s->step;
+			if (s->rot >= al) s->rot -= al;
+		}
+		s->movement = (m->steptype == T_PIN_BLOCKING);
+	}
+	group_post_step(m, group, g);
+}
+
+/* Same rotations, same machine state */
+static bool same_rotations(machine *m, const int *rot) {
+	for (int i = m->wheelslots; i--; ) if (m->slot[i].rot != rot[i]) return false;
+	return true;
+}
+
+/* Sort the rotating slots into groups. Returns the number of groups */
+int stepping_groups(machine *m, int *group) {
+	int n = m->wheelslots, groups = 0;
+	for (int i = 0; i < n; ++i) group[i] = m->slot[i].step ? i : -1;
+	/* Merge groups until nothing changes, the lowest slot number names the group */
+	for (bool merged = true; merged; ) {
+		merged = false;
+		for (int i = 0; i < n; ++i) {
+			if (group[i] < 0) continue;
+			wheelslot *s = &m->slot[i];
+			for (int j = s->affect_slots; j--; ) {
+				int a = s->affect_slot[j];
+				if (group[a] < 0 || group[a] == group[i]) continue;
+				int from = group[a] > group[i] ? group[a] : group[i];
+				int to = group[a] < group[i] ? group[a] : group[i];
+				for (int k = 0; k < n; ++k) if (group[k] == from) group[k] = to;
+				merged = true;
+			}
+		}
+	}
+	for (int i = 0; i < n; ++i) if (group[i] == i) ++groups;
+	return groups;
+}
+
+/*
+	Move the machine n keypresses ahead, as if n letters were typed.
+	Groups of slots that don't affect each other are moved separately.
+	Within a group, stretches where only fast wheels move are taken in one
+	jump, for an enigma that is 25 of every 26 keypresses. The rest is stepping.
+	The sequence of states eventually repeats, so Brent's cycle detection runs
+	along. When a state repeats, the rest of n is reduced modulo the cycle 
+	length. A 3-wheel enigma repeats after 16 900 keypresses, so any position
+	is reached in a few hundred jumps and steps. A pin-blocking group is
+	stepped one keypress at a time until it cycles, which bounds the work by 
+	the group's period. (The fialka has two groups of five wheels)
+*/
+void machine_seek(machine *m, unsigned long long n) {
+	int group[m->wheelslots], tortoise[m->wheelslots];
+	stepping_groups(m, group);
+	for (int g = 0; g < m->wheelslots; ++g) {
+		if (group[g] != g) continue;
+		for (int i = m->wheelslots; i--; ) tortoise[i] = m->slot[i].rot;
+		unsigned long long left = n, done = 0, tortoise_at = 0, power = 1, lam = 0;
+		bool cycled = false;
+		while (done < left) {
+			unsigned long long quiet = quiet_steps(m, group, g);
+			if (quiet >= left - done) {
+				quiet_turn(m, group, g, left - done);
+				break;
+			}
+			if (quiet) quiet_turn(m, group, g, quiet);
+			group_turn(m, group, g);
+			done += quiet + 1;
+			if (cycled) continue;
+			if (same_rotations(m, tortoise)) {
+				left = done + (left - done) % (done - tortoise_at);
+				cycled = true;
+			} else if (++lam == power) {
+				for (int i = m->wheelslots; i--; ) tortoise[i] = m->slot[i].rot;
+				tortoise_at = done;
+				power *= 2;
+				lam = 0;
+			}
+		}
+	}
+	step_cleanup(m);
 }
 
 
@@ -268,492 +765,121 @@ decipher:
 * then proceed with the rest:
 * if no reflector, start here:
 * proceed through the decipher mappings from left to right, starting with the reflector.
-*/
-wchar_t encipher(machine *m, wchar_t c, ui_info *ui) {
-	int l = lookup(c, m->alphabet);
-	if (l == -1) return c;
-	step(m, ui);
-	int al = m->alphabet_len;
-  /*  Process all the wheels ... */
-	for (int i = m->wheelslots; i--;) {
-		wheelslot *sl = &m->slot[i];
-		l = (sl->w->encode[(l+sl->rot+al-sl->ringstellung) % al] + al - sl->rot + sl->ringstellung) % al;
 
+The paths through the wheels work on alphabet indices, the machine must be 
+stepped first. They follow the stages set up by build_paths().
+*/
+static inline int run_path(machine *m, pathstage *p, int stages, int l) {
+	if (m->runs_dirty) recompose_runs(m);
+	STAT_ADD(ST_STAGES, stages);
+	for (; stages--; ++p) {
+		if (p->map) l = p->map[l];
+		else if (p->decode) l = slot_decode(m, &m->slot[p->slot], l);
+		else l = slot_encode(m, &m->slot[p->slot], l);
 	}
-	/* ... reflect if we have a reflector ... */
-	if (m->slot[0].w->reflector) for (int i = 1; i < m->wheelslots; ++i) {
-		wheelslot *sl = &m->slot[i];
-		l = (sl->w->decode[(l+sl->rot+al-sl->ringstellung) % al] + al - sl->rot + sl->ringstellung) % al;		
-	}
-	return m->alphabet[l];
+	return l;
 }
 
-wchar_t decipher(machine *m, wchar_t c, ui_info *ui) {
-	int l = lookup(c, m->alphabet);
-	if (l == -1) return c;
-	step(m, ui);
-	int al = m->alphabet_len;
-  /* Is the machine eqipeed with a reflector? */
-  if (m->slot[0].w->reflector) for (int i = m->wheelslots; --i;) {
-		wheelslot *sl = &m->slot[i];
-		l = (sl->w->encode[(l+sl->rot+al-sl->ringstellung) % al] + al - sl->rot + sl->ringstellung) % al;		
-	}
-	for (int i = 0; i < m->wheelslots; ++i) {
-		wheelslot *sl = &m->slot[i];
-		l = (sl->w->decode[(l+sl->rot+al-sl->ringstellung) % al] + al - sl->rot + sl->ringstellung) % al;
-	} 
-	return m->alphabet[l];
-}
-
-/* Draw wheel number i */
-void draw_wheel(machine *m, ui_info *ui, int i) {
-	bool highlight = ui->chosen_wheel == i;
-	wattrset(ui->w_wheels, ui->attr_wheel_activ);
-	int base_y = (ui->layout == 0) ? m->wheelslots : m->longest_wheelname;
-	mvwprintw(ui->w_wheels, base_y + 5, i*4, "     ");
-	if (!highlight) wattrset(ui->w_wheels, ui->attr_wheel_plain);
-	/* Wheel background, inactive parts */
-	for (int j = 2; j <= 6; ++j) mvwprintw(ui->w_wheels, base_y + j + 1, i*4+1, "   ");
-  if (m->slot[i].step) {
-		/* Wheel turning knobs */
-		wattrset(ui->w_wheels, highlight ? ui->attr_btnh : ui->attr_btn );
-		mvwprintw(ui->w_wheels, base_y + 8, i*4+1, " v ");
-		mvwprintw(ui->w_wheels, base_y + 2, i*4+1, " ^ ");
-		/* Wheel text */
-		draw_wheel_rot(m, ui, i);
-		/* Ring settings */
-		wattrset(ui->w_wheels, highlight ? ui->attr_lblh : ui->attr_lbl);
-		mvwprintw(ui->w_wheels, base_y + 9, i*4+1, " %lc ", m->alphabet[m->slot[i].ringstellung]);
-	}
-  /* Wheel name */ 
-	wattrset(ui->w_wheels, highlight ? ui->attr_lblh : ui->attr_lbl);
-  if (ui->layout == 0) {
-		mvwprintw(ui->w_wheels, i+1, i*3+m->wheelslots+3, "%*ls", -m->longest_wheelname, m->slot[i].w->name);
-		for (int j = 1; j < 1+m->wheelslots-i; ++j) mvwprintw(ui->w_wheels, i+j+1, 3+i*3+m->wheelslots-j, "%c", '/');
-	} else {
-
-		int nlen = m->slot[i].w->name_len;
-		for (int j = 0; j < nlen; ++j) mvwprintw(ui->w_wheels, 1+j+m->longest_wheelname-nlen, 2+i*4, "%lc", m->slot[i].w->name[j]);	
-		mvwprintw(ui->w_wheels, m->longest_wheelname+1, 2+i*4, "|");
-
-	}
+static inline int encipher_path(machine *m, int l) {
+	STAT_START(t);
+	l = run_path(m, m->enc_path, m->enc_stages, l);
+	STAT_STOP(ST_ENC_PATH, t);
+	return l;
 }
 
-/* Draw the set of wheels (entire window) */
-void draw_wheels(machine *m, ui_info *ui) {
-	for (int i = 0; i < m->wheelslots; ++i) draw_wheel(m, ui, i);
-	/* Machine name centered on top */
-	wattrset(ui->w_wheels, ui->attr_wheel_activ);
-	mvwprintw(ui->w_wheels, 0, (getmaxx(ui->w_wheels)-wcslen(m->name))/2, "%ls", m->name);
-	/* Ring setting heading */
-	wattrset(ui->w_wheels, A_NORMAL);
-	mvwprintw(ui->w_wheels, 9+m->wheelslots, 4*m->wheelslots, "ring setting");
+static inline int decipher_path(machine *m, int l) {
+	STAT_START(t);
+	l = run_path(m, m->dec_path, m->dec_stages, l);
+	STAT_STOP(ST_DEC_PATH, t);
+	return l;
 }
 
-
-void highlight_wheel(machine *m, ui_info *ui, int wheelnr) {
-	int old = ui->chosen_wheel;
-	ui->chosen_wheel = (wheelnr < m->wheelslots && wheelnr >= 0 )? wheelnr : -1;
-	if (old == ui->chosen_wheel) return; /* no change */
-	if (old >= 0) draw_wheel(m, ui, old);
-	if (ui->chosen_wheel >= 0) draw_wheel(m, ui, ui->chosen_wheel);
-	wnoutrefresh(ui->w_wheels);
+wchar_t encipher(machine *m, wchar_t c) {
+	int l = alphabet_index(m, c);
+	if (l == -1) return c;
+	step(m);
+	return m->alphabet[encipher_path(m, l)];
 }
 
-
-void highlight_left(machine *m, ui_info *ui) {
-	int n = ui->chosen_wheel > 0 ? ui->chosen_wheel - 1 : m->wheelslots - 1;
-	highlight_wheel(m, ui, n);
+wchar_t decipher(machine *m, wchar_t c) {
+	int l = alphabet_index(m, c);
+	if (l == -1) return c;
+	step(m);
+	return m->alphabet[decipher_path(m, l)];
 }
 
 
-void highlight_right(machine *m, ui_info *ui) {
-	int n = ui->chosen_wheel < m->wheelslots - 1 ? ui->chosen_wheel + 1 : 0;
-	highlight_wheel(m, ui, n);
+/* 
+	Block API for bulk work. Text is translated to alphabet indices once,
+	and then processed n symbols at a time without lookups or UI. 
+	in and out may be the same array.
+*/
+void encipher_block(machine *m, const symbol *in, symbol *out, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		turn_wheels(m);
+		out[i] = encipher_path(m, in[i]);
+	}
 }
 
-
-/* Manual turning of the chosen code wheel */
-void wheel_turn(machine *m, ui_info *ui, int step) {
-	if (ui->chosen_wheel < 0) return;
-	if (!m->slot[ui->chosen_wheel].step) return;
-	int *i = &m->slot[ui->chosen_wheel].rot;
-	*i = (*i + m->alphabet_len + step) % m->alphabet_len;
-	step_cleanup(m);
-	draw_wheel(m, ui, ui->chosen_wheel);
-	wnoutrefresh(ui->w_wheels);
+void decipher_block(machine *m, const symbol *in, symbol *out, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		turn_wheels(m);
+		out[i] = decipher_path(m, in[i]);
+	}
 }
 
-
-/* Manual change of ring setting */
-void ringstellung(machine *m, ui_info *ui, int step) {
-	if (ui->chosen_wheel < 0) return;
-	if (!m->slot[ui->chosen_wheel].step) return;
-	int *i = &m->slot[ui->chosen_wheel].ringstellung;
-	*i = (*i + m->alphabet_len + step) % m->alphabet_len;
-	step_cleanup(m);
-	draw_wheel(m, ui, ui->chosen_wheel);
-	wnoutrefresh(ui->w_wheels);
+/* Translate wide characters to alphabet indices. Characters not in the 
+   machine alphabet are dropped. Returns the number of symbols stored. */
+size_t wcs_to_symbols(machine *m, const wchar_t *ws, size_t n, symbol *s) {
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		int l = alphabet_index(m, ws[i]);
+		if (l != -1) s[k++] = l;
+	}
+	return k;
 }
 
+/* Translate alphabet indices back to wide characters */
+void symbols_to_wcs(machine *m, const symbol *s, size_t n, wchar_t *ws) {
+	for (size_t i = 0; i < n; ++i) ws[i] = m->alphabet[s[i]];
+}
 
-/* change the highlighted code wheel (or plugboard) */
-void next_wheel(machine *m, ui_info *ui) {
-	if (ui->chosen_wheel < 0) return;
-	wheelslot *sl = &m->slot[ui->chosen_wheel];
-	if (sl->type == T_WHEEL) {
-		/* Change an ordinary wheel or reflector, to another allowed wheel */
-		do {
-			sl->w = sl->w->next_in_set;
-		} while(!sl->w->allow_slot[ui->chosen_wheel]);
-		draw_wheel(m, ui, ui->chosen_wheel);
-	} else {
-		/* change plugboard- / crossbar-settings, or rewire a wheel */
-		wint_t s[m->alphabet_len * 2];
-		echo();
-		char *err = ""; /* Short msg if they screw up */
-		for (bool done = false; !done; ) {
-			wclear(ui->w_pop);
-			if (sl->type == T_PAIRSWAP) {
-				wprintw(ui->w_pop, "%sGive plugboard swaps in the format AX CF ...\nor just enter for the identity mapping\n", err);
-				mvwgetn_wstr(ui->w_pop, 2, 0, s, (m->alphabet_len / 2) * 3);
-				identity_map(m, sl->w);
-				wchar_t *l1=s, *l2;
-				done = true; /* optimistic */
-				do { /* Each iteration parses one stecker pair */
-					while (*l1 == L' ') ++l1;
-					if (*l1) { /*  if we didn't hit \0 */
-						l2 = l1 + 1;
-						int i1 = lookup(*l1, m->alphabet);
-						int i2 = lookup(*l2, m->alphabet);
-						if (i1 == -1 || i2 == -1) {
-							*l1 = 0;
-							err = "Letter not in machine alphabet. ";
-							done = false;
-						} else {
-							/* Got a pair, and it is valid! Set up the encoding & decoding */						
-							sl->w->encode[i1] = i2;
-							sl->w->encode[i2] = i1;
-							sl->w->decode[i1] = i2;
-							sl->w->decode[i2] = i1;
-							l1 = l2 + 1;
-						}
-					}
-				} while (*l1);
-			} else {
-				wprintw(ui->w_pop, "%sType the new mapping like XYZABCDE...\nor just enter for the identity mapping\n", err);
-				mvwgetn_wstr(ui->w_pop, 2, 0, s, m->alphabet_len);
-				identity_map(m, sl->w);
-				done = true; /* Unless we get a bad string */
-				int i = 0;
-				wchar_t *l = s;
-				while (*l && i < m->alphabet_len && done) {
-					int c = lookup(*l, m->alphabet);
-					if (c == -1) {
-						err = "Letter not in machine alphabet. ";
-						done = false;
-					} else {
-						sl->w->encode[i] = c;
-						sl->w->decode[c] = i;
-					}
-					++i;
-					++l;
-				}
-				/* More sanity checking */
-				if (done) {
-					if (*l) {
-						err = "Too many characters. ";
-						done = false;
-					} else if (i && i < m->alphabet_len) {
-						err = "Too few characters. ";
-						done = false;
-					}
-				}
-
-			}
-		}
-		noecho();
-		redrawwin(ui->w_code);
-		wnoutrefresh(ui->w_code);	
-
+/*
+	Translate a wide string to alphabet indices, dropping characters outside the
+	alphabet. Lower case letters count as their upper case forms when only those
+	are in the alphabet. Returns the number of symbols.
+*/
+size_t fold_symbols(machine *m, const wchar_t *ws, symbol *s) {
+	size_t n = 0;
+	for (; *ws; ++ws) {
+		int l = alphabet_index(m, *ws);
+		if (l == -1) l = alphabet_index(m, towupper(*ws));
+		if (l != -1) s[n++] = l;
 	}
-	wnoutrefresh(ui->w_wheels);
-	step_cleanup(m);
+	return n;
 }
 
-void interactive(machine *m) {
-	/* Set up the ncurses interface */
-	ui_info ui;
-	initscr();
-	start_color();
-	raw(); 
-	noecho(); 
-	keypad(stdscr, true);
-
-	/* Figure out the level of color support, choose attributes accordingly */
-	if (has_colors()) {
-		if (can_change_color()) {
-			/* Best case, programmable colors */
-			init_color(CLR_WHITEGRAY, 800, 800, 800); /* dull text */
-			init_color(CLR_DARKGRAY, 400, 400, 400);  /* highlighted metal */
-			init_color(CLR_DARKESTGRAY, 250, 250, 250); /* darkest metal */
-			init_color(CLR_BRIGHTRED, 1000, 400, 400); /* coded text */
-			init_pair(CP_WHEEL_PLAIN, CLR_WHITEGRAY, CLR_DARKESTGRAY);
-			init_pair(CP_WHEEL_ACTIV, COLOR_WHITE, CLR_DARKGRAY);
-			init_pair(CP_PLAIN, COLOR_WHITE, COLOR_BLACK);
-			init_pair(CP_CODED, CLR_BRIGHTRED, COLOR_BLACK);
-			init_pair(CP_BTN, COLOR_RED, CLR_DARKESTGRAY);
-			init_pair(CP_BTNH, COLOR_RED, CLR_DARKGRAY);	
-			init_pair(CP_WHEELSIDE_PLAIN, COLOR_BLACK, CLR_DARKESTGRAY);
-			init_pair(CP_WHEELSIDE_ACTIV, COLOR_BLACK, CLR_DARKGRAY);
-		} else {
-			/* Second best, 8 color ncurses */
-			init_pair(CP_WHEEL_PLAIN, COLOR_YELLOW, COLOR_BLUE);
-			init_pair(CP_WHEEL_ACTIV, COLOR_WHITE, COLOR_RED);
-			init_pair(CP_PLAIN, COLOR_WHITE, COLOR_BLACK);
-			init_pair(CP_CODED, COLOR_RED, COLOR_BLACK);
-			init_pair(CP_BTN, COLOR_RED, COLOR_BLUE);
-			init_pair(CP_BTNH, COLOR_BLUE, COLOR_RED);
-			init_pair(CP_WHEELSIDE_PLAIN, COLOR_BLACK, COLOR_BLUE);
-			init_pair(CP_WHEELSIDE_ACTIV, COLOR_BLACK, COLOR_RED);
-		}
-		ui.attr_plain = COLOR_PAIR(CP_PLAIN);
-		ui.attr_coded = COLOR_PAIR(CP_CODED);
-		ui.attr_wheel_plain = COLOR_PAIR(CP_WHEEL_PLAIN);
-		ui.attr_wheel_activ = COLOR_PAIR(CP_WHEEL_ACTIV) | A_BOLD;
-		ui.attr_btn = COLOR_PAIR(CP_BTN);
-		ui.attr_btnh = COLOR_PAIR(CP_BTNH);
-		ui.attr_wheelside_plain = COLOR_PAIR(CP_WHEELSIDE_PLAIN);
-		ui.attr_wheelside_activ = COLOR_PAIR(CP_WHEELSIDE_ACTIV);
-	} else {
-		/* No color fallback */
-		ui.attr_plain = A_NORMAL;
-		ui.attr_coded = A_BOLD;
-		ui.attr_wheel_plain = A_REVERSE;
-		ui.attr_wheel_activ = A_REVERSE | A_BOLD | A_UNDERLINE;
-		ui.attr_btn = A_REVERSE | A_BOLD;
-		ui.attr_btnh = ui.attr_btn;
-		ui.attr_wheelside_plain = ui.attr_wheel_plain;
-		ui.attr_wheelside_activ = ui.attr_wheel_activ;
-	}
-	ui.attr_lbl = A_NORMAL;
-	ui.attr_lblh = A_BOLD;
-	ui.chosen_wheel = -1;
-
-	/* Make the windows.
-     Two ways to print slot headings, select the lowest height:
-		 way0: (height depends on the number of slots)
-
-        UKW-B
-       /   VII
-      /   /   VI
-     /   /   /   steckerbrett
-    /   /   /   /
-
-   way1: (height depends on the longest wheelname)
- 
-    U       V   E
-    K       I   T
-    W   V   I   W
-    |   |   |   |
-   */
-	int topheight0 = 10 + m->wheelslots;
-	int topheight1 = 10 + m->longest_wheelname;
-	ui.layout = topheight0 < topheight1 ? 0 : 1;
-	int topheight = ui.layout == 0 ? topheight0 : topheight1;
-	int longestname = strlen("ring settings");
-	if (ui.layout == 0 && longestname < m->longest_wheelname) longestname = m->longest_wheelname;
-	int topwidth = 4 * m->wheelslots + 1 + longestname;
-	int namelen = wcslen(m->name);
-	if (namelen > topwidth) topwidth = namelen;
-	ui.w_wheels = newwin(topheight, topwidth, 0, COLS-topwidth);
-	int botheight = ((LINES - topheight) / 3) * 3 - 1;
-	int botwidth = COLS;
-	ui.w_code = newwin(botheight, botwidth, topheight, 0);
-	ui.w_pop = newwin(botheight, botwidth, topheight, 0);
-	draw_wheels(m, &ui);
-
-  bool enciphering = true;		/* enchiper or dechiper */
-
-	wchar_t plaintext[MAXLINE+1]; /* typed/dechipered text */
-	wchar_t ciphertxt[MAXLINE+1]; /* typed/enchipered text */
-	memset(plaintext, 0, sizeof(wchar_t)*(MAXLINE+1));
-	memset(ciphertxt, 0, sizeof(wchar_t)*(MAXLINE+1));
-
-	int textpos = 0;
-  int maxpos = COLS - 2 > MAXLINE ? MAXLINE : COLS - 2;  
-
-	curses_bug_workaround();
-	wmove(ui.w_code, 1, 1);
-
-	/* main loop. The first event has to be the KEY_RESIZE, it creates the display! */
-	int rc = KEY_CODE_YES;
-	wint_t wch = KEY_RESIZE; 
-	for (bool active = true; active; rc = active ? get_wch(&wch) : 0) {
-		switch (rc) {
-			case KEY_CODE_YES:		/* specials */
-				switch (wch) {
-					case KEY_F(1):
-						highlight_wheel(m, &ui, 0);
-						break;
-					case KEY_F(2):
-						highlight_wheel(m, &ui, 1);
-						break;
-					case KEY_F(3):
-						highlight_wheel(m, &ui, 2);
-						break;
-					case KEY_F(4):
-						highlight_wheel(m, &ui, 3);
-						break;
-					case KEY_F(5):
-						highlight_wheel(m, &ui, 4);
-						break;
-					case KEY_F(6):
-						highlight_wheel(m, &ui, 5);
-						break;
-					case KEY_F(7):
-						highlight_wheel(m, &ui, 6);
-						break;
-					case KEY_F(8):
-						highlight_wheel(m, &ui, 7);
-						break;
-					case KEY_F(9):
-						highlight_wheel(m, &ui, 8);
-						break;
-					case KEY_LEFT:
-						highlight_left(m, &ui);
-						break;
-					case KEY_RIGHT:
-						highlight_right(m, &ui);
-						break;
-					case KEY_F(10):
-						highlight_wheel(m, &ui, 9);
-						break;
-					case KEY_NPAGE:
-						next_wheel(m, &ui);
-						break;
-					case KEY_UP:
-						if (ui.chosen_wheel == -1) {		
-							/* switch to encoding */
-							enciphering = true;
-							wmove(ui.w_code, 1, textpos+1);
-							wnoutrefresh(ui.w_code);
-						} else wheel_turn(m, &ui, -1);
-						break;
-					case KEY_DOWN:
-						if (ui.chosen_wheel == -1) {		
-							/* switch to decoding */
-							enciphering = false;
-							wmove(ui.w_code, 2, textpos+1);
-							wnoutrefresh(ui.w_code);
-						} else wheel_turn(m, &ui, 1);		
-						break;
-					case KEY_RESIZE:	/* user resized the xterm - redraw all! */
-						curses_bug_workaround();//Remove, and top window blanks out
-						/* Must repaint all, as downsizing may blank the terminal */
-						
-						/* Deal with the code wheel window */
-						botheight = ((LINES - topheight) / 3) * 3 - 1;
-						botwidth = COLS;
-						wresize(ui.w_code, botheight, botwidth);
-						wresize(ui.w_pop, botheight, botwidth);
-						int oldx = getbegx(ui.w_wheels);
-						int newx = COLS-topwidth;
-						mvwin(ui.w_wheels, 0, COLS-topwidth); /* move the window */
-						/* now clear out the exposed screen area */
-						if (newx > oldx) {
-							int xlen = newx-oldx;
-							char *spc = malloc(xlen+1);
-							memset(spc, ' ', xlen);
-							spc[xlen] = 0;
-							for (int i=0; i < topheight; ++i) mvprintw(i, oldx, spc);
-							free(spc); 
-						}
-						wnoutrefresh(ui.w_wheels);
-						curses_bug_workaround(); //Remove, and the cursor will misplaced when upsizing
-						
-
-						/* Now the code text window */
-						maxpos = COLS - 2 > MAXLINE ? MAXLINE : COLS - 2;  
-                  
-						if (textpos > maxpos) {
-							leftcut(plaintext, textpos - maxpos, maxpos+1);
-							leftcut(ciphertxt, textpos - maxpos, maxpos+1);
-							textpos = maxpos;
-							wattrset(ui.w_code, ui.attr_plain);
-							mvwprintw(ui.w_code, 1, 1, "%ls", plaintext);wclrtoeol(ui.w_code);
-							wattrset(ui.w_code, ui.attr_coded);
-							mvwprintw(ui.w_code, 2, 1, "%ls", ciphertxt);wclrtoeol(ui.w_code);
-							if (enciphering) wmove(ui.w_code, 1, textpos+1);
-						}
-
-						wnoutrefresh(ui.w_code);
-						break;
-				}
-				break;
-			case OK:
-				if (iscntrl(wch)) switch (wch) {
-					/* ctrl tv change ring settings */
-					case 20:
-						ringstellung(m, &ui, -1);
-						break;
-					case 22:
-						ringstellung(m, &ui, 1);
-						break;
-					/* quit on ctrl+c */	
-					case 3:
-						active = false;
-						break;
-					/* unselect wheel on enter */
-						case '\n':
-							highlight_wheel(m, &ui, -1);
-							wnoutrefresh(ui.w_code);
-							break;
-				}							
-				/* plain typing */
-				else { 
-					if (ui.chosen_wheel > -1) highlight_wheel(m, &ui, -1);
-					/* Need a line break first? */
-					if (textpos >= maxpos) {
-						/* add scrolling later !!! for now, just clear */
-						textpos = 0;
-						memset(plaintext, 0, sizeof(wchar_t)*(MAXLINE+1));
-						memset(ciphertxt, 0, sizeof(wchar_t)*(MAXLINE+1));
-						if (enciphering) {
-							wmove(ui.w_code, 2, textpos+1); wclrtoeol(ui.w_code);
-							wmove(ui.w_code, 1, textpos+1); wclrtoeol(ui.w_code);
-						} else {
-							wmove(ui.w_code, 1, textpos+1); wclrtoeol(ui.w_code);
-							wmove(ui.w_code, 2, textpos+1); wclrtoeol(ui.w_code);
-						}
-					}
-					if (enciphering) {
-						plaintext[textpos] = wch;
-						ciphertxt[textpos] = encipher(m, wch, &ui);
-						wattrset(ui.w_code, ui.attr_coded);
-						mvwprintw(ui.w_code, 2, 1, "%ls", ciphertxt);
-						wattrset(ui.w_code, ui.attr_plain);
-						mvwprintw(ui.w_code, 1, 1, "%ls", plaintext);
-					} else {
-						ciphertxt[textpos] = wch;
-						plaintext[textpos] = decipher(m, wch, &ui);
-						wattrset(ui.w_code, ui.attr_plain);
-						mvwprintw(ui.w_code, 1, 1, "%ls", plaintext);
-						wattrset(ui.w_code, ui.attr_coded);
-						mvwprintw(ui.w_code, 2, 1, "%ls", ciphertxt);
-					}
-					textpos++;
-					wnoutrefresh(ui.w_wheels);
-					wnoutrefresh(ui.w_code);
-					break;
-				}
-		} 
-		doupdate();
-	}
-	endwin();
+/* Read a whole text file as alphabet indices, see fold_symbols() */
+symbol *read_symbols(machine *m, const char *filename, size_t *n) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
+	size_t len = 0, size = STREAMBUF;
+	char *buf = malloc(size + 1);
+	for (ssize_t r; (r = read(fd, buf + len, size - len)) > 0; ) {
+		len += r;
+		if (len == size) buf = realloc(buf, (size *= 2) + 1);
+	}
+	close(fd);
+	buf[len] = 0;
+	wchar_t *ws = mbstowcsdup(buf);
+	free(buf);
+	if (!ws) return NULL;
+	symbol *s = malloc((wcslen(ws) + 1) * sizeof(symbol));
+	*n = fold_symbols(m, ws, s);
+	free(ws);
+	return s;
 }
 
-
 /* Print Vigènere tables for the code wheels */
 /* 
      Wheel "III"
@@ -807,21 +933,97 @@ void print_tables(machine *m) {
 }
 
 
-int main(int argc, char *argv[]) {
-	/* setlocale(), so mbtowc() etc will work. 
-     We may want to encode/decode non-ascii stuff. 
-     Spies works with many scripts . . . */
-	if (setlocale(LC_ALL, "") == NULL) feil("Bad locale, please configure your computer correctly. Install the locale package, and/or set the LANG environment variable.\n");
-	fwide(stdout,1);
+/* Write a whole buffer, retrying short writes */
+void write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0) feil("write error\n");
+		buf += w;
+		len -= w;
+	}
+}
+
+/* Buffers for code_utf8(), STREAMBUF entries each */
+codebuf *new_codebuf() {
+	codebuf *cb = malloc(sizeof(codebuf));
+	cb->sym = malloc(STREAMBUF * sizeof(symbol));
+	cb->pos = malloc(STREAMBUF * sizeof(uint32_t));
+	return cb;
+}
+
+void free_codebuf(codebuf *cb) {
+	free(cb->sym);
+	free(cb->pos);
+	free(cb);
+}
 
-  bool print_wheel_tables = (argc == 3) && !strcmp(argv[2], "-t");
+/*
+	(De)cipher utf-8 text, for the file and pipe modes.
+	Takes up to STREAMBUF characters from in, and stores the result in out. 
+	out needs room for STREAMBUF * MB_LEN_MAX bytes. 
+	The characters found in the machine alphabet are translated to indices 
+	and run through the block functions, the rest (and bytes that aren't valid
+	utf-8) pass through unchanged. A character split at the end of in is left
+	for the next call, unless this is the final part of the input.
+	Returns the number of bytes stored in out, *used and *chars are set to the 
+	number of bytes and characters consumed from in.
+*/
+size_t code_utf8(machine *m, bool enciphering, const char *in, size_t len, bool final, 
+                 size_t *used, size_t *chars, char *out, codebuf *cb) {
+	symbol *sym = cb->sym;
+	uint32_t *pos = cb->pos;
+	size_t ns = utf8_scan(m->utf8, in, len, final, STREAMBUF, sym, pos, used, chars);
+	if (enciphering) encipher_block(m, sym, sym, ns);
+	else decipher_block(m, sym, sym, ns);
+	/* Copy what passes through, and encode the result */
+	size_t olen = 0, from = 0;
+	for (size_t k = 0; k < ns; ++k) {
+		memcpy(out + olen, in + from, pos[k] - from);
+		olen += pos[k] - from;
+		olen += utf8_put(m->utf8, sym[k], out + olen);
+		from = pos[k] + utf8_len(in[pos[k]]);
+	}
+	memcpy(out + olen, in + from, *used - from);
+	return olen + *used - from;
+}
+
+/* Report characters/s on stderr */
+void report_throughput(unsigned long long chars, struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+	fprintf(stderr, "%llu characters in %.3f s, %.0f characters/s\n", chars, secs, secs > 0 ? chars / secs : 0.0);
+}
 
-  if ((argc < 2) || (argc > 3) || (argc == 3 && !print_wheel_tables )) feil("enigma machine-description [-t]\n -t prints wheel tables\n");
-  machine *m=getdescr(argv[1]);
-  if (!m) feil("Unuseable machine description\n");
-  
-  if (print_wheel_tables) print_tables(m); 
-  else interactive(m);
+/* 
+	Non-interactive mode, encipher or decipher a whole file or pipe.
+	Input is read in big blocks, output is written in big blocks.
+	Throughput is reported on stderr when done.
+*/
+void stream(machine *m, bool enciphering, int in, int out) {
+	static char ibuf[STREAMBUF];
+	static char obuf[STREAMBUF * MB_LEN_MAX];
+	codebuf *cb = new_codebuf();
+	size_t left = 0;
+	unsigned long long chars = 0;
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (;;) {
+		ssize_t r = read(in, ibuf + left, STREAMBUF - left);
+		if (r < 0) feil("read error\n");
+		size_t len = left + r, pos = 0;
+		do {
+			size_t used, n;
+			write_all(out, obuf, code_utf8(m, enciphering, ibuf + pos, len - pos, !r, &used, &n, obuf, cb));
+			pos += used;
+			chars += n;
+		} while (!r && pos < len);
+		if (!r) break;
+		left = len - pos;
+		memmove(ibuf, ibuf + pos, left);
+	}
+	report_throughput(chars, &t0);
 }
 
 
@@ -1,33 +1,38 @@
 /*
   enigma.h
+	The simulator core, libenigma: machine descriptions, stepping, enciphering
+	and the searches. No user interface, see ui.h
 	© 2015 Helge Hafting, licenced under the GPL
 */
 
+#ifndef ENIGMA_H
+#define ENIGMA_H
+
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdarg.h>
-#include <ncurses.h>
-
-/* Color pair numbers for UI */
-#define CP_WHEEL_PLAIN 20
-#define CP_WHEEL_ACTIV 21
-#define CP_PLAIN 22
-#define CP_CODED 23
-#define CP_BTN 24
-#define CP_BTNH 25
-#define CP_WHEELSIDE_PLAIN 26
-#define CP_WHEELSIDE_ACTIV 27
-
-#define CLR_WHITEGRAY   20
-#define CLR_DARKESTGRAY 21
-#define CLR_DARKGRAY    22
-#define CLR_BRIGHTRED		23
-
-/* Longest screenline to bother with */
-#define MAXLINE 200
+#include <time.h>
+#include <stdio.h>
+#include <wchar.h>
+
+/* Block size for non-interactive file/pipe processing */
+#define STREAMBUF 65536
 
 /* Maximum set of integers (on a line in a config file) */
 #define MAX_INT_SET 100
 
+/* A character, as its position in the machine alphabet */
+typedef uint16_t symbol;
+
+/* Not a position in any alphabet, so alphabets have up to 65535 characters */
+#define NO_SYMBOL 0xFFFF
+#define MAX_ALPHABET 65535
+
+/* Longest alphabet with per-rotation wheel tables, see wheel_tables() */
+#define ROT_TABLE_MAX 256
+
 /* Description of a code wheel */
 typedef struct _wheel {
 	wchar_t *name;
@@ -35,8 +40,14 @@ typedef struct _wheel {
 	bool reflector;
 	struct _wheel *next_in_set;
 
-	int *encode; /* Array, code mapping for this wheel   */
-	int *decode; /* Array, inverse mapping for decoding */ 
+	symbol *encode; /* Array, code mapping for this wheel   */
+	symbol *decode; /* Array, inverse mapping for decoding */ 
+
+	/* encode/decode with the wheel turned, alphabet_len x alphabet_len arrays 
+	   indexed by [rotation - ring setting][letter]. See wheel_tables().
+	   NULL for alphabets longer than ROT_TABLE_MAX */
+	symbol *rot_encode;
+	symbol *rot_decode;
 
 	bool *notch; /* Array of notch positions.  */
 	bool *allow_slot; /* Array of slots the wheel will fit into (indexed by slot number) */
@@ -79,8 +90,65 @@ typedef struct {
      perhaps the pin/slot at "P" is active.
   */
 	int pin_offset;
+	int run; /* The slotrun this slot belongs to, or -1 if it is looked up on every keypress */
+
+	/* Pin-blocking as bit masks, see pin_masks() */
+	uint64_t pins;	/* Bit r: a pin is up when the rotation is r */
+	uint64_t blocks;	/* Bit j: the pins block slot j */
 } wheelslot;
 
+/* One state of a notch machine's rotating slots, in a steptable */
+typedef struct {
+	uint32_t next;		/* State after the next keypress */
+	uint32_t turned;	/* Slots turned by that keypress, bit i for slot i */
+	uint32_t moving;	/* Their movement flags after it, and STEP_MOVING_CHANGED */
+} stepentry;
+
+/* The movement flags differ from those before the keypress */
+#define STEP_MOVING_CHANGED (1u << 31)
+
+/* The next state for every state of the rotating slots, see steptable.c */
+typedef struct {
+	int slots;				/* Rotating slots, slot[0] counts fastest in the state number */
+	int *slot;
+	wheel **w;				/* The wheels they had when the table was built */
+	uint32_t mask;		/* The rotating slots, bit i for slot i */
+	uint32_t states;
+	stepentry *entry;
+} steptable;
+
+/* A run of neighbouring slots whose wheels seldom move.
+   Their mappings are folded into one table, recomposed when one of them turns. 
+   The composition is kept in levels, one per slot: level j covers slots first..j
+   Only the levels from the lowest turned slot and up need recomposing. */
+typedef struct {
+	int first, last;  /* Slots in the run */
+	bool reflecting;  /* Run contains the reflector, the maps go there and back again */
+	int dirty;        /* Lowest slot that turned, or INT_MAX if the maps are up to date */
+	int *levels;      /* 2*alphabet_len entries per slot: forward and backward maps */
+	int *fwd;         /* Right to left through the run (the encipher path, when reflecting) */
+	int *back;        /* Left to right through the run (the decipher path, when reflecting) */
+} slotrun;
+
+/* One stage of a signal path: a single slot, or a run of slots */
+typedef struct {
+	int slot;         /* Slot to pass through, if there is no map */
+	bool decode;      /* Use the slot's decode mapping instead of encode */
+	int *map;         /* Composed mapping for a slotrun */
+} pathstage;
+
+/* utf-8 translation for a machine alphabet, see utf8.c */
+typedef struct {
+	int32_t low[0x800];	/* Alphabet index of code points below 0x800, -1 for others */
+	uint8_t ascii_rows[16];	/* Ascii alphabet bitmap, bit c >> 4 of row c & 15 */
+	bool ascii_members;	/* Some alphabet characters are ascii */
+	uint32_t hash_mask;	/* The rest of the alphabet, open addressing */
+	uint32_t *hash_cp;
+	int32_t *hash_idx;
+	char (*enc)[4];			/* utf-8 encoding of each alphabet character */
+	uint8_t *enc_len;
+} utf8map;
+
 /* Description of a code machine */
 typedef struct {
 	bool broken_description;
@@ -95,29 +163,226 @@ typedef struct {
 	/* Needed for UI */
 	int longest_wheelname;
 
+	utf8map *utf8;			/* For the bulk modes, built when the machine is loaded */
+
+	/* Signal paths through the machine, see build_paths() */
+	slotrun *run;
+	int runs;
+	int *run_maps;      /* Storage for the composed maps */
+	bool runs_dirty;		/* Some run needs recomposing */
+	pathstage *enc_path, *dec_path;
+	int enc_stages, dec_stages;
+
+	/* Pin-blocking stepping as bit masks, bit i for slot i. See pin_masks() */
+	bool pin_masks;			/* In use, for up to 64 slots and letters */
+	uint64_t pin_slots;	/* Rotating slots whose pins block something */
+	uint64_t step_slots, fast_slots;
+	uint64_t blocked;		/* Slots that won't move on the next keypress */
+
+	/* Notch stepping by table lookup, see steptable.c */
+	steptable *steps;		/* NULL until built */
+	uint32_t step_state;	/* Current state in the table */
+	uint32_t step_states;	/* Table size, 0 if the machine can't have one */
+	uint32_t step_count;	/* Keypresses with the same wheels, while there is no table */
+
 } machine;
 
-/* UI stuff */
-typedef struct {
-	int attr_plain, attr_coded; /* plain & enciphered text */
-	int attr_wheel_plain, attr_wheel_activ; /* wheel parts */
-	int attr_wheelside_plain, attr_wheelside_activ; 
-	int attr_btn, attr_btnh; /* wheel parts */
-	int attr_lbl, attr_lblh; /* label text */
-	int layout; /* 0 or 1, how to print slot headings. see interactive() */
-	WINDOW *w_wheels;
-	WINDOW *w_code;
-	WINDOW *w_pop;
-	int chosen_wheel;
-} ui_info;
 
 
+void feil(char *m);
+machine *getdescr(char *filename);
+machine *parse_descr(char *filename);
+machine *descr_from_text(const char *text, size_t len);
+void print_tables(machine *m);
+void stream(machine *m, bool enciphering, int in, int out);
+void write_all(int fd, const char *buf, size_t len);
 wchar_t *mbstowcsdup(const char *s);
-int lookup(const wchar_t wc, const wchar_t *ws);
+int alphabet_index(machine *m, wchar_t wc);
 wheel *wheel_lookup(machine *m, wchar_t *name);
 void identity_map(machine *m, wheel *w);
+void wheel_tables(machine *m, wheel *w);
 
+void post_step(machine *m);
+void step(machine *m);
 void step_cleanup(machine *m);
+wchar_t encipher(machine *m, wchar_t c);
+wchar_t decipher(machine *m, wchar_t c);
+void build_paths(machine *m);
+void machine_seek(machine *m, unsigned long long n);
+int stepping_groups(machine *m, int *group);
+void group_settle(machine *m, const int *group, int g);
+void group_turn(machine *m, const int *group, int g);
+machine *machine_clone(machine *m);
+wheel **wheel_orders(machine *m, int *count);
+void free_clone(machine *c);
+
+/* Bulk (de)ciphering of alphabet indices, see enigma.c */
+void encipher_block(machine *m, const symbol *in, symbol *out, size_t n);
+void decipher_block(machine *m, const symbol *in, symbol *out, size_t n);
+size_t wcs_to_symbols(machine *m, const wchar_t *ws, size_t n, symbol *s);
+void symbols_to_wcs(machine *m, const symbol *s, size_t n, wchar_t *ws);
+size_t fold_symbols(machine *m, const wchar_t *ws, symbol *s);
+symbol *read_symbols(machine *m, const char *filename, size_t *n);
+
+/* utf-8 text processing for the file and pipe modes */
+typedef struct {
+	symbol *sym;
+	uint32_t *pos;	/* Where each symbol was in the input */
+} codebuf;
+
+codebuf *new_codebuf();
+void free_codebuf(codebuf *cb);
+void report_throughput(unsigned long long chars, struct timespec *t0);
+size_t code_utf8(machine *m, bool enciphering, const char *in, size_t len, bool final,
+                 size_t *used, size_t *chars, char *out, codebuf *cb);
+
+/* cfg-parser.y */
+machine *parse_machine(const char *text, size_t len);
+void zero_slot(wheelslot *s);
+
+/* parallel.c */
+void parallel_stream(machine *m, bool enciphering, const char *infile, const char *outfile, int threads);
+
+/* multikey.c: many key settings run in lockstep, one lane each */
+typedef struct _multikey multikey;
+
+multikey *multikey_new(machine *m, int lanes);
+void multikey_free(multikey *mk);
+int multikey_lanes(multikey *mk);
+bool multikey_set_lane(multikey *mk, int lane, machine *key);
+void multikey_encipher(multikey *mk, const symbol *in, size_t n, symbol *out);
+void multikey_decipher(multikey *mk, const symbol *in, size_t n, symbol *out);
+
+/* ngram.c: n-gram log probabilities, indexed by alphabet position */
+typedef struct {
+	int n;				/* n-gram length */
+	int al;				/* alphabet length */
+	size_t top;		/* al^(n-1), weight of an n-gram's first symbol */
+	size_t entries;	/* al^n */
+	float *logp;	/* al^n entries */
+	void *map;		/* Mapping that holds logp */
+	size_t mapsize;
+} ngrams;
+
+ngrams *ngram_build(machine *m, const char *corpus);
+ngrams *ngram_open(machine *m, const char *file);
+bool ngram_write(machine *m, const ngrams *g, const char *file);
+void ngram_free(ngrams *g);
+float ngram_score(const ngrams *g, const symbol *s, size_t len);
+
+/* pool.c: work-stealing thread pool */
+typedef void (*pool_work)(void *data, int thread, long item);
+void run_pool(int threads, long items, pool_work work, void *data);
+int pool_threads(int threads);
+
+/* search.c: ciphertext-only key search */
+void key_search(machine *m, const char *cipherfile, const char *corpus, int top, int threads);
+
+/* cache.c: compiled machine descriptions */
+char *cache_name(const char *filename);
+bool compile_descr(char *filename);
+machine *load_cached_descr(const char *filename);
+machine *compact_descr(machine *m);
+
+/* steptable.c: notch stepping as a state table */
+#define STEP_TABLE_MAX (1 << 20)
+uint32_t step_table_size(machine *m);
+steptable *step_table_new(machine *m);
+void step_table_free(steptable *t);
+void step_table_sync(machine *m);
+
+/* utf8.c: utf-8 text straight to alphabet indices */
+utf8map *utf8_map(machine *m);
+size_t utf8_scan(const utf8map *u, const char *in, size_t len, bool final, size_t max,
+                 symbol *sym, uint32_t *pos, size_t *used, size_t *chars);
+int utf8_put(const utf8map *u, symbol s, char *out);
+int utf8_len(unsigned char c);
+
+/* keystate.c: key settings, apart from the shared machine description */
+typedef struct {
+	uint16_t wheel;		/* Position in wheel_list, for T_WHEEL slots */
+	uint16_t rot, ring;
+	bool movement;
+} keyslot;
+
+typedef struct {
+	uint32_t size;		/* Of the whole key, for copying */
+	uint16_t slots, alphabet_len, wirings;
+	keyslot slot[];		/* Followed by the wirings of the rewirable slots */
+} keystate;
+
+keystate *keystate_new(machine *m);
+keystate *keystate_clone(const keystate *k);
+void keystate_save(machine *m, keystate *k);
+void keystate_load(machine *m, const keystate *k);
+
+/* period.c: cycle structure of the stepping */
+#define PERIOD_STATES_MAX (1 << 26)
+void analyze_period(machine *m, int threads);
+
+/* server.c: --serve, encipher requests over a Unix domain socket */
+const char *key_apply(machine *m, const char *key);
+void serve(machine *m, char **names, int n, const char *path, int threads);
+
+/* emit.c: --emit-c, a C engine for one machine */
+void emit_c(machine *m, FILE *f);
+
+/*
+	stats.c: hot path counters and cycle timers. They cost nothing unless
+	compiled with -DENIGMA_STATS (make STATS=-DENIGMA_STATS). Each thread
+	counts in its own block, the blocks are summed by stats_report().
+*/
+typedef enum {
+	ST_LOOKUP,		/* alphabet_index() */
+	ST_UTF8,		/* Symbols from utf8_scan() */
+	ST_STEP_TABLE,	/* Keypresses by step table */
+	ST_STEP_PINS,	/* Keypresses by pin masks */
+	ST_STEP_SLOTS,	/* Keypresses by the slot loop, notch or pins */
+	ST_POST_STEP,
+	ST_RECOMPOSE,	/* recompose_runs() after turning */
+	ST_ENC_PATH,	/* Slot loop of encipher() */
+	ST_DEC_PATH,	/* Slot loop of decipher() */
+	ST_STAGES,		/* Path stages taken */
+	ST_DRAW_WHEEL,	/* draw_wheel_rot() */
+	ST_DRAW_TEXT,	/* Text lines printed */
+	ST_DOUPDATE,
+	STATS
+} statid;
+
+typedef struct statblock {
+	uint64_t count[STATS], cycles[STATS];
+	struct statblock *next;
+} statblock;
+
+extern __thread statblock *stat_local;
+statblock *stat_block(void);
+void stats_at_exit(bool json);
+void stats_report(FILE *f, bool json);
+
+#ifdef ENIGMA_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stat_clock() __rdtsc()
+#else
+#define stat_clock() ((uint64_t)clock())
+#endif
+#define STAT_BLOCK (stat_local ? stat_local : stat_block())
+#define STAT_COUNT(id) (++STAT_BLOCK->count[id])
+#define STAT_ADD(id, n) (STAT_BLOCK->count[id] += (n))
+#define STAT_START(t) uint64_t t = stat_clock()
+#define STAT_STOP(id, t) do { \
+	statblock *_b = STAT_BLOCK; \
+	++_b->count[id]; \
+	_b->cycles[id] += stat_clock() - t; \
+} while (0)
+#else
+#define STAT_COUNT(id) ((void)0)
+#define STAT_ADD(id, n) ((void)0)
+#define STAT_START(t) ((void)0)
+#define STAT_STOP(id, t) ((void)0)
+#endif
 
-void yyerror(machine *m, const char *s, ...);
+/* bombe.c: crib search */
+void bombe_search(machine *m, const char *cipherfile, const char *cribtext, int at, int threads);
 
+#endif
@@ -0,0 +1,73 @@
+/*
+	gapbuf.c
+	Gap buffer for the text of the interactive mode. Each cell holds a
+	typed letter together with its (de)ciphering, so the plaintext and
+	ciphertext lines always line up. All of the text is kept, the screen
+	shows the part around the cursor.
+
+	The text is buf[0 .. gap) followed by buf[gap_end .. size). Inserting at
+	the gap is a store, moving the gap costs the distance moved.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ui.h"
+
+#define GAPBUF_START 256
+
+gapbuf *gapbuf_new(void) {
+	gapbuf *g = malloc(sizeof(gapbuf));
+	if (!g) feil("out of memory for the text\n");
+	g->size = g->gap_end = GAPBUF_START;
+	g->gap = 0;
+	g->buf = malloc(g->size * sizeof(textcell));
+	if (!g->buf) feil("out of memory for the text\n");
+	return g;
+}
+
+void gapbuf_free(gapbuf *g) {
+	free(g->buf);
+	free(g);
+}
+
+size_t gapbuf_len(const gapbuf *g) {
+	return g->size - (g->gap_end - g->gap);
+}
+
+/* Cell i of the text */
+textcell *gapbuf_at(gapbuf *g, size_t i) {
+	return &g->buf[i < g->gap ? i : i + (g->gap_end - g->gap)];
+}
+
+/* Move the gap to text position pos */
+static void gapbuf_move(gapbuf *g, size_t pos) {
+	if (pos < g->gap) {
+		size_t n = g->gap - pos;
+		memmove(g->buf + g->gap_end - n, g->buf + pos, n * sizeof(textcell));
+		g->gap -= n;
+		g->gap_end -= n;
+	} else if (pos > g->gap) {
+		size_t n = pos - g->gap;
+		memmove(g->buf + g->gap, g->buf + g->gap_end, n * sizeof(textcell));
+		g->gap += n;
+		g->gap_end += n;
+	}
+}
+
+/* Insert a cell at text position pos. Doubles the buffer when the gap is used up */
+void gapbuf_insert(gapbuf *g, size_t pos, textcell c) {
+	gapbuf_move(g, pos);
+	if (g->gap == g->gap_end) {
+		size_t tail = g->size - g->gap_end, size = g->size * 2;
+		textcell *buf = realloc(g->buf, size * sizeof(textcell));
+		if (!buf) feil("out of memory for the text\n");
+		memmove(buf + size - tail, buf + g->gap_end, tail * sizeof(textcell));
+		g->buf = buf;
+		g->gap_end = size - tail;
+		g->size = size;
+	}
+	g->buf[g->gap++] = c;
+}
@@ -0,0 +1,101 @@
+/*
+	keystate.c
+	Key settings apart from the machine description.
+
+	A machine description is shared and read-only: alphabet, wheels, notches
+	and the slot mechanics. A keystate holds what the operator sets and what
+	changes while typing: the wheel in each slot, rotations, ring settings,
+	pending movement, and the wiring of plugboards and other rewirable slots.
+	It is one contiguous block of a few hundred bytes, so many sessions can
+	share one description and copy keys with a single memcpy.
+
+	Wheels are stored as their position in wheel_list, which is an array for
+	descriptions from compact_descr() or the cache. Rewirable slots store
+	their wiring instead; loading rewires the machine's wheel in that slot,
+	so load into a machine_clone() when the description is shared.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "enigma.h"
+
+static int wirings(machine *m) {
+	int n = 0;
+	for (int i = 0; i < m->wheelslots; ++i) n += m->slot[i].type != T_WHEEL;
+	return n;
+}
+
+/* A key holding the machine's current settings */
+keystate *keystate_new(machine *m) {
+	int n = m->wheelslots, al = m->alphabet_len, rw = wirings(m);
+	size_t size = sizeof(keystate) + n * sizeof(keyslot) + 2 * rw * al * sizeof(symbol);
+	keystate *k = malloc(size);
+	k->size = size;
+	k->slots = n;
+	k->alphabet_len = al;
+	k->wirings = rw;
+	keystate_save(m, k);
+	return k;
+}
+
+keystate *keystate_clone(const keystate *k) {
+	keystate *c = malloc(k->size);
+	memcpy(c, k, k->size);
+	return c;
+}
+
+/* Encode and decode wiring for each rewirable slot, in slot order */
+static symbol *key_wiring(const keystate *k) {
+	return (symbol *)(k->slot + k->slots);
+}
+
+/* Store the machine's settings in k, which must be made for this description */
+void keystate_save(machine *m, keystate *k) {
+	int al = m->alphabet_len;
+	symbol *wr = key_wiring(k);
+	for (int i = 0; i < m->wheelslots; ++i) {
+		wheelslot *sl = &m->slot[i];
+		keyslot *ks = &k->slot[i];
+		ks->rot = sl->rot;
+		ks->ring = sl->ringstellung;
+		ks->movement = sl->movement;
+		if (sl->type == T_WHEEL) {
+			ks->wheel = sl->w - m->wheel_list;
+		} else {
+			ks->wheel = 0;
+			for (int j = 0; j < al; ++j) {
+				wr[j] = sl->w->encode[j];
+				wr[al + j] = sl->w->decode[j];
+			}
+			wr += 2 * al;
+		}
+	}
+}
+
+/* Set the machine up with the key, ready to encipher */
+void keystate_load(machine *m, const keystate *k) {
+	int al = m->alphabet_len;
+	const symbol *wr = key_wiring(k);
+	for (int i = 0; i < m->wheelslots; ++i) {
+		wheelslot *sl = &m->slot[i];
+		const keyslot *ks = &k->slot[i];
+		sl->rot = ks->rot;
+		sl->ringstellung = ks->ring;
+		if (sl->type == T_WHEEL) {
+			sl->w = m->wheel_list + ks->wheel;
+		} else {
+			for (int j = 0; j < al; ++j) {
+				sl->w->encode[j] = wr[j];
+				sl->w->decode[j] = wr[al + j];
+			}
+			wheel_tables(m, sl->w);
+			wr += 2 * al;
+		}
+	}
+	step_cleanup(m);
+	/* Movement pending from before the key was saved */
+	for (int i = 0; i < m->wheelslots; ++i) m->slot[i].movement = k->slot[i].movement;
+}
@@ -0,0 +1,217 @@
+/*
+	loadgen.c
+	Load generator for enigma --serve. Opens connections to the server
+	socket, each keeps up to depth requests in flight, and checks every
+	answer against the library. Reports requests per second and latency
+	percentiles, from sending a request to having its whole answer.
+
+	The texts are random letters from the machine alphabet, enciphered and
+	deciphered in turn. They start at the key's position, or with -p at a
+	random position below that. Seeking far costs the server time of its
+	own, a machine like fialka-m125 walks there. All requests use the same
+	key, so the server can reuse its key setup.
+
+	loadgen [-c connections] [-n requests] [-d depth] [-l letters] [-p positions] [-k key] socket machine-description
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "enigma.h"
+
+/* Clients make their frames, then all start together */
+static pthread_barrier_t start;
+
+typedef struct {
+	const char *socket, *machine_name, *key;
+	machine *m;
+	int requests, depth, letters, positions;
+	unsigned seed;
+	double *latency;	/* Per request */
+	long failed;
+} client;
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+	for (char *p = buf; len; ) {
+		ssize_t r = read(fd, p, len);
+		if (r <= 0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static void put(char **p, const void *v, size_t len) {
+	memcpy(*p, v, len);
+	*p += len;
+}
+
+/* A request frame, and the answer it should get */
+static char *make_request(client *cl, machine *c, const keystate *key, codebuf *cb, uint32_t id, size_t *frame_len, char **expect, size_t *expect_len) {
+	wchar_t *ws = malloc((cl->letters + 1) * sizeof(wchar_t));
+	for (int i = 0; i < cl->letters; ++i) ws[i] = cl->m->alphabet[rand_r(&cl->seed) % cl->m->alphabet_len];
+	ws[cl->letters] = 0;
+	size_t tl = wcstombs(NULL, ws, 0);
+	char *text = malloc(tl + 1);
+	wcstombs(text, ws, tl + 1);
+	free(ws);
+	uint64_t position = cl->positions ? rand_r(&cl->seed) % cl->positions : 0;
+	bool enciphering = id % 2 == 0;
+
+	keystate_load(c, key);
+	machine_seek(c, position);
+	*expect = malloc(tl * MB_LEN_MAX + STREAMBUF * MB_LEN_MAX);
+	*expect_len = 0;
+	for (size_t pos = 0; pos < tl; ) {
+		size_t used, chars;
+		*expect_len += code_utf8(c, enciphering, text + pos, tl - pos, true, &used, &chars, *expect + *expect_len, cb);
+		pos += used;
+	}
+
+	uint16_t ml = strlen(cl->machine_name), kl = strlen(cl->key);
+	uint32_t len = 4 + 1 + 8 + 2 + ml + 2 + kl + 4 + tl, text_len = tl;
+	char *frame = malloc(4 + len), *p = frame;
+	put(&p, &len, 4);
+	put(&p, &id, 4);
+	*p++ = enciphering ? 'e' : 'd';
+	put(&p, &position, 8);
+	put(&p, &ml, 2);
+	put(&p, cl->machine_name, ml);
+	put(&p, &kl, 2);
+	put(&p, cl->key, kl);
+	put(&p, &text_len, 4);
+	put(&p, text, tl);
+	free(text);
+	*frame_len = 4 + len;
+	return frame;
+}
+
+static void *client_main(void *arg) {
+	client *cl = arg;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, cl->socket, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) feil("cannot connect to the server\n");
+
+	machine *c = machine_clone(cl->m);
+	keystate *key = keystate_new(c);
+	const char *err = key_apply(c, cl->key);
+	if (err) {
+		fprintf(stderr, "%s\n", err);
+		exit(1);
+	}
+	step_cleanup(c);
+	keystate_save(c, key);
+
+	/* Frames made up front, so the timing is the server's */
+	char **frame = malloc(cl->requests * sizeof(char *)), **expect = malloc(cl->requests * sizeof(char *));
+	size_t *frame_len = malloc(cl->requests * sizeof(size_t)), *expect_len = malloc(cl->requests * sizeof(size_t));
+	double *sent = malloc(cl->requests * sizeof(double));
+	codebuf *cb = new_codebuf();
+	for (int i = 0; i < cl->requests; ++i) frame[i] = make_request(cl, c, key, cb, i, &frame_len[i], &expect[i], &expect_len[i]);
+	free_codebuf(cb);
+	pthread_barrier_wait(&start);
+
+	char *answer = NULL;
+	size_t answer_size = 0;
+	for (int next = 0, done = 0; done < cl->requests; ) {
+		for (; next < cl->requests && next - done < cl->depth; ++next) {
+			sent[next] = now();
+			if (write(fd, frame[next], frame_len[next]) != (ssize_t)frame_len[next]) feil("cannot send to the server\n");
+		}
+		uint32_t len, id;
+		if (!read_full(fd, &len, 4) || len < 5) feil("the server hung up\n");
+		if (len > answer_size) answer = realloc(answer, answer_size = len);
+		if (!read_full(fd, answer, len)) feil("the server hung up\n");
+		memcpy(&id, answer, 4);
+		if (id >= (uint32_t)cl->requests) feil("answer to an unknown request\n");
+		cl->latency[done++] = now() - sent[id];
+		if (answer[4] || len - 5 != expect_len[id] || memcmp(answer + 5, expect[id], expect_len[id])) {
+			if (!cl->failed++) fprintf(stderr, "wrong answer to request %u: %.*s\n", id, (int)(len - 5), answer + 5);
+		}
+	}
+	close(fd);
+	for (int i = 0; i < cl->requests; ++i) {
+		free(frame[i]);
+		free(expect[i]);
+	}
+	free(frame);
+	free(expect);
+	free(frame_len);
+	free(expect_len);
+	free(sent);
+	free(answer);
+	free(key);
+	free_clone(c);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	if (setlocale(LC_ALL, "") == NULL) feil("Bad locale, please configure your computer correctly.\n");
+	int connections = 4, requests = 100000, depth = 16, letters = 100, positions = 0;
+	const char *key = "";
+	int i;
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-c")) connections = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-n")) requests = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-d")) depth = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-l")) letters = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-p")) positions = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "-k")) key = argv[i + 1];
+		else break;
+	}
+	if (argc - i != 2 || connections < 1 || requests < connections || depth < 1 || letters < 0 || positions < 0) {
+		feil("loadgen [-c connections] [-n requests] [-d depth] [-l letters] [-p positions] [-k key] socket machine-description\n");
+	}
+	machine *m = getdescr(argv[i + 1]);
+	if (!m) feil("Unuseable machine description\n");
+	step_cleanup(m);
+
+	client *cl = calloc(connections, sizeof(client));
+	double *latency = malloc(requests * sizeof(double));
+	pthread_t *tid = malloc(connections * sizeof(pthread_t));
+	for (int c = 0, first = 0; c < connections; ++c) {
+		int n = requests / connections + (c < requests % connections);
+		cl[c] = (client){argv[i], argv[i + 1], key, m, n, depth, letters, positions, c + 1, latency + first, 0};
+		first += n;
+	}
+	pthread_barrier_init(&start, NULL, connections + 1);
+	for (int c = 0; c < connections; ++c) if (pthread_create(&tid[c], NULL, client_main, &cl[c])) feil("cannot start thread\n");
+	pthread_barrier_wait(&start);
+	double t0 = now();
+	long failed = 0;
+	for (int c = 0; c < connections; ++c) {
+		pthread_join(tid[c], NULL);
+		failed += cl[c].failed;
+	}
+	double t = now() - t0;
+
+	qsort(latency, requests, sizeof(double), cmp_double);
+	printf("%i requests of %i letters, %i connections, %i in flight each\n", requests, letters, connections, depth);
+	printf("%.0f requests/s, %.1f Mletters/s\n", requests / t, (double)requests * letters / t / 1e6);
+	printf("latency us    p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", latency[requests / 2] * 1e6,
+	       latency[requests * 99 / 100] * 1e6, latency[requests * 999 / 1000] * 1e6, latency[requests - 1] * 1e6);
+	if (failed) printf("%li wrong answers\n", failed);
+	return failed != 0;
+}
@@ -0,0 +1,177 @@
+/*
+	main.c
+	Command line for the enigma simulator: interactive, file and search modes.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#define _XOPEN_SOURCE_EXTENDED 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ui.h"
+
+int main(int argc, char *argv[]) {
+	/* setlocale(), so mbtowc() etc will work. 
+     We may want to encode/decode non-ascii stuff. 
+     Spies works with many scripts . . . */
+	if (setlocale(LC_ALL, "") == NULL) feil("Bad locale, please configure your computer correctly. Install the locale package, and/or set the LANG environment variable.\n");
+	fwide(stdout,1);
+
+	char mode = 0; /* -t, -e, -d, s for --search, b for --bombe, g for --ngrams, c for --compile, a for --analyze-period, r for --replay, S for --serve, E for --emit-c, or interactive */
+	unsigned long long position = 0;
+	int threads = 0;
+	char *cipherfile = NULL, *corpus = NULL, *crib = NULL, *ngramfile = NULL, *keyfile = NULL, *sockname = NULL;
+	int top = 0, at = -1;
+	int stats = 0; /* 1 for a table, 2 for JSON */
+	/* In and out files, or for --serve, more machine descriptions */
+	char **file = calloc(argc + 1, sizeof(char *));
+	int files = 0;
+	bool usage = argc < 2;
+	for (int i = 2; i < argc && !usage; ++i) {
+		if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "-e") || !strcmp(argv[i], "-d")) {
+			usage = mode;
+			mode = argv[i][1];
+		} else if (!strcmp(argv[i], "--compile")) {
+			usage = mode;
+			mode = 'c';
+		} else if (!strcmp(argv[i], "--emit-c")) {
+			usage = mode;
+			mode = 'E';
+		} else if (!strcmp(argv[i], "--analyze-period")) {
+			usage = mode;
+			mode = 'a';
+		} else if (!strcmp(argv[i], "--replay") && i + 1 < argc && !keyfile) {
+			usage = mode;
+			mode = 'r';
+			keyfile = argv[++i];
+		} else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+			usage = mode;
+			mode = 'S';
+			sockname = argv[++i];
+		} else if (!strcmp(argv[i], "--search") && i + 1 < argc) {
+			usage = mode;
+			mode = 's';
+			cipherfile = argv[++i];
+		} else if (!strcmp(argv[i], "--bombe") && i + 1 < argc) {
+			usage = mode;
+			mode = 'b';
+			cipherfile = argv[++i];
+		} else if (!strcmp(argv[i], "--ngrams") && i + 2 < argc) {
+			usage = mode;
+			mode = 'g';
+			corpus = argv[++i];
+			ngramfile = argv[++i];
+		} else if (!strcmp(argv[i], "--crib") && i + 1 < argc) crib = argv[++i];
+		else if (!strcmp(argv[i], "--record") && i + 1 < argc && !keyfile) keyfile = argv[++i];
+		else if (!strcmp(argv[i], "--at") && i + 1 < argc) usage = (at = atoi(argv[++i])) < 0;
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc) corpus = argv[++i];
+		else if (!strcmp(argv[i], "--top") && i + 1 < argc) usage = (top = atoi(argv[++i])) < 1;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc) position = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) usage = (threads = atoi(argv[++i])) < 1;
+		else if (!strcmp(argv[i], "--stats")) stats = 1;
+		else if (!strcmp(argv[i], "--stats=json")) stats = 2;
+		else if (argv[i][0] != '-') file[files++] = argv[i];
+		else usage = true;
+	}
+	bool streaming = mode == 'e' || mode == 'd';
+	bool searching = mode == 's' || mode == 'b';
+	if (!streaming && ((files && mode != 'S') || (position && mode != 'a') || (threads && !searching && mode != 'a' && mode != 'S'))) usage = true;
+	if (streaming && files > 2) usage = true;
+	if (threads && streaming && files < 2) usage = true;
+	if ((mode != 's' && mode != 'g' && corpus) || (mode != 's' && top)) usage = true;
+	if ((mode == 'b') != (crib != NULL) || (mode != 'b' && at >= 0)) usage = true;
+	if (keyfile && mode && mode != 'r') usage = true;
+
+  if (usage) {
+		feil("enigma machine-description [-t | -e | -d [-p position] [-j threads infile outfile | [infile [outfile]]]\n"
+		     "enigma machine-description --search ciphertext [-n corpus] [--top K] [-j threads]\n"
+		     "enigma machine-description --bombe ciphertext --crib text [--at position] [-j threads]\n"
+		     "enigma machine-description --ngrams corpus ngramfile\n"
+		     "enigma machine-description --compile\n"
+		     "enigma machine-description --emit-c > engine.c\n"
+		     "enigma machine-description --analyze-period [-p position] [-j threads]\n"
+		     "enigma machine-description [--record keylog | --replay keylog]\n"
+		     "enigma machine-description --serve socket [-j threads] [more-descriptions]\n"
+		     " -t prints wheel tables\n"
+		     " -e enciphers infile (or stdin) to outfile (or stdout)\n"
+		     " -d deciphers infile (or stdin) to outfile (or stdout)\n"
+		     " -p starts that many keypresses into the message\n"
+		     " -j splits the work on several threads, for big files\n"
+		     " --search looks for the key of a ciphertext, without a crib\n"
+		     " -n ranks the keys by n-grams from a corpus or ngramfile, instead of index of coincidence\n"
+		     " --top how many keys to report, default 10\n"
+		     " --bombe looks for the key of a ciphertext, given a crib of known plaintext\n"
+		     " --at where the crib starts, in letters. Without it, all possible places are tried\n"
+		     " --ngrams compiles the n-grams of a corpus to a file, for fast loading with -n\n"
+		     " --compile stores the parsed machine next to its description, later runs load it instead of parsing\n"
+		     " --emit-c writes a C engine for this machine, with the description compiled in and the default key\n"
+		     " --analyze-period reports the stepping period from the start position, and the cycle lengths over all start positions\n"
+		     " --record writes the keys typed in the interactive mode to a file\n"
+		     " --replay runs the interactive mode on a recorded key log without a terminal, and reports the latency per key\n"
+		     " --serve answers encipher requests for the given machines on a Unix socket until interrupted, see server.c for the protocol\n"
+		     " --stats, --stats=json report hot path counters and timers at exit, for a build with ENIGMA_STATS\n");
+	}
+#ifdef ENIGMA_STATS
+	if (stats) stats_at_exit(stats == 2);
+#else
+	if (stats) feil("--stats needs a build with ENIGMA_STATS: make clean; make STATS=-DENIGMA_STATS\n");
+#endif
+	if (mode == 'c') {
+		if (!compile_descr(argv[1])) feil("cannot compile the machine description\n");
+		return 0;
+	}
+  machine *m=getdescr(argv[1]);
+  if (!m) feil("Unuseable machine description\n");
+  
+  if (mode == 't') print_tables(m); 
+	else if (mode == 'E') emit_c(m, stdout);
+	else if (mode == 's') key_search(m, cipherfile, corpus, top ? top : 10, threads);
+	else if (mode == 'b') bombe_search(m, cipherfile, crib, at, threads);
+	else if (mode == 'a') {
+		machine_seek(m, position);
+		analyze_period(m, threads);
+	}
+	else if (mode == 'g') {
+		ngrams *g = ngram_build(m, corpus);
+		if (!g) feil("cannot read the corpus\n");
+		if (!ngram_write(m, g, ngramfile)) feil("cannot write the n-gram file\n");
+		ngram_free(g);
+	}
+	else if (streaming && threads) {
+		machine_seek(m, position);
+		parallel_stream(m, mode == 'e', file[0], file[1], threads);
+	} else if (streaming) {
+		int in = file[0] ? open(file[0], O_RDONLY) : 0;
+		if (in < 0) feil("cannot open input file\n");
+		int out = file[1] ? open(file[1], O_WRONLY | O_CREAT | O_TRUNC, 0666) : 1;
+		if (out < 0) feil("cannot open output file\n");
+		machine_seek(m, position);
+		stream(m, mode == 'e', in, out);
+	}
+	else if (mode == 'S') {
+		char **names = malloc((files + 1) * sizeof(char *));
+		names[0] = argv[1];
+		memcpy(names + 1, file, files * sizeof(char *));
+		serve(m, names, files + 1, sockname, threads);
+	}
+	else if (mode == 'r') {
+		keylog *log = keylog_replay(keyfile);
+		if (!log) feil("cannot read the key log\n");
+		interactive(m, log);
+		keylog_report(log);
+		keylog_close(log);
+	} else if (keyfile) {
+		keylog *log = keylog_record(keyfile);
+		if (!log) feil("cannot write the key log\n");
+		interactive(m, log);
+		keylog_close(log);
+	}
+  else interactive(m, NULL);
+}
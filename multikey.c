@@ -0,0 +1,307 @@
+/*
+	multikey.c
+	Run many key settings of the same machine in lockstep, for key search
+	and trial decryption. One lane per key setting, the lanes hold their own
+	wheel order, rotations and ring settings. All lanes take the same input.
+
+	State is kept as structure-of-arrays, so a vector holds the same slot
+	for several lanes. Wheel lookups are gathers from one table arena.
+	AVX-512 or AVX2 is used when the compiler targets it (-march=native),
+	otherwise the same code runs on plain vectors with scalar lookups.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+#include <immintrin.h>
+
+#include "enigma.h"
+
+#if defined(__AVX512F__)
+#define VW 16
+#elif defined(__AVX2__)
+#define VW 8
+#else
+#define VW 4
+#endif
+
+/* VW lanes of 32-bit integers */
+typedef int32_t vint __attribute__((vector_size(VW * 4)));
+
+static inline vint gather(const int32_t *base, vint idx) {
+#if defined(__AVX512F__)
+	return (vint)_mm512_i32gather_epi32((__m512i)idx, base, 4);
+#elif defined(__AVX2__)
+	return (vint)_mm256_i32gather_epi32(base, (__m256i)idx, 4);
+#else
+	vint r;
+	for (int i = 0; i < VW; ++i) r[i] = base[idx[i]];
+	return r;
+#endif
+}
+
+/* Where a wheel's tables are in the arena */
+typedef struct {
+	wheel *w;
+	int32_t enc, dec, notch;
+} arena_wheel;
+
+struct _multikey {
+	machine *m;
+	int lanes;			/* A multiple of VW */
+	int groups;			/* lanes / VW */
+	bool reflector;
+	int32_t *arena;	/* Rotated encode & decode tables, notch tables */
+	arena_wheel *aw;
+	int wheels;
+	int32_t per_wheel, nonotch;
+	/* Tables of each lane's own for the slots that are not T_WHEEL, in the arena from 'wired' */
+	int32_t wired;
+	int *wired_of;	/* Per slot, its number among those, -1 for T_WHEEL */
+	/* Per slot and lane, indexed [slot * groups + group] */
+	vint *rot, *ring, *movement;
+	vint *enc, *dec, *notch;	/* Arena offsets for the wheel in the slot */
+};
+
+static arena_wheel *find_wheel(multikey *mk, wheel *w) {
+	for (int i = 0; i < mk->wheels; ++i) if (mk->aw[i].w == w) return &mk->aw[i];
+	return NULL;
+}
+
+/* Put lane number 'lane' in vector v (a vint array indexed by group) */
+static inline void set_lane(vint *v, int lane, int32_t x) {
+	v[lane / VW][lane % VW] = x;
+}
+
+/*
+	The lane's own tables for slot i, a plugboard or rewirable slot, with
+	the current wiring of w. Made like wheel_tables(), from encode and
+	decode, and only when the wiring differs from what the lane has.
+*/
+static arena_wheel lane_wheel(multikey *mk, int lane, int i, wheel *w) {
+	int al = mk->m->alphabet_len;
+	arena_wheel a = {w, mk->wired + (mk->wired_of[i] * mk->lanes + lane) * mk->per_wheel};
+	a.dec = a.enc + al * al;
+	int32_t *e = mk->arena + a.enc, *d = mk->arena + a.dec, *n = d + al * al;
+	a.notch = w->notch ? a.dec + al * al : mk->nonotch;
+
+	/* Row 0, for rotation 0, is the wiring itself */
+	bool same = true;
+	for (int l = 0; l < al && same; ++l) same = e[l] == w->encode[l] && n[l] == (w->notch && w->notch[l]);
+	if (same) return a;
+	for (int k = 0; k < al; ++k) for (int l = 0, j = k; l < al; ++l) {
+		int x = w->encode[j] - k, y = w->decode[j] - k;
+		e[k * al + l] = x < 0 ? x + al : x;
+		d[k * al + l] = y < 0 ? y + al : y;
+		if (++j == al) j = 0;
+	}
+	for (int l = 0; l < al; ++l) n[l] = w->notch && w->notch[l];
+	return a;
+}
+
+/*
+	Set one lane to the wheel order, rotations and ring settings of 'key',
+	a machine with the same description as the one the multikey was made for,
+	or a machine_clone() of it. The wiring in slots that are not T_WHEEL is
+	copied for the lane as it is now, whoever owns the wheel there.
+	Returns false, with the lane left as it was, if the key's reflector
+	choice doesn't match the others or a wheel is not from the description.
+*/
+bool multikey_set_lane(multikey *mk, int lane, machine *key) {
+	int n = key->wheelslots;
+	if (lane < 0 || lane >= mk->lanes || n != mk->m->wheelslots) return false;
+	if (n && key->slot[0].w->reflector != mk->reflector) return false;
+	arena_wheel *found[n ? n : 1];
+	for (int i = 0; i < n; ++i) {
+		found[i] = mk->wired_of[i] < 0 ? find_wheel(mk, key->slot[i].w) : NULL;
+		if (!found[i] && (mk->wired_of[i] < 0 || !key->slot[i].w)) return false;
+	}
+	int g = mk->groups;
+	for (int i = 0; i < n; ++i) {
+		wheelslot *sl = &key->slot[i];
+		arena_wheel a = found[i] ? *found[i] : lane_wheel(mk, lane, i, sl->w);
+		set_lane(&mk->enc[i * g], lane, a.enc);
+		set_lane(&mk->dec[i * g], lane, a.dec);
+		set_lane(&mk->notch[i * g], lane, a.notch);
+		set_lane(&mk->rot[i * g], lane, sl->rot);
+		set_lane(&mk->ring[i * g], lane, sl->ringstellung);
+		set_lane(&mk->movement[i * g], lane, sl->movement ? -1 : 0);
+	}
+	return true;
+}
+
+/*
+	Set up a multikey with room for at least 'lanes' key settings.
+	The wheel wirings are copied now. Plugboards and other slots that are
+	not T_WHEEL are copied when a lane is set, so a rewiring is seen from
+	the next multikey_set_lane(). All lanes start out with the machine's
+	current setting.
+	Returns NULL for alphabets too long for wheel tables.
+*/
+multikey *multikey_new(machine *m, int lanes) {
+	int al = m->alphabet_len, n = m->wheelslots;
+	if (al > ROT_TABLE_MAX) return NULL;
+	multikey *mk = calloc(1, sizeof(multikey));
+	mk->m = m;
+	mk->groups = (lanes + VW - 1) / VW;
+	if (!mk->groups) mk->groups = 1;
+	mk->lanes = mk->groups * VW;
+	mk->reflector = n && m->slot[0].w->reflector;
+
+	/* The wheel set is a circular list */
+	wheel *w = m->wheel_list;
+	if (w) do {
+		++mk->wheels;
+		w = w->next_in_set;
+	} while (w != m->wheel_list);
+	mk->aw = malloc(mk->wheels * sizeof(arena_wheel));
+	int per_wheel = mk->per_wheel = 2 * al * al + al, wired = 0;
+	mk->wired_of = malloc((n ? n : 1) * sizeof(int));
+	for (int i = 0; i < n; ++i) mk->wired_of[i] = m->slot[i].type == T_WHEEL ? -1 : wired++;
+	int32_t nonotch = mk->nonotch = mk->wheels * per_wheel; /* all zeros */
+	mk->wired = nonotch + al;
+	mk->arena = calloc(mk->wired + (size_t)wired * mk->lanes * per_wheel, sizeof(int32_t));
+	w = m->wheel_list;
+	for (int i = 0; i < mk->wheels; ++i, w = w->next_in_set) {
+		arena_wheel *a = &mk->aw[i];
+		a->w = w;
+		a->enc = i * per_wheel;
+		a->dec = a->enc + al * al;
+		a->notch = w->notch ? a->dec + al * al : nonotch;
+		if (!w->rot_encode) wheel_tables(m, w);
+		for (int j = 0; j < al * al; ++j) {
+			mk->arena[a->enc + j] = w->rot_encode[j];
+			mk->arena[a->dec + j] = w->rot_decode[j];
+		}
+		if (w->notch) for (int j = 0; j < al; ++j) mk->arena[a->notch + j] = w->notch[j];
+	}
+
+	int vecs = n * mk->groups;
+	vint *v = aligned_alloc(sizeof(vint), (6 * vecs + 1) * sizeof(vint));
+	mk->rot = v;
+	mk->ring = v + vecs;
+	mk->movement = v + 2 * vecs;
+	mk->enc = v + 3 * vecs;
+	mk->dec = v + 4 * vecs;
+	mk->notch = v + 5 * vecs;
+	for (int lane = 0; lane < mk->lanes; ++lane) multikey_set_lane(mk, lane, m);
+	return mk;
+}
+
+void multikey_free(multikey *mk) {
+	free(mk->rot);
+	free(mk->arena);
+	free(mk->aw);
+	free(mk->wired_of);
+	free(mk);
+}
+
+int multikey_lanes(multikey *mk) {
+	return mk->lanes;
+}
+
+/* The state of VW lanes while running, kept apart from the rest for locality */
+typedef struct {
+	vint *rot, *movement;
+	vint *ering, *dring;	/* Table rows for the current rotations: arena offset + (rot - ring) * al */
+} lanes;
+
+static inline vint table_row(multikey *mk, vint *tab, int i, int g, vint rot) {
+	int al = mk->m->alphabet_len;
+	vint off = rot - mk->ring[i * mk->groups + g];
+	off += (off < 0) & al;
+	return tab[i * mk->groups + g] + off * al;
+}
+
+/* turn_wheels() and post_step() for VW lanes */
+static inline void mk_step(multikey *mk, int g, lanes *ls) {
+	machine *m = mk->m;
+	int n = m->wheelslots, G = mk->groups;
+	vint al = (vint){} + m->alphabet_len;
+	vint reset = (vint){} + (m->steptype == T_PIN_BLOCKING ? -1 : 0);
+	for (int i = n; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (!s->step) continue;
+		vint moving = s->fast ? (vint){} - 1 : ls->movement[i];
+		vint r = ls->rot[i] + (moving & s->step);
+		r -= (r >= al) & al;
+		ls->rot[i] = r;
+		ls->ering[i] = table_row(mk, mk->enc, i, g, r);
+		ls->dring[i] = table_row(mk, mk->dec, i, g, r);
+		ls->movement[i] = reset;
+	}
+	for (int i = n; i--; ) {
+		wheelslot *s = &m->slot[i];
+		if (!s->step || !s->affect_slots) continue;
+		vint pos = ls->rot[i] + s->pin_offset;
+		pos -= (pos >= al) & al;
+		vint hit = gather(mk->arena, mk->notch[i * G + g] + pos) != 0;
+		for (int j = s->affect_slots; j--; ) {
+			vint *mv = &ls->movement[s->affect_slot[j]];
+			if (m->steptype == T_NOTCH_ENABLING) *mv |= hit;
+			else *mv &= ~hit;
+		}
+	}
+}
+
+/* The paths of encipher() and decipher(), without the cached runs */
+static inline vint mk_encipher_path(multikey *mk, lanes *ls, vint l) {
+	int n = mk->m->wheelslots;
+	for (int i = n; i--; ) l = gather(mk->arena, ls->ering[i] + l);
+	if (mk->reflector) for (int i = 1; i < n; ++i) l = gather(mk->arena, ls->dring[i] + l);
+	return l;
+}
+
+static inline vint mk_decipher_path(multikey *mk, lanes *ls, vint l) {
+	int n = mk->m->wheelslots;
+	if (mk->reflector) for (int i = n; --i; ) l = gather(mk->arena, ls->ering[i] + l);
+	for (int i = 0; i < n; ++i) l = gather(mk->arena, ls->dring[i] + l);
+	return l;
+}
+
+/*
+	Encipher or decipher the same n symbols in every lane.
+	The output for lane k is out[k*n ... k*n + n-1]
+	A symbol's trip through the machine is a chain of dependent gathers,
+	so up to INTERLEAVE groups are run side by side to hide the latency.
+*/
+#define INTERLEAVE 4
+static void mk_run(multikey *mk, bool enciphering, const symbol *in, size_t n, symbol *out) {
+	int slots = mk->m->wheelslots, G = mk->groups;
+	vint state[INTERLEAVE][4][slots];
+	lanes ls[INTERLEAVE];
+	for (int g0 = 0; g0 < G; g0 += INTERLEAVE) {
+		int groups = G - g0 < INTERLEAVE ? G - g0 : INTERLEAVE;
+		for (int b = 0; b < groups; ++b) {
+			int g = g0 + b;
+			ls[b] = (lanes){state[b][0], state[b][1], state[b][2], state[b][3]};
+			for (int i = 0; i < slots; ++i) {
+				ls[b].rot[i] = mk->rot[i * G + g];
+				ls[b].movement[i] = mk->movement[i * G + g];
+				ls[b].ering[i] = table_row(mk, mk->enc, i, g, ls[b].rot[i]);
+				ls[b].dring[i] = table_row(mk, mk->dec, i, g, ls[b].rot[i]);
+			}
+		}
+		for (size_t i = 0; i < n; ++i) {
+			for (int b = 0; b < groups; ++b) {
+				mk_step(mk, g0 + b, &ls[b]);
+				vint l = (vint){} + in[i];
+				l = enciphering ? mk_encipher_path(mk, &ls[b], l) : mk_decipher_path(mk, &ls[b], l);
+				symbol *o = out + (size_t)(g0 + b) * VW * n + i;
+				for (int k = 0; k < VW; ++k) o[k * n] = l[k];
+			}
+		}
+		for (int b = 0; b < groups; ++b) for (int i = 0; i < slots; ++i) {
+			mk->rot[i * G + g0 + b] = ls[b].rot[i];
+			mk->movement[i * G + g0 + b] = ls[b].movement[i];
+		}
+	}
+}
+
+void multikey_encipher(multikey *mk, const symbol *in, size_t n, symbol *out) {
+	mk_run(mk, true, in, n, out);
+}
+
+void multikey_decipher(multikey *mk, const symbol *in, size_t n, symbol *out) {
+	mk_run(mk, false, in, n, out);
+}
@@ -0,0 +1,174 @@
+/*
+	ngram.c
+	n-gram statistics for scoring candidate plaintexts.
+	Tables are indexed by alphabet position, so they fit any machine alphabet.
+	An n-gram a b c ... has index ((a * al + b) * al + c) ...
+
+	A table can be compiled to a file once, and mapped from it at startup.
+	The file is a page of header, then the al^n floats in host byte order.
+	The header has a hash of the alphabet, so a table made for one machine
+	alphabet is not used with another.
+	Tables are megabytes, so they go in huge pages when the kernel has them.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "enigma.h"
+
+/* Longest n-gram that keeps the table below this many entries */
+#define NGRAM_MAX_ENTRIES (1 << 24)
+
+/* The table starts this far into the file, so the mapping is page aligned */
+#define NGRAM_HEADER 4096
+#define HUGE_PAGE (2 << 20)
+
+static const char ngram_magic[8] = "ENIGRAM1";
+
+typedef struct {
+	char magic[8];
+	uint32_t n, al;
+	uint64_t alphabet;	/* Hash of the machine alphabet */
+	uint64_t entries;
+} ngram_header;
+
+/* FNV-1a over the alphabet's characters */
+static uint64_t alphabet_hash(machine *m) {
+	uint64_t h = 14695981039346656037ULL;
+	for (int i = 0; i < m->alphabet_len; ++i) {
+		h ^= (uint32_t)m->alphabet[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void ngram_sizes(ngrams *g) {
+	g->top = 1;
+	for (int i = 1; i < g->n; ++i) g->top *= g->al;
+	g->entries = g->top * g->al;
+}
+
+/* Anonymous memory for a table, in huge pages if there are any. size is rounded up */
+static void *table_alloc(size_t *size) {
+	size_t huge = *size = (*size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+	void *p = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) return p;
+	/* No reserved huge pages, ask for transparent ones */
+	p = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+	madvise(p, huge, MADV_HUGEPAGE);
+	return p;
+}
+
+/*
+	Count the n-grams of a corpus in the machine's alphabet, and turn the counts
+	into log10 probabilities. Unseen n-grams get a floor below the rarest seen.
+	n is 4 (quadgrams), or less for big alphabets.
+*/
+ngrams *ngram_build(machine *m, const char *corpus) {
+	size_t len;
+	symbol *s = read_symbols(m, corpus, &len);
+	if (!s) return NULL;
+	ngrams *g = calloc(1, sizeof(ngrams));
+	g->al = m->alphabet_len;
+	for (g->n = 4; ; --g->n) {
+		ngram_sizes(g);
+		if (g->entries <= NGRAM_MAX_ENTRIES || g->n == 1) break;
+	}
+	g->mapsize = g->entries * sizeof(float);
+	if (len < (size_t)g->n || !(g->map = table_alloc(&g->mapsize))) {
+		free(s);
+		free(g);
+		return NULL;
+	}
+	g->logp = g->map;
+	size_t total = len - g->n + 1;
+	for (size_t i = 0; i < total; ++i) {
+		size_t ix = 0;
+		for (int j = 0; j < g->n; ++j) ix = ix * g->al + s[i + j];
+		g->logp[ix] += 1;
+	}
+	free(s);
+	float floor = log10f(0.01f / total);
+	for (size_t i = 0; i < g->entries; ++i) g->logp[i] = g->logp[i] ? log10f(g->logp[i] / total) : floor;
+	return g;
+}
+
+/* Write a table for mapping with ngram_open(). Returns false on failure */
+bool ngram_write(machine *m, const ngrams *g, const char *file) {
+	FILE *f = fopen(file, "wb");
+	if (!f) return false;
+	char header[NGRAM_HEADER] = {0};
+	ngram_header h = {.n = g->n, .al = g->al, .alphabet = alphabet_hash(m), .entries = g->entries};
+	memcpy(h.magic, ngram_magic, sizeof(h.magic));
+	memcpy(header, &h, sizeof(h));
+	bool ok = fwrite(header, NGRAM_HEADER, 1, f) == 1 &&
+	          fwrite(g->logp, sizeof(float), g->entries, f) == g->entries;
+	return !fclose(f) && ok;
+}
+
+/*
+	A table from 'file': mapped if it is a compiled table,
+	otherwise the file is taken as a corpus and counted.
+	NULL if the file can't be read, or is compiled for another alphabet.
+*/
+ngrams *ngram_open(machine *m, const char *file) {
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return NULL;
+	ngram_header h;
+	struct stat st;
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, ngram_magic, sizeof(h.magic))) {
+		close(fd);
+		return ngram_build(m, file);
+	}
+	ngrams *g = calloc(1, sizeof(ngrams));
+	g->n = h.n;
+	g->al = h.al;
+	if (g->n >= 1 && g->n <= 4) ngram_sizes(g);
+	g->mapsize = NGRAM_HEADER + g->entries * sizeof(float);
+	if (!g->entries || g->entries != h.entries || g->al != m->alphabet_len || h.alphabet != alphabet_hash(m) ||
+	    fstat(fd, &st) || (size_t)st.st_size != g->mapsize ||
+	    (g->map = mmap(NULL, g->mapsize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		free(g);
+		return NULL;
+	}
+	close(fd);
+	/* Huge pages for file mappings need kernel support, this is only a hint */
+	madvise(g->map, g->mapsize, MADV_HUGEPAGE);
+	madvise(g->map, g->mapsize, MADV_WILLNEED);
+	g->logp = (float *)((char *)g->map + NGRAM_HEADER);
+	return g;
+}
+
+void ngram_free(ngrams *g) {
+	if (!g) return;
+	munmap(g->map, g->mapsize);
+	free(g);
+}
+
+/*
+	Sum of the log probabilities of all n-grams in s. Higher is more like the corpus.
+	The index rolls along: drop the oldest symbol, shift, add the new one.
+*/
+float ngram_score(const ngrams *g, const symbol *s, size_t len) {
+	int n = g->n, al = g->al;
+	if (len < (size_t)n) return 0;
+	size_t ix = 0, top = g->top;
+	for (int j = 0; j < n - 1; ++j) ix = ix * al + s[j];
+	float score = 0;
+	for (size_t i = n - 1; i < len; ++i) {
+		ix = ix * al + s[i];
+		score += g->logp[ix];
+		ix -= s[i - n + 1] * top;
+	}
+	return score;
+}
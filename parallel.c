@@ -0,0 +1,165 @@
+/*
+	parallel.c
+	Multi-threaded encipher/decipher of big files.
+
+	The input file is memory-mapped and split into one chunk per thread.
+	Every thread uses its own copy of the machine, moved ahead to the
+	number of keypresses (alphabet characters) before its chunk.
+	The result is identical to a sequential run.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "enigma.h"
+
+/* One thread's share of the work */
+typedef struct {
+	machine *m;
+	bool enciphering;
+	const char *in;
+	size_t len;
+	char *out;			/* Where this chunk's output goes */
+	size_t outlen;
+	unsigned long long start;		/* Keypresses before this chunk */
+	unsigned long long symbols;	/* Alphabet characters in this chunk */
+	unsigned long long chars;
+} chunk;
+
+/* Count the alphabet characters in a chunk, the same way as code_utf8() */
+static void *count_chunk(void *arg) {
+	chunk *c = arg;
+	size_t used, chars;
+	c->symbols = utf8_scan(c->m->utf8, c->in, c->len, true, SIZE_MAX, NULL, NULL, &used, &chars);
+	return NULL;
+}
+
+/* (De)cipher a chunk, with a machine moved ahead to the chunk start */
+static void *code_chunk(void *arg) {
+	chunk *c = arg;
+	machine *m = machine_clone(c->m);
+	machine_seek(m, c->start);
+	codebuf *cb = new_codebuf();
+	for (size_t pos = 0; pos < c->len; ) {
+		size_t used, n;
+		c->outlen += code_utf8(m, c->enciphering, c->in + pos, c->len - pos, true, &used, &n, c->out + c->outlen, cb);
+		pos += used;
+		c->chars += n;
+	}
+	free_codebuf(cb);
+	free_clone(m);
+	return NULL;
+}
+
+/* Run fn on all chunks, one thread each */
+static void run_threads(void *(*fn)(void *), chunk *c, int threads) {
+	pthread_t tid[threads];
+	for (int t = 0; t < threads; ++t) {
+		if (pthread_create(&tid[t], NULL, fn, &c[t])) feil("cannot start thread\n");
+	}
+	for (int t = 0; t < threads; ++t) pthread_join(tid[t], NULL);
+}
+
+/*
+	Longest utf-8 encoding of an alphabet character.
+	*uniform is set if they all have the same length, as the output
+	then has the same size as the input, character by character.
+*/
+static int alphabet_utf8_len(machine *m, bool *uniform) {
+	const uint8_t *len = m->utf8->enc_len;
+	int longest = len[0];
+	*uniform = true;
+	for (int i = 1; i < m->alphabet_len; ++i) {
+		if (len[i] != len[0]) *uniform = false;
+		if (len[i] > longest) longest = len[i];
+	}
+	return longest;
+}
+
+/*
+	Encipher or decipher infile to outfile using several threads.
+	Chunk borders are moved forward to the start of a utf-8 character.
+	Pass 1 counts the alphabet characters in each chunk, giving every
+	chunk its starting keypress. Pass 2 does the work. When all alphabet
+	characters have utf-8 encodings of the same length, the threads write
+	straight into the memory-mapped output file. Otherwise they use
+	buffers of their own, which are written out afterwards.
+*/
+void parallel_stream(machine *m, bool enciphering, const char *infile, const char *outfile, int threads) {
+	int in = open(infile, O_RDONLY);
+	if (in < 0) feil("cannot open input file\n");
+	int out = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) feil("cannot open output file\n");
+	struct stat st;
+	if (fstat(in, &st)) feil("cannot stat input file\n");
+	size_t len = st.st_size;
+	if (!len) {
+		close(out);
+		close(in);
+		return;
+	}
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	const char *text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in, 0);
+	if (text == MAP_FAILED) feil("cannot map input file\n");
+	madvise((void *)text, len, MADV_SEQUENTIAL);
+
+	/* Split the work */
+	if ((size_t)threads > len) threads = len;
+	chunk c[threads];
+	size_t from = 0;
+	for (int t = 0; t < threads; ++t) {
+		size_t to = len / threads * (t + 1);
+		if (t == threads - 1) to = len;
+		while (to < len && (text[to] & 0xC0) == 0x80) ++to; /* utf-8 continuation byte */
+		if (to < from) to = from;
+		memset(&c[t], 0, sizeof(chunk));
+		c[t].m = m;
+		c[t].enciphering = enciphering;
+		c[t].in = text + from;
+		c[t].len = to - from;
+		from = to;
+	}
+	run_threads(count_chunk, c, threads);
+	for (int t = 1; t < threads; ++t) c[t].start = c[t-1].start + c[t-1].symbols;
+
+	/* Where the output goes */
+	bool uniform;
+	int longest = alphabet_utf8_len(m, &uniform);
+	char *mapped = NULL;
+	if (uniform) {
+		if (ftruncate(out, len)) feil("cannot write output file\n");
+		mapped = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+		if (mapped == MAP_FAILED) feil("cannot map output file\n");
+		for (int t = 0; t < threads; ++t) c[t].out = mapped + (c[t].in - text);
+	} else for (int t = 0; t < threads; ++t) {
+		c[t].out = malloc(c[t].len * longest + 1);
+		if (!c[t].out) feil("out of memory\n");
+	}
+	run_threads(code_chunk, c, threads);
+
+	unsigned long long chars = 0;
+	for (int t = 0; t < threads; ++t) {
+		chars += c[t].chars;
+		if (!uniform) {
+			write_all(out, c[t].out, c[t].outlen);
+			free(c[t].out);
+		}
+	}
+	if (mapped) munmap(mapped, len);
+	munmap((void *)text, len);
+	close(out);
+	close(in);
+	report_throughput(chars, &t0);
+}
@@ -0,0 +1,306 @@
+/*
+	period.c
+	Cycle structure of the stepping, for --analyze-period.
+
+	The rotations of the rotating slots are the whole stepping state, on notch
+	and pin machines alike, as the movement follows from them. The slots fall
+	into groups that move independently (see machine_seek()), and each group
+	is analyzed on its own with its state packed into one number. The machine
+	as a whole repeats with the lcm of the group cycle lengths, after the
+	longest group pre-period.
+
+	From the start position, Brent's cycle detection finds the pre-period and
+	the cycle length. For the distribution over all start states, the next
+	state of every state is tabled in parallel. One walk through the table
+	then finds the cycle every state ends up in.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+
+#include "enigma.h"
+
+#define PERIOD_CHUNK 4096	/* States per work item */
+#define PERIOD_LINES 20		/* Cycle lengths listed */
+#define STAMP 0x80000000u	/* Walk under way */
+#define ON_CYCLE 0x40000000u
+
+/* One stepping group, named by its lowest slot */
+typedef struct {
+	const int *group;
+	int g, slots;
+	int *slot;
+	uint64_t states;	/* al^slots, 0 if that doesn't fit */
+} stepgroup;
+
+/* How many cycles of length len, and how many start states end up in them */
+typedef struct {
+	uint64_t len, cycles, states;
+} cyclecount;
+
+typedef struct {
+	cyclecount *c;
+	int n;
+} cyclestats;
+
+typedef struct {
+	machine **c;		/* A copy of the machine for each thread */
+	const stepgroup *sg;
+	uint32_t *next;
+} tablework;
+
+static uint64_t state_of(machine *m, const stepgroup *sg) {
+	uint64_t st = 0;
+	for (int k = sg->slots; k--; ) st = st * m->alphabet_len + m->slot[sg->slot[k]].rot;
+	return st;
+}
+
+static void set_state(machine *m, const stepgroup *sg, uint64_t st) {
+	for (int k = 0; k < sg->slots; ++k, st /= m->alphabet_len) m->slot[sg->slot[k]].rot = st % m->alphabet_len;
+	group_settle(m, sg->group, sg->g);
+}
+
+static uint64_t next_state(machine *m, const stepgroup *sg) {
+	group_turn(m, sg->group, sg->g);
+	return state_of(m, sg);
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+	while (b) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Least common multiple, false if it overflows */
+static bool lcm(uint64_t a, uint64_t b, uint64_t *l) {
+	return !__builtin_mul_overflow(a / gcd(a, b), b, l);
+}
+
+/*
+	Brent's cycle detection from state x0. The hare runs ahead in powers of
+	two, the tortoise waits at the last power. Then the hare starts a cycle
+	length ahead of the tortoise, and they meet where the cycle begins.
+*/
+static void brent(machine *m, const stepgroup *sg, uint64_t x0, uint64_t *pre, uint64_t *len) {
+	machine *tortoise = machine_clone(m), *hare = machine_clone(m);
+	uint64_t power = 1, lam = 1, t = x0, h;
+	set_state(hare, sg, x0);
+	for (h = next_state(hare, sg); t != h; ++lam, h = next_state(hare, sg)) {
+		if (lam == power) {
+			t = h;
+			power *= 2;
+			lam = 0;
+		}
+	}
+	set_state(tortoise, sg, x0);
+	set_state(hare, sg, x0);
+	t = h = x0;
+	for (uint64_t i = 0; i < lam; ++i) h = next_state(hare, sg);
+	uint64_t mu = 0;
+	for (; t != h; ++mu) {
+		t = next_state(tortoise, sg);
+		h = next_state(hare, sg);
+	}
+	*pre = mu;
+	*len = lam;
+	free_clone(tortoise);
+	free_clone(hare);
+}
+
+/* Next states of a chunk of states */
+static void table_chunk(void *data, int thread, long item) {
+	tablework *w = data;
+	machine *c = w->c[thread];
+	uint64_t st = (uint64_t)item * PERIOD_CHUNK, end = st + PERIOD_CHUNK;
+	if (end > w->sg->states) end = w->sg->states;
+	for (; st < end; ++st) {
+		set_state(c, w->sg, st);
+		w->next[st] = next_state(c, w->sg);
+	}
+}
+
+/*
+	Cycle length for every state. len[x] is 0 for states not seen yet,
+	STAMP | s while the walk from s is under way, and then the cycle length,
+	with ON_CYCLE for the states on the cycle itself. A walk that runs into
+	its own stamp has found a new cycle.
+*/
+static void cycle_lengths(const uint32_t *next, uint32_t *len, uint32_t states) {
+	for (uint32_t s = 0; s < states; ++s) {
+		if (len[s]) continue;
+		uint32_t x = s;
+		for (; !len[x]; x = next[x]) len[x] = STAMP | s;
+		uint32_t l = len[x];
+		if (l == (STAMP | s)) {
+			l = 1;
+			for (uint32_t y = next[x]; y != x; y = next[y]) ++l;
+			uint32_t y = x;
+			do {
+				len[y] = l | ON_CYCLE;
+				y = next[y];
+			} while (y != x);
+		}
+		l &= ~ON_CYCLE;
+		for (x = s; len[x] == (STAMP | s); x = next[x]) len[x] = l;
+	}
+}
+
+/* Count the states and cycles of each length, using count[] as scratch space */
+static cyclestats tally(const uint32_t *len, uint32_t *count, uint32_t states) {
+	cyclestats cs = {NULL, 0};
+	memset(count, 0, states * sizeof(uint32_t));
+	for (uint32_t s = 0; s < states; ++s) ++count[(len[s] & ~ON_CYCLE) - 1];
+	for (uint32_t l = 0; l < states; ++l) cs.n += count[l] > 0;
+	cs.c = malloc(cs.n * sizeof(cyclecount));
+	cs.n = 0;
+	for (uint32_t l = 0; l < states; ++l) if (count[l]) cs.c[cs.n++] = (cyclecount){l + 1, 0, count[l]};
+	memset(count, 0, states * sizeof(uint32_t));
+	for (uint32_t s = 0; s < states; ++s) if (len[s] & ON_CYCLE) ++count[(len[s] & ~ON_CYCLE) - 1];
+	for (int i = 0; i < cs.n; ++i) cs.c[i].cycles = count[cs.c[i].len - 1] / cs.c[i].len;
+	return cs;
+}
+
+/* Cycle lengths over all start states of the group */
+static cyclestats group_cycles(machine *m, const stepgroup *sg, int threads) {
+	uint32_t states = sg->states;
+	uint32_t *next = malloc(states * sizeof(uint32_t)), *len = calloc(states, sizeof(uint32_t));
+	if (!next || !len) feil("not enough memory for the state table\n");
+	machine *c[threads];
+	for (int t = 0; t < threads; ++t) c[t] = machine_clone(m);
+	tablework w = {c, sg, next};
+	run_pool(threads, (states + PERIOD_CHUNK - 1) / PERIOD_CHUNK, table_chunk, &w);
+	for (int t = 0; t < threads; ++t) free_clone(c[t]);
+	cycle_lengths(next, len, states);
+	cyclestats cs = tally(len, next, states);
+	free(len);
+	free(next);
+	return cs;
+}
+
+static int cmp_len(const void *a, const void *b) {
+	const cyclecount *x = a, *y = b;
+	return (x->len > y->len) - (x->len < y->len);
+}
+
+static int cmp_states(const void *a, const void *b) {
+	const cyclecount *x = a, *y = b;
+	return (x->states < y->states) - (x->states > y->states);
+}
+
+/*
+	Both groups together. A pair of cycles of lengths a and b makes
+	gcd(a, b) cycles of length lcm(a, b). False if the numbers overflow.
+*/
+static bool combine(cyclestats *a, const cyclestats *b) {
+	cyclecount *c = malloc((size_t)a->n * b->n * sizeof(cyclecount));
+	int n = 0;
+	bool ok = true;
+	for (int i = 0; i < a->n && ok; ++i) for (int j = 0; j < b->n && ok; ++j) {
+		cyclecount *x = &a->c[i], *y = &b->c[j], *z = &c[n++];
+		ok = lcm(x->len, y->len, &z->len) &&
+		     !__builtin_mul_overflow(x->cycles * y->cycles, gcd(x->len, y->len), &z->cycles) &&
+		     !__builtin_mul_overflow(x->states, y->states, &z->states);
+	}
+	/* Merge equal lengths */
+	qsort(c, n, sizeof(cyclecount), cmp_len);
+	int k = 0;
+	for (int i = 0; i < n; ++i) {
+		if (k && c[k - 1].len == c[i].len) {
+			c[k - 1].cycles += c[i].cycles;
+			c[k - 1].states += c[i].states;
+		} else c[k++] = c[i];
+	}
+	free(a->c);
+	a->c = c;
+	a->n = k;
+	return ok;
+}
+
+static void print_cycles(cyclestats *cs) {
+	uint64_t total = 0, longest = 0;
+	double mean = 0;
+	for (int i = 0; i < cs->n; ++i) total += cs->c[i].states;
+	for (int i = 0; i < cs->n; ++i) {
+		mean += (double)cs->c[i].len * cs->c[i].states / total;
+		if (cs->c[i].len > longest) longest = cs->c[i].len;
+	}
+	wprintf(L"    %i cycle lengths over %llu start states, longest %llu, mean %.1f\n",
+	        cs->n, (unsigned long long)total, (unsigned long long)longest, mean);
+	qsort(cs->c, cs->n, sizeof(cyclecount), cmp_states);
+	wprintf(L"    %16ls %16ls %18ls\n", L"cycle length", L"cycles", L"start states");
+	for (int i = 0; i < cs->n && i < PERIOD_LINES; ++i) {
+		wprintf(L"    %16llu %16llu %18llu %6.2f%%\n", (unsigned long long)cs->c[i].len,
+		        (unsigned long long)cs->c[i].cycles, (unsigned long long)cs->c[i].states,
+		        100.0 * cs->c[i].states / total);
+	}
+	if (cs->n > PERIOD_LINES) wprintf(L"    (%i more cycle lengths)\n", cs->n - PERIOD_LINES);
+}
+
+/*
+	Print the pre-period and cycle length from the machine's current
+	position, and the cycle lengths over all start states.
+*/
+void analyze_period(machine *m, int threads) {
+	int n = m->wheelslots, group[n], slot[n], al = m->alphabet_len;
+	int groups = stepping_groups(m, group);
+	threads = pool_threads(threads);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	uint64_t pre = 0, len = 1;
+	bool len_ok = true, all_ok = true;
+	cyclestats all = {malloc(sizeof(cyclecount)), 1};
+	all.c[0] = (cyclecount){1, 1, 1};
+	wprintf(L"%i stepping groups\n", groups);
+	for (int g = 0; g < n; ++g) {
+		if (group[g] != g) continue;
+		stepgroup sg = {group, g, 0, slot, 1};
+		for (int i = 0; i < n; ++i) if (group[i] == g) slot[sg.slots++] = i;
+		wprintf(L"slots");
+		for (int k = 0; k < sg.slots; ++k) {
+			wprintf(L" %i", slot[k] + 1);
+			if (sg.states && __builtin_mul_overflow(sg.states, (uint64_t)al, &sg.states)) sg.states = 0;
+		}
+		if (!sg.states) {
+			wprintf(L": too many states to pack, skipped\n");
+			len_ok = all_ok = false;
+			continue;
+		}
+		wprintf(L": %llu states\n", (unsigned long long)sg.states);
+
+		uint64_t gpre, glen;
+		brent(m, &sg, state_of(m, &sg), &gpre, &glen);
+		wprintf(L"    from the start position: pre-period %llu, cycle length %llu\n",
+		        (unsigned long long)gpre, (unsigned long long)glen);
+		if (gpre > pre) pre = gpre;
+		len_ok = len_ok && lcm(len, glen, &len);
+
+		if (sg.states > PERIOD_STATES_MAX) {
+			wprintf(L"    too many states for the distribution\n");
+			all_ok = false;
+			continue;
+		}
+		cyclestats cs = group_cycles(m, &sg, threads);
+		print_cycles(&cs);
+		if (all_ok) all_ok = combine(&all, &cs);
+		free(cs.c);
+	}
+
+	wprintf(L"whole machine\n    from the start position: pre-period %llu, ", (unsigned long long)pre);
+	if (len_ok) wprintf(L"cycle length %llu\n", (unsigned long long)len);
+	else wprintf(L"cycle length unknown\n");
+	if (all_ok && groups > 1) print_cycles(&all);
+	free(all.c);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "analyzed in %.1f s, %i threads\n",
+	        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9, threads);
+}
@@ -0,0 +1,108 @@
+/*
+	pool.c
+	Thread pool with work-stealing queues, for the key searches.
+	Items are numbered 0 .. items-1. Each thread starts out with an equal
+	share, and takes items from the front of its own queue. A thread whose
+	queue runs dry steals the back half of the fullest queue.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "enigma.h"
+
+/* Items left for one thread: next .. end-1. Others steal from the end */
+typedef struct {
+	pthread_mutex_t lock;
+	long next, end;
+} workqueue;
+
+typedef struct {
+	workqueue *q;
+	int threads;
+	pool_work work;
+	void *data;
+} pool;
+
+typedef struct {
+	pool *p;
+	int id;
+} pool_thread;
+
+/* Next item for thread 'self'. When its own queue is empty, steal half of the fullest one */
+static bool get_work(pool *p, int self, long *item) {
+	workqueue *q = &p->q[self];
+	pthread_mutex_lock(&q->lock);
+	bool got = q->next < q->end;
+	if (got) *item = q->next++;
+	pthread_mutex_unlock(&q->lock);
+	while (!got) {
+		int victim = -1;
+		long most = 0;
+		for (int t = 0; t < p->threads; ++t) {
+			pthread_mutex_lock(&p->q[t].lock);
+			long left = p->q[t].end - p->q[t].next;
+			pthread_mutex_unlock(&p->q[t].lock);
+			if (left > most) {
+				most = left;
+				victim = t;
+			}
+		}
+		if (victim < 0) return false;
+		workqueue *v = &p->q[victim];
+		pthread_mutex_lock(&v->lock);
+		long left = v->end - v->next, lo = 0, hi = 0;
+		if (left > 0) {
+			hi = v->end;
+			lo = hi - (left + 1) / 2;
+			v->end = lo;
+		}
+		pthread_mutex_unlock(&v->lock);
+		if (hi > lo) {
+			pthread_mutex_lock(&q->lock);
+			q->next = lo + 1;
+			q->end = hi;
+			pthread_mutex_unlock(&q->lock);
+			*item = lo;
+			got = true;
+		}
+	}
+	return true;
+}
+
+static void *pool_main(void *arg) {
+	pool_thread *t = arg;
+	long item;
+	while (get_work(t->p, t->id, &item)) t->p->work(t->p->data, t->id, item);
+	return NULL;
+}
+
+/* Run work(data, thread, item) on items 0 .. items-1, using 'threads' threads */
+void run_pool(int threads, long items, pool_work work, void *data) {
+	workqueue q[threads];
+	pool_thread pt[threads];
+	pthread_t tid[threads];
+	pool p = {q, threads, work, data};
+	for (int t = 0; t < threads; ++t) {
+		pthread_mutex_init(&q[t].lock, NULL);
+		q[t].next = items * t / threads;
+		q[t].end = items * (t + 1) / threads;
+		pt[t].p = &p;
+		pt[t].id = t;
+	}
+	for (int t = 0; t < threads; ++t) {
+		if (pthread_create(&tid[t], NULL, pool_main, &pt[t])) feil("cannot start thread\n");
+	}
+	for (int t = 0; t < threads; ++t) pthread_join(tid[t], NULL);
+	for (int t = 0; t < threads; ++t) pthread_mutex_destroy(&q[t].lock);
+}
+
+/* Default thread count, one per processor */
+int pool_threads(int threads) {
+	if (threads > 0) return threads;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	return threads > 0 ? threads : 1;
+}
@@ -0,0 +1,282 @@
+/*
+	replay.c
+	Keystroke logs for the interactive mode. --record writes the keys as
+	they are typed. --replay feeds a log to interactive() with no human and
+	no terminal, as fast as it goes, and reports how long each key took
+	until its doupdate() was done and how many bytes went to the terminal.
+
+	The log is utf-8 text, typed characters stand for themselves.
+	Other keys are written in angle brackets:
+	  <F1> .. <F10>   select a wheel    <LEFT> <RIGHT>  select the next wheel
+	  <UP> <DOWN>     turn the wheel    <C-T> <C-V>     ring setting
+	  <NPAGE>         change the wheel  <ENTER>         unselect
+	  <RESIZE>        redraw            <LT>            a '<'
+	Line breaks in the log are ignored, use <ENTER> for the enter key.
+
+	The replayed screen goes to an unlinked temporary file, ncurses writes
+	to it like to a terminal and its size counts the bytes. The screen size
+	is LINES x COLUMNS from the environment, 50 x 132 when not set.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#define _XOPEN_SOURCE_EXTENDED 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "ui.h"
+
+/* What a key does, for the report */
+enum { K_TEXT, K_SELECT, K_TURN, K_RING, K_OTHER, KINDS };
+static const char *kind_names[KINDS] = {"typing", "wheel selection", "wheel turning", "ring setting", "other"};
+
+typedef struct {
+	int rc;
+	wint_t wch;
+} logkey;
+
+struct keylog {
+	FILE *rec;			/* Recording to this, or */
+	logkey *key;		/* replaying these */
+	size_t keys, next, done;	/* Keys in the log, handed out, measured */
+	FILE *term, *in;	/* The replay terminal */
+	double t_key;		/* When the last key was handed out */
+	off_t bytes;		/* Terminal output until then */
+	double *latency;	/* Per key */
+	off_t *written;
+};
+
+static const struct {
+	const char *name;
+	int rc;
+	wint_t wch;
+} key_names[] = {
+	{"UP", KEY_CODE_YES, KEY_UP}, {"DOWN", KEY_CODE_YES, KEY_DOWN},
+	{"LEFT", KEY_CODE_YES, KEY_LEFT}, {"RIGHT", KEY_CODE_YES, KEY_RIGHT},
+	{"NPAGE", KEY_CODE_YES, KEY_NPAGE}, {"RESIZE", KEY_CODE_YES, KEY_RESIZE},
+	{"ENTER", OK, L'\n'}, {"LT", OK, L'<'}
+};
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+keylog *keylog_record(const char *file) {
+	keylog *k = calloc(1, sizeof(keylog));
+	if (!k || !(k->rec = fopen(file, "w"))) return NULL;
+	return k;
+}
+
+/* Log a key read from the keyboard */
+void keylog_put(keylog *k, int rc, wint_t wch) {
+	if (rc == ERR) return;
+	for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); ++i) {
+		if (key_names[i].rc == rc && key_names[i].wch == wch) {
+			fprintf(k->rec, "<%s>", key_names[i].name);
+			return;
+		}
+	}
+	if (rc == KEY_CODE_YES && wch >= KEY_F(1) && wch <= KEY_F(12)) fprintf(k->rec, "<F%i>", wch - KEY_F0);
+	else if (rc == OK && wch < 32) fprintf(k->rec, "<C-%c>", wch + '@');
+	else if (rc == OK) fprintf(k->rec, "%lc", (wchar_t)wch);
+}
+
+/* Parse one <name>, false if unknown */
+static bool parse_key(const wchar_t *name, size_t len, logkey *key) {
+	char s[16];
+	if (len >= sizeof(s)) return false;
+	for (size_t i = 0; i < len; ++i) s[i] = name[i] < 128 ? name[i] : '?';
+	s[len] = 0;
+	int f;
+	for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); ++i) {
+		if (!strcmp(s, key_names[i].name)) {
+			*key = (logkey){key_names[i].rc, key_names[i].wch};
+			return true;
+		}
+	}
+	if (sscanf(s, "F%i", &f) == 1 && f >= 1 && f <= 12) *key = (logkey){KEY_CODE_YES, KEY_F(f)};
+	else if (len == 3 && s[0] == 'C' && s[1] == '-' && s[2] >= '@' && s[2] <= '_') *key = (logkey){OK, s[2] - '@'};
+	else return false;
+	return true;
+}
+
+keylog *keylog_replay(const char *file) {
+	FILE *f = fopen(file, "r");
+	if (!f) return NULL;
+	size_t len = 0, size = 4096;
+	char *buf = malloc(size + 1);
+	for (size_t r; (r = fread(buf + len, 1, size - len, f)) > 0; ) {
+		len += r;
+		if (len == size) buf = realloc(buf, (size *= 2) + 1);
+	}
+	fclose(f);
+	buf[len] = 0;
+	wchar_t *ws = mbstowcsdup(buf);
+	free(buf);
+	if (!ws) return NULL;
+
+	keylog *k = calloc(1, sizeof(keylog));
+	k->key = malloc((wcslen(ws) + 1) * sizeof(logkey));
+	for (wchar_t *p = ws; *p; ++p) {
+		if (*p == L'\n') continue;
+		logkey *key = &k->key[k->keys];
+		if (*p != L'<') *key = (logkey){OK, *p};
+		else {
+			wchar_t *end = wcschr(p, L'>');
+			if (!end || !parse_key(p + 1, end - p - 1, key)) {
+				fprintf(stderr, "unknown key at %li in the key log\n", (long)(p - ws));
+				exit(1);
+			}
+			p = end;
+		}
+		++k->keys;
+	}
+	free(ws);
+	k->latency = malloc((k->keys + 1) * sizeof(double));
+	k->written = malloc((k->keys + 1) * sizeof(off_t));
+
+	/* A terminal nobody looks at */
+	setenv("TERM", "xterm", 0);
+	setenv("LINES", "50", 0);
+	setenv("COLUMNS", "132", 0);
+	k->term = tmpfile();
+	k->in = fopen("/dev/null", "r");
+	if (!k->term || !k->in) feil("cannot set up the replay terminal\n");
+	return k;
+}
+
+bool keylog_replaying(keylog *k) {
+	return k && k->key;
+}
+
+/* The screen for a replay */
+SCREEN *keylog_screen(keylog *k) {
+	SCREEN *s = newterm(NULL, k->term, k->in);
+	if (!s) feil("cannot start the replay terminal\n");
+	return s;
+}
+
+static off_t term_bytes(keylog *k) {
+	struct stat st;
+	fflush(k->term);
+	fstat(fileno(k->term), &st);
+	return st.st_size;
+}
+
+/*
+	The next key of the replay. The screen is up to date with the previous
+	key, so that one is measured now. Ctrl-C quits after the last key.
+*/
+int keylog_get(keylog *k, wint_t *wch) {
+	double t = now();
+	off_t bytes = term_bytes(k);
+	if (k->next) {
+		k->latency[k->next - 1] = t - k->t_key;
+		k->written[k->next - 1] = bytes - k->bytes;
+		k->done = k->next;
+	}
+	if (k->next == k->keys) {
+		*wch = 3;
+		return OK;
+	}
+	k->bytes = bytes;
+	k->t_key = now();
+	*wch = k->key[k->next].wch;
+	return k->key[k->next++].rc;
+}
+
+static int kind(const logkey *key) {
+	if (key->rc == KEY_CODE_YES) {
+		if (key->wch == KEY_UP || key->wch == KEY_DOWN) return K_TURN;
+		if (key->wch == KEY_LEFT || key->wch == KEY_RIGHT || (key->wch >= KEY_F(1) && key->wch <= KEY_F(12))) return K_SELECT;
+		return K_OTHER;
+	}
+	if (key->wch == 20 || key->wch == 22) return K_RING;
+	if (key->wch == L'\n') return K_SELECT;
+	return key->wch < 32 ? K_OTHER : K_TEXT;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int cmp_off(const void *a, const void *b) {
+	off_t x = *(const off_t *)a, y = *(const off_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Latency and output per key, overall and by kind of key, and a latency histogram */
+void keylog_report(keylog *k) {
+	size_t n = k->done;
+	if (!n) {
+		wprintf(L"no keys replayed\n");
+		return;
+	}
+	double total = 0, kind_lat[KINDS] = {0};
+	off_t bytes = 0, kind_bytes[KINDS] = {0};
+	size_t kind_keys[KINDS] = {0};
+	for (size_t i = 0; i < n; ++i) {
+		int d = kind(&k->key[i]);
+		total += k->latency[i];
+		bytes += k->written[i];
+		kind_lat[d] += k->latency[i];
+		kind_bytes[d] += k->written[i];
+		++kind_keys[d];
+	}
+	wprintf(L"%zu keys in %.3f s, %.0f keys/s, %lld bytes to the terminal\n", n, total, n / total, (long long)bytes);
+	wprintf(L"%-18s %8ls %14ls %12ls\n", "", L"keys", L"mean latency", L"mean bytes");
+	for (int d = 0; d < KINDS; ++d) if (kind_keys[d]) {
+		wprintf(L"%-18s %8zu %11.2f us %12.1f\n", kind_names[d], kind_keys[d],
+		        kind_lat[d] / kind_keys[d] * 1e6, (double)kind_bytes[d] / kind_keys[d]);
+	}
+
+	double *lat = malloc(n * sizeof(double));
+	off_t *wr = malloc(n * sizeof(off_t));
+	memcpy(lat, k->latency, n * sizeof(double));
+	memcpy(wr, k->written, n * sizeof(off_t));
+	qsort(lat, n, sizeof(double), cmp_double);
+	qsort(wr, n, sizeof(off_t), cmp_off);
+	wprintf(L"latency us    p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n", lat[n / 2] * 1e6,
+	        lat[n * 9 / 10] * 1e6, lat[n * 99 / 100] * 1e6, lat[n * 999 / 1000] * 1e6, lat[n - 1] * 1e6);
+	wprintf(L"bytes/key     p50 %lld  p90 %lld  p99 %lld  max %lld\n", (long long)wr[n / 2],
+	        (long long)wr[n * 9 / 10], (long long)wr[n * 99 / 100], (long long)wr[n - 1]);
+
+	/* Powers of two, in microseconds */
+	size_t bucket[32] = {0};
+	int low = 31, top = 0;
+	for (size_t i = 0; i < n; ++i) {
+		int b = 0;
+		for (double us = lat[i] * 1e6; us >= 1 && b < 31; us /= 2) ++b;
+		++bucket[b];
+		if (b < low) low = b;
+		if (b > top) top = b;
+	}
+	size_t most = 0;
+	for (int b = low; b <= top; ++b) if (bucket[b] > most) most = bucket[b];
+	wprintf(L"latency histogram\n");
+	for (int b = low; b <= top; ++b) {
+		wprintf(L"  < %8lu us %8zu ", 1ul << b, bucket[b]);
+		for (size_t j = 0; j < bucket[b] * 50 / most; ++j) wprintf(L"#");
+		wprintf(L"\n");
+	}
+	free(wr);
+	free(lat);
+}
+
+void keylog_close(keylog *k) {
+	if (k->rec) fclose(k->rec);
+	if (k->term) fclose(k->term);
+	if (k->in) fclose(k->in);
+	free(k->key);
+	free(k->latency);
+	free(k->written);
+	free(k);
+}
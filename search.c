@@ -0,0 +1,362 @@
+/*
+	search.c
+	Ciphertext-only key search, for messages without a crib.
+
+	Works from the machine description alone. Pass 1 tries every wheel order
+	the slots allow, with every start position of the rotating slots, and ranks
+	them by the index of coincidence of the deciphered text. Ring settings stay
+	at the first letter, a ring setting mostly just offsets the start position.
+	Pass 2 improves the best candidates by hill climbing on ring settings and
+	plugboard pairs, first on the index of coincidence, then on n-gram fitness
+	when a corpus is given.
+
+	Both passes are spread over threads with run_pool().
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "enigma.h"
+
+/* Lanes per multikey in pass 1 */
+#define SEARCH_LANES 64
+
+/* Candidates from pass 1 per key reported */
+#define SEARCH_KEEP 10
+
+/* A candidate key. v holds rotations, ring settings and plugboard wiring */
+typedef struct {
+	double score;
+	int order;		/* Index into the wheel orders */
+	int v[];
+} key;
+
+#define ROT(s, k) ((k)->v)
+#define RING(s, k) ((k)->v + (s)->n)
+#define PLUG(s, k) ((k)->v + 2 * (s)->n)
+
+/* Best keys so far, sorted by falling score */
+typedef struct {
+	key **k;
+	int len, size;
+} ranking;
+
+typedef struct {
+	machine *m;
+	int n, al;
+	const symbol *text;
+	size_t len;
+	ngrams *ng;
+	wheel **orders;		/* orders x n wheels */
+	int norders;
+	int *stepping;		/* Slots that rotate */
+	int nstepping;
+	int plugslot;			/* The plugboard slot, or -1 */
+	size_t keysize;
+	long positions;		/* Start positions per item in pass 1 */
+	int threads;
+	struct _worker *w;
+	key **final;			/* Results from pass 2 */
+} search;
+
+/* One thread */
+typedef struct _worker {
+	search *s;
+	int id;
+	machine *c;				/* Private machine */
+	wheel *plug;			/* Private plugboard */
+	symbol *out;
+	multikey *mk;			/* Pass 1 lanes, and their output */
+	symbol *lane_out;
+	ranking best;
+	unsigned long long tried;
+} worker;
+
+static key *new_key(search *s) {
+	return calloc(1, s->keysize);
+}
+
+static void copy_key(search *s, key *to, const key *from) {
+	memcpy(to, from, s->keysize);
+}
+
+static void init_ranking(search *s, ranking *r, int size) {
+	r->k = malloc(size * sizeof(key *));
+	for (int i = 0; i < size; ++i) r->k[i] = new_key(s);
+	r->len = 0;
+	r->size = size;
+}
+
+/* Insert a key if it is among the best, keeping the ranking sorted */
+static void rank_key(search *s, ranking *r, const key *k) {
+	if (r->len == r->size && k->score <= r->k[r->len - 1]->score) return;
+	key *spare = r->len < r->size ? r->k[r->len++] : r->k[r->len - 1];
+	int i = r->len - 1;
+	for (; i > 0 && r->k[i - 1]->score < k->score; --i) r->k[i] = r->k[i - 1];
+	r->k[i] = spare;
+	copy_key(s, spare, k);
+}
+
+
+/* Scoring */
+
+/* Index of coincidence, in the range 0..1 */
+static double ioc(search *s, const symbol *t, size_t len) {
+	unsigned count[s->al];
+	memset(count, 0, sizeof(count));
+	for (size_t i = 0; i < len; ++i) ++count[t[i]];
+	double sum = 0;
+	for (int i = 0; i < s->al; ++i) sum += (double)count[i] * (count[i] - 1);
+	return len > 1 ? sum / ((double)len * (len - 1)) : 0;
+}
+
+/* Set up the thread's machine with key k. Rotations and movement as at the start of the message */
+static void set_key(worker *w, const key *k) {
+	search *s = w->s;
+	machine *c = w->c;
+	for (int i = 0; i < s->n; ++i) {
+		wheelslot *sl = &c->slot[i];
+		sl->w = s->orders[k->order * s->n + i];
+		sl->rot = ROT(s, k)[i];
+		sl->ringstellung = RING(s, k)[i];
+	}
+	if (s->plugslot >= 0) {
+		wheel *p = c->slot[s->plugslot].w = w->plug;
+		for (int i = 0; i < s->al; ++i) {
+			p->encode[i] = PLUG(s, k)[i];
+			p->decode[PLUG(s, k)[i]] = i;
+		}
+		wheel_tables(c, p);
+	}
+	step_cleanup(c);
+}
+
+static double score_key(worker *w, key *k, bool ngram) {
+	search *s = w->s;
+	set_key(w, k);
+	decipher_block(w->c, s->text, w->out, s->len);
+	return k->score = ngram ? ngram_score(s->ng, w->out, s->len) : ioc(s, w->out, s->len);
+}
+
+
+/* Put a wheel order in the thread's machine, with ring settings at 0. Pins and blocks follow the wheels */
+static void set_order(search *s, machine *c, int order) {
+	for (int i = 0; i < s->n; ++i) {
+		c->slot[i].w = s->orders[order * s->n + i];
+		c->slot[i].ringstellung = 0;
+	}
+	step_cleanup(c);
+}
+
+/* Pass 1: item = wheel order and start position of the first rotating slot */
+static void try_positions(void *data, int thread, long item) {
+	search *s = data;
+	worker *w = &s->w[thread];
+	machine *c = w->c;
+	multikey *mk = w->mk;
+	symbol *out = w->lane_out;
+	int lanes = multikey_lanes(mk);
+	key *k = new_key(s);
+	key *lane_key[lanes];
+	for (int l = 0; l < lanes; ++l) lane_key[l] = new_key(s);
+	k->order = item / (s->nstepping ? s->al : 1);
+	if (s->plugslot >= 0) for (int i = 0; i < s->al; ++i) PLUG(s, k)[i] = s->m->slot[s->plugslot].w->encode[i];
+	for (int i = 0; i < s->n; ++i) ROT(s, k)[i] = s->m->slot[i].rot;
+	for (int i = 0; i < s->nstepping; ++i) ROT(s, k)[s->stepping[i]] = 0;
+	if (s->nstepping) ROT(s, k)[s->stepping[0]] = item % s->al;
+	set_order(s, c, k->order);
+
+	for (long p = 0; p < s->positions; ) {
+		int l = 0;
+		for (; l < lanes && p < s->positions; ++l, ++p) {
+			/* The other rotating slots count like an odometer */
+			for (long i = s->nstepping, q = p; --i > 0; q /= s->al) ROT(s, k)[s->stepping[i]] = q % s->al;
+			copy_key(s, lane_key[l], k);
+			for (int i = 0; i < s->n; ++i) {
+				wheelslot *sl = &c->slot[i];
+				sl->rot = ROT(s, k)[i];
+				sl->movement = (s->m->steptype == T_PIN_BLOCKING);
+			}
+			post_step(c);
+			if (!multikey_set_lane(mk, l, c)) {
+				/* Reflector in some orders only, do this one the slow way */
+				lane_key[l]->score = score_key(w, lane_key[l], false);
+				rank_key(s, &w->best, lane_key[l]);
+				set_order(s, c, k->order);
+				--l;
+			}
+		}
+		multikey_decipher(mk, s->text, s->len, out);
+		for (int i = 0; i < l; ++i) {
+			lane_key[i]->score = ioc(s, out + (size_t)i * s->len, s->len);
+			rank_key(s, &w->best, lane_key[i]);
+		}
+		w->tried += l;
+	}
+	for (int l = 0; l < lanes; ++l) free(lane_key[l]);
+	free(k);
+}
+
+/* Pass 2: hill climbing on ring settings and plugboard pairs */
+static void climb(worker *w, key *k, bool ngram) {
+	search *s = w->s;
+	int al = s->al;
+	key *t = new_key(s);
+	double best = score_key(w, k, ngram);
+	for (bool improved = true; improved; ) {
+		improved = false;
+
+		/*
+			A ring setting, with the rotation following along, changes only the stepping.
+			The wheels it pushes may then be one step off, so try those too.
+		*/
+		for (int j = 0; j < s->nstepping; ++j) {
+			int i = s->stepping[j];
+			wheelslot *sl = &s->m->slot[i];
+			for (int r = 0; r < al; ++r) for (int a = -1; a < sl->affect_slots; ++a) for (int d = -1; d <= 1; d += 2) {
+				int pushed = a < 0 ? -1 : sl->affect_slot[a];
+				if ((a < 0 && d > 0) || pushed == i) continue;
+				copy_key(s, t, k);
+				RING(s, t)[i] = r;
+				ROT(s, t)[i] = (ROT(s, k)[i] + r - RING(s, k)[i] + al) % al;
+				if (pushed >= 0) ROT(s, t)[pushed] = (ROT(s, t)[pushed] + d + al) % al;
+				if (score_key(w, t, ngram) > best) {
+					best = t->score;
+					copy_key(s, k, t);
+					improved = true;
+				}
+			}
+		}
+
+		/* Plug a to b, or unplug them */
+		if (s->plugslot >= 0) for (int a = 0; a < al; ++a) for (int b = a + 1; b < al; ++b) {
+			copy_key(s, t, k);
+			int *p = PLUG(s, t), pa = p[a], pb = p[b];
+			if (pa == b) {
+				p[a] = a;
+				p[b] = b;
+			} else {
+				p[pa] = pa;
+				p[pb] = pb;
+				p[a] = b;
+				p[b] = a;
+			}
+			if (score_key(w, t, ngram) > best) {
+				best = t->score;
+				copy_key(s, k, t);
+				improved = true;
+			}
+		}
+	}
+	k->score = best;
+	free(t);
+}
+
+static void improve(void *data, int thread, long item) {
+	search *s = data;
+	worker *w = &s->w[thread];
+	key *k = s->final[item];
+	climb(w, k, false);
+	if (s->ng) climb(w, k, true);
+	w->tried += 1;
+}
+
+
+static void print_key(search *s, int rank, key *k, symbol *plain) {
+	machine *m = s->m;
+	wprintf(L"%2i. %s %.4f  wheels", rank, s->ng ? "fitness" : "ioc", k->score);
+	for (int i = 0; i < s->n; ++i) if (m->slot[i].type == T_WHEEL) wprintf(L" %ls", s->orders[k->order * s->n + i]->name);
+	wprintf(L"  positions ");
+	for (int i = 0; i < s->nstepping; ++i) wprintf(L"%lc", m->alphabet[ROT(s, k)[s->stepping[i]]]);
+	wprintf(L"  rings ");
+	for (int i = 0; i < s->nstepping; ++i) wprintf(L"%lc", m->alphabet[RING(s, k)[s->stepping[i]]]);
+	if (s->plugslot >= 0) {
+		wprintf(L"  plugs");
+		for (int i = 0; i < s->al; ++i) {
+			int j = PLUG(s, k)[i];
+			if (j > i) wprintf(L" %lc%lc", m->alphabet[i], m->alphabet[j]);
+		}
+	}
+	wprintf(L"\n    ");
+	for (size_t i = 0; i < s->len && i < 70; ++i) wprintf(L"%lc", m->alphabet[plain[i]]);
+	wprintf(L"\n");
+}
+
+/*
+	Search for the key of the ciphertext in 'cipherfile', and print the 'top' best.
+	Without a corpus for n-gram statistics, keys are ranked by index of coincidence.
+*/
+void key_search(machine *m, const char *cipherfile, const char *corpus, int top, int threads) {
+	search s;
+	memset(&s, 0, sizeof(s));
+	s.m = m;
+	s.n = m->wheelslots;
+	s.al = m->alphabet_len;
+	if (s.al > ROT_TABLE_MAX) feil("the key search handles alphabets of up to 256 letters\n");
+	s.text = read_symbols(m, cipherfile, &s.len);
+	if (!s.text) feil("cannot read the ciphertext\n");
+	if (s.len < 2) feil("ciphertext too short\n");
+	if (corpus && !(s.ng = ngram_open(m, corpus))) feil("cannot read the corpus, or the n-grams are for another alphabet\n");
+	s.threads = pool_threads(threads);
+	s.orders = wheel_orders(m, &s.norders);
+	s.plugslot = -1;
+	s.stepping = malloc(s.n * sizeof(int));
+	for (int i = 0; i < s.n; ++i) {
+		if (m->slot[i].step) s.stepping[s.nstepping++] = i;
+		if (m->slot[i].type == T_PAIRSWAP && s.plugslot < 0) s.plugslot = i;
+	}
+	s.keysize = sizeof(key) + (2 * s.n + s.al) * sizeof(int);
+	s.positions = 1;
+	for (int i = 1; i < s.nstepping; ++i) s.positions *= s.al;
+	long items = (long)s.norders * (s.nstepping ? s.al : 1);
+
+	worker w[s.threads];
+	s.w = w;
+	int keep = top * SEARCH_KEEP;
+	for (int t = 0; t < s.threads; ++t) {
+		memset(&w[t], 0, sizeof(worker));
+		w[t].s = &s;
+		w[t].id = t;
+		w[t].c = machine_clone(m);
+		w[t].out = malloc(s.len * sizeof(symbol));
+		w[t].mk = multikey_new(m, SEARCH_LANES);
+		w[t].lane_out = malloc((size_t)multikey_lanes(w[t].mk) * s.len * sizeof(symbol));
+		init_ranking(&s, &w[t].best, keep);
+		/* The clone has a private plugboard, so the threads can rewire their own */
+		if (s.plugslot >= 0) w[t].plug = w[t].c->slot[s.plugslot].w;
+	}
+	fprintf(stderr, "%i wheel orders, %ld start positions each, %i threads\n",
+	        s.norders, s.positions * (s.nstepping ? s.al : 1), s.threads);
+
+	/* Pass 1 */
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	run_pool(s.threads, items, try_positions, &s);
+	unsigned long long tried = 0;
+	ranking all;
+	init_ranking(&s, &all, keep);
+	for (int t = 0; t < s.threads; ++t) {
+		tried += w[t].tried;
+		for (int i = 0; i < w[t].best.len; ++i) rank_key(&s, &all, w[t].best.k[i]);
+	}
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	fprintf(stderr, "%llu keys in %.1f s, %.0f keys/s\n", tried, secs, secs > 0 ? tried / secs : 0.0);
+
+	/* Pass 2 */
+	s.final = all.k;
+	run_pool(s.threads, all.len, improve, &s);
+	ranking result;
+	init_ranking(&s, &result, top);
+	for (int i = 0; i < all.len; ++i) rank_key(&s, &result, all.k[i]);
+	for (int i = 0; i < result.len; ++i) {
+		set_key(&w[0], result.k[i]);
+		decipher_block(w[0].c, s.text, w[0].out, s.len);
+		print_key(&s, i + 1, result.k[i], w[0].out);
+	}
+}
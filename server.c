@@ -0,0 +1,443 @@
+/*
+	server.c
+	A long-running server for --serve. The machine descriptions given on the
+	command line are parsed at startup and kept, and requests come over a
+	Unix domain socket.
+
+	A request names one of those description files, a key (see key_apply()),
+	a start position in keypresses and the text, and asks for enciphering
+	or deciphering. Frames are in host byte order, the socket is local:
+
+	  request:  u32 length of the rest, u32 request id, u8 'e' or 'd',
+	            u64 position, u16 length + machine file name,
+	            u16 length + key, u32 length + utf-8 text
+	  response: u32 length of the rest, u32 request id,
+	            u8 status (0 ok, 1 error), the text or an error message
+
+	A client may send many requests without waiting, answers come back
+	tagged with the request id, not necessarily in order. Each connection
+	has a thread reading requests into one queue, worker threads take up
+	to SERVE_BATCH requests at a time. Requests for the same machine and
+	key reuse the worker's machine copy with that key already set, and
+	the answers for one connection in a batch go out in one write.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "enigma.h"
+
+#define SERVE_BATCH 64
+#define SERVE_MAX_FRAME (64 << 20)
+#define SERVE_HEADER 9		/* Response length, id and status */
+
+/* A parsed machine description, kept for the life of the server */
+typedef struct {
+	const char *name;
+	machine *m;
+	keystate *defaults;
+} served;
+
+/* Filled in before the workers start, and never changed after */
+static struct {
+	served *s;
+	int n;
+} registry;
+
+typedef struct {
+	int fd;
+	int refs;		/* The reader, and requests not yet answered */
+	pthread_mutex_t write_lock;
+} conn;
+
+typedef struct job {
+	struct job *next;
+	conn *c;
+	uint32_t id;
+	bool enciphering;
+	uint64_t position;
+	char *machine, *key, *text;	/* Into frame */
+	uint32_t text_len;
+	char *frame;
+} job;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	job *head, *tail;
+} queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* A worker's copy of one machine, with the key it has set */
+typedef struct {
+	machine *c;
+	char *key;		/* NULL if the copy is in no known state */
+	keystate *ks;
+} workmachine;
+
+typedef struct {
+	workmachine *wm;	/* By registry index */
+	int n;
+	codebuf *cb;
+	char *out;
+	size_t out_len, out_size;
+} worker;
+
+static unsigned long long served_requests;
+static volatile sig_atomic_t stopping;
+
+/* Find a wheel by name, the wheel set is circular once parsed */
+static wheel *find_wheel(machine *m, const wchar_t *name) {
+	wheel *w = m->wheel_list;
+	do {
+		if (w->name && !wcscmp(name, w->name)) return w;
+	} while ((w = w->next_in_set) != m->wheel_list);
+	return NULL;
+}
+
+static bool key_word(const wchar_t *tok) {
+	return !wcscmp(tok, L"wheels") || !wcscmp(tok, L"rings") || !wcscmp(tok, L"positions") || !wcscmp(tok, L"plugs");
+}
+
+/*
+	Set a key given as text, over the machine's current settings:
+	  wheels UKW-B I II III   a wheel name for each wheel slot, in slot order
+	  rings AAA               ring settings of the rotating slots, in slot order
+	  positions ABC           start positions of the rotating slots
+	  plugs AB CD             pairs swapped by the plugboard
+	The parts may come in any order, or be left out. Returns NULL for a
+	good key, or what is wrong with it. step_cleanup() must follow.
+*/
+const char *key_apply(machine *m, const char *key) {
+	wchar_t *ws = mbstowcsdup(key);
+	if (!ws) return "the key is not valid text";
+	const char *err = NULL;
+	wchar_t *save, *tok = wcstok(ws, L" \t\n", &save);
+	while (tok && !err) {
+		if (!wcscmp(tok, L"wheels")) {
+			for (int i = 0; i < m->wheelslots && !err; ++i) {
+				if (m->slot[i].type != T_WHEEL) continue;
+				tok = wcstok(NULL, L" \t\n", &save);
+				wheel *w = tok ? find_wheel(m, tok) : NULL;
+				if (!w || !w->allow_slot[i]) err = "unknown wheel, or one not allowed in its slot";
+				else m->slot[i].w = w;
+			}
+			tok = wcstok(NULL, L" \t\n", &save);
+		} else if (!wcscmp(tok, L"rings") || !wcscmp(tok, L"positions")) {
+			bool rings = tok[0] == L'r';
+			tok = wcstok(NULL, L" \t\n", &save);
+			const wchar_t *l = tok ? tok : L"";
+			for (int i = 0; i < m->wheelslots && !err; ++i) {
+				if (!m->slot[i].step) continue;
+				int k = *l ? alphabet_index(m, *l++) : -1;
+				if (k == -1) err = "a letter for each rotating slot, in the machine alphabet";
+				else if (rings) m->slot[i].ringstellung = k;
+				else m->slot[i].rot = k;
+			}
+			if (*l) err = "more letters than rotating slots";
+			tok = wcstok(NULL, L" \t\n", &save);
+		} else if (!wcscmp(tok, L"plugs")) {
+			wheel *p = NULL;
+			for (int i = 0; i < m->wheelslots && !p; ++i) if (m->slot[i].type == T_PAIRSWAP) p = m->slot[i].w;
+			if (!p) {
+				err = "the machine has no plugboard";
+				break;
+			}
+			identity_map(m, p);
+			while ((tok = wcstok(NULL, L" \t\n", &save)) && !key_word(tok) && !err) {
+				int a = alphabet_index(m, tok[0]), b = tok[0] ? alphabet_index(m, tok[1]) : -1;
+				if (a == -1 || b == -1 || tok[2] || a == b) err = "plugs are pairs of letters";
+				else if (p->encode[a] != a || p->encode[b] != b) err = "a letter is plugged twice";
+				else {
+					p->encode[a] = p->decode[a] = b;
+					p->encode[b] = p->decode[b] = a;
+				}
+			}
+			wheel_tables(m, p);
+		} else err = "the key has wheels, rings, positions and plugs";
+	}
+	free(ws);
+	return err;
+}
+
+/*
+	The registry index of a served machine, -1 if the name is not one of
+	them. Clients never get a file parsed, only the server's own are used.
+*/
+static int find_machine(const char *name) {
+	for (int i = 0; i < registry.n; ++i) if (!strcmp(registry.s[i].name, name)) return i;
+	return -1;
+}
+
+static void conn_unref(conn *c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL)) return;
+	close(c->fd);
+	pthread_mutex_destroy(&c->write_lock);
+	free(c);
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+	for (char *p = buf; len; ) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+/* Write to a client, which may be gone */
+static void send_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return;
+		buf += w;
+		len -= w;
+	}
+}
+
+/* Split a request frame into its fields. Takes the frame, NULL if it is malformed */
+static job *parse_frame(char *frame, uint32_t len) {
+	job *j = calloc(1, sizeof(job));
+	char *p = frame, *end = frame + len;
+	uint16_t ml, kl;
+	if (len < 4 + 1 + 8 + 2) goto bad;
+	memcpy(&j->id, p, 4);
+	j->enciphering = p[4] == 'e';
+	if (p[4] != 'e' && p[4] != 'd') goto bad;
+	memcpy(&j->position, p + 5, 8);
+	memcpy(&ml, p + 13, 2);
+	p += 15;
+	if (end - p < ml + 2) goto bad;
+	j->machine = p;
+	p += ml;
+	memcpy(&kl, p, 2);
+	p[0] = 0;	/* Ends the machine name, the key length is read */
+	p += 2;
+	if (end - p < kl + 4) goto bad;
+	j->key = p;
+	p += kl;
+	memcpy(&j->text_len, p, 4);
+	p[0] = 0;
+	p += 4;
+	if ((size_t)(end - p) != j->text_len) goto bad;
+	j->text = p;
+	j->frame = frame;
+	return j;
+bad:
+	free(j);
+	return NULL;
+}
+
+static void queue_push(job *j) {
+	pthread_mutex_lock(&queue.lock);
+	if (queue.tail) queue.tail->next = j;
+	else queue.head = j;
+	queue.tail = j;
+	pthread_cond_signal(&queue.ready);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/* Wait for requests, and take up to max of them */
+static int queue_pop(job **batch, int max) {
+	pthread_mutex_lock(&queue.lock);
+	while (!queue.head) pthread_cond_wait(&queue.ready, &queue.lock);
+	int n = 0;
+	for (; queue.head && n < max; ++n) {
+		batch[n] = queue.head;
+		queue.head = queue.head->next;
+	}
+	if (!queue.head) queue.tail = NULL;
+	pthread_mutex_unlock(&queue.lock);
+	return n;
+}
+
+/* Reads the requests of one connection */
+static void *conn_main(void *arg) {
+	conn *c = arg;
+	for (uint32_t len; read_full(c->fd, &len, 4) && len <= SERVE_MAX_FRAME; ) {
+		char *frame = malloc(len);
+		if (!frame || !read_full(c->fd, frame, len)) {
+			free(frame);
+			break;
+		}
+		job *j = parse_frame(frame, len);
+		if (!j) {
+			free(frame);
+			break;
+		}
+		j->c = c;
+		__atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+		queue_push(j);
+	}
+	shutdown(c->fd, SHUT_RD);
+	conn_unref(c);
+	return NULL;
+}
+
+static void out_reserve(worker *w, size_t more) {
+	if (w->out_len + more <= w->out_size) return;
+	while (w->out_len + more > w->out_size) w->out_size = w->out_size ? 2 * w->out_size : STREAMBUF;
+	w->out = realloc(w->out, w->out_size);
+	if (!w->out) feil("out of memory for the answers\n");
+}
+
+/* Set up the worker's copy of the machine with the job's key */
+static const char *set_key(worker *w, int idx, job *j) {
+	if (idx >= w->n) {
+		w->wm = realloc(w->wm, (idx + 1) * sizeof(workmachine));
+		memset(w->wm + w->n, 0, (idx + 1 - w->n) * sizeof(workmachine));
+		w->n = idx + 1;
+	}
+	workmachine *wm = &w->wm[idx];
+	if (!wm->c) {
+		wm->c = machine_clone(registry.s[idx].m);
+		wm->ks = keystate_new(wm->c);
+	}
+	if (wm->key && !strcmp(wm->key, j->key)) {
+		keystate_load(wm->c, wm->ks);
+		return NULL;
+	}
+	free(wm->key);
+	wm->key = NULL;
+	keystate_load(wm->c, registry.s[idx].defaults);
+	const char *err = key_apply(wm->c, j->key);
+	if (err) return err;
+	step_cleanup(wm->c);
+	keystate_save(wm->c, wm->ks);
+	wm->key = strdup(j->key);
+	return NULL;
+}
+
+/* Run a job, and add its answer to the worker's output */
+static void run_job(worker *w, job *j) {
+	size_t start = w->out_len;
+	out_reserve(w, SERVE_HEADER);
+	w->out_len += SERVE_HEADER;
+	int idx = find_machine(j->machine);
+	const char *err = idx < 0 ? "machine description not served" : set_key(w, idx, j);
+	if (!err) {
+		machine *c = w->wm[idx].c;
+		machine_seek(c, j->position);
+		for (size_t pos = 0; pos < j->text_len; ) {
+			size_t used, chars;
+			out_reserve(w, STREAMBUF * MB_LEN_MAX);
+			w->out_len += code_utf8(c, j->enciphering, j->text + pos, j->text_len - pos, true,
+			                        &used, &chars, w->out + w->out_len, w->cb);
+			if (!used) break;
+			pos += used;
+		}
+	} else {
+		out_reserve(w, strlen(err));
+		memcpy(w->out + w->out_len, err, strlen(err));
+		w->out_len += strlen(err);
+	}
+	uint32_t len = w->out_len - start - 4;
+	char *h = w->out + start;
+	memcpy(h, &len, 4);
+	memcpy(h + 4, &j->id, 4);
+	h[8] = err != NULL;
+}
+
+static int cmp_conn(const void *a, const void *b) {
+	const job *x = *(job * const *)a, *y = *(job * const *)b;
+	if (x->c != y->c) return x->c < y->c ? -1 : 1;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static void *worker_main(void *arg) {
+	worker *w = arg;
+	job *batch[SERVE_BATCH];
+	for (;;) {
+		int n = queue_pop(batch, SERVE_BATCH);
+		/* Connection by connection, one write for each */
+		qsort(batch, n, sizeof(job *), cmp_conn);
+		for (int i = 0; i < n; ) {
+			conn *c = batch[i]->c;
+			int k = i;
+			w->out_len = 0;
+			for (; k < n && batch[k]->c == c; ++k) run_job(w, batch[k]);
+			pthread_mutex_lock(&c->write_lock);
+			send_all(c->fd, w->out, w->out_len);
+			pthread_mutex_unlock(&c->write_lock);
+			__atomic_add_fetch(&served_requests, k - i, __ATOMIC_RELAXED);
+			for (; i < k; ++i) {
+				free(batch[i]->frame);
+				free(batch[i]);
+				conn_unref(c);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void stop(int sig) {
+	(void)sig;
+	stopping = 1;
+}
+
+/*
+	Serve requests on the socket until interrupted. m is the description
+	from names[0], the other n - 1 names are parsed here. Requests can
+	only use these.
+*/
+void serve(machine *m, char **names, int n, const char *path, int threads) {
+	registry.s = malloc(n * sizeof(served));
+	for (int i = 0; i < n; ++i) {
+		machine *d = i ? getdescr(names[i]) : m;
+		if (!d) {
+			fprintf(stderr, "%s: ", names[i]);
+			feil("Unuseable machine description\n");
+		}
+		step_cleanup(d);
+		registry.s[registry.n++] = (served){names[i], d, keystate_new(d)};
+	}
+
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) feil("socket path too long\n");
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) feil("cannot listen on the socket\n");
+
+	struct sigaction sa = {.sa_handler = stop};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	threads = pool_threads(threads);
+	pthread_attr_t detached;
+	pthread_attr_init(&detached);
+	pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+	for (int t = 0; t < threads; ++t) {
+		worker *w = calloc(1, sizeof(worker));
+		w->cb = new_codebuf();
+		pthread_t tid;
+		if (pthread_create(&tid, &detached, worker_main, w)) feil("cannot start thread\n");
+	}
+	fprintf(stderr, "serving on %s, %i threads\n", path, threads);
+
+	while (!stopping) {
+		int cfd = accept(fd, NULL, NULL);
+		if (cfd < 0) continue;
+		conn *c = malloc(sizeof(conn));
+		c->fd = cfd;
+		c->refs = 1;
+		pthread_mutex_init(&c->write_lock, NULL);
+		pthread_t tid;
+		if (pthread_create(&tid, &detached, conn_main, c)) conn_unref(c);
+	}
+	close(fd);
+	unlink(path);
+	fprintf(stderr, "%llu requests served\n", __atomic_load_n(&served_requests, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,77 @@
+/*
+	stats.c
+	Counters and cycle timers for the hot paths, reported by --stats.
+
+	Every thread gets a block of its own on first use, so counting needs no
+	locks or atomics. The blocks are kept on a list after their threads are
+	gone, and summed at exit. The STAT_ macros in enigma.h are empty unless
+	compiled with -DENIGMA_STATS.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "enigma.h"
+
+static const char *stat_names[STATS] = {
+	"alphabet_index", "utf8_symbols", "step_table", "step_pins", "step_slots", "post_step",
+	"recompose_runs", "encipher_path", "decipher_path", "path_stages",
+	"draw_wheel_rot", "draw_text", "doupdate"
+};
+
+__thread statblock *stat_local;
+static statblock *stat_blocks;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stat_json;
+
+/* This thread's block, made on first use */
+statblock *stat_block(void) {
+	if (stat_local) return stat_local;
+	statblock *b = calloc(1, sizeof(statblock));
+	if (!b) feil("out of memory for the statistics\n");
+	pthread_mutex_lock(&stat_lock);
+	b->next = stat_blocks;
+	stat_blocks = b;
+	pthread_mutex_unlock(&stat_lock);
+	return stat_local = b;
+}
+
+/* All threads together, as a table or as JSON */
+void stats_report(FILE *f, bool json) {
+	uint64_t count[STATS] = {0}, cycles[STATS] = {0};
+	int threads = 0;
+	pthread_mutex_lock(&stat_lock);
+	for (statblock *b = stat_blocks; b; b = b->next, ++threads) for (int i = 0; i < STATS; ++i) {
+		count[i] += b->count[i];
+		cycles[i] += b->cycles[i];
+	}
+	pthread_mutex_unlock(&stat_lock);
+	if (json) {
+		fprintf(f, "{\"threads\": %i, \"stats\": [", threads);
+		for (int i = 0; i < STATS; ++i) {
+			fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}", i ? "," : "",
+			        stat_names[i], (unsigned long long)count[i], (unsigned long long)cycles[i]);
+		}
+		fprintf(f, "\n]}\n");
+		return;
+	}
+	fprintf(f, "%-16s %16s %18s %12s   (%i threads)\n", "", "count", "cycles", "per count", threads);
+	for (int i = 0; i < STATS; ++i) {
+		fprintf(f, "%-16s %16llu", stat_names[i], (unsigned long long)count[i]);
+		if (cycles[i]) fprintf(f, " %18llu %12.1f\n", (unsigned long long)cycles[i], (double)cycles[i] / count[i]);
+		else fprintf(f, "\n");
+	}
+}
+
+static void report_at_exit(void) {
+	stats_report(stderr, stat_json);
+}
+
+/* Report to stderr when the program ends */
+void stats_at_exit(bool json) {
+	stat_json = json;
+	atexit(report_at_exit);
+}
@@ -0,0 +1,139 @@
+/*
+	steptable.c
+	Notch stepping as a table lookup.
+
+	On a notch machine, what turns on the next keypress depends only on the
+	rotations of the rotating slots and the notches of their wheels. Ring
+	settings move the wiring, not the notches, so they don't matter here.
+	With few enough states (17576 for a 3-wheel enigma) all of them go in a
+	table: the next state, the slots that turn, and the movement flags after.
+	A keypress is then one lookup, see turn_wheels().
+
+	The table is built once the machine has done as many keypresses with
+	the same wheels as the table has states, so short messages and wheel
+	order searches don't pay for it. post_step() notices new wheels or
+	rotations set from outside, and drops the table or finds the new state.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+
+#include "enigma.h"
+
+/*
+	Does slot i take part in the stepping? It must rotate, and either move
+	or push something. A rotating slot that nothing pushes just sits there,
+	like the greek wheel of the M4.
+*/
+static bool in_table(machine *m, int i) {
+	wheelslot *s = &m->slot[i];
+	if (!s->step) return false;
+	if (s->fast || s->affect_slots) return true;
+	for (int j = 0; j < m->wheelslots; ++j) {
+		wheelslot *p = &m->slot[j];
+		for (int k = p->step ? p->affect_slots : 0; k--; ) if (p->affect_slot[k] == i) return true;
+	}
+	return false;
+}
+
+/* Number of states of the rotating slots, 0 if the machine can't use a table */
+uint32_t step_table_size(machine *m) {
+	if (m->steptype != T_NOTCH_ENABLING || m->wheelslots > 31) return 0;
+	uint64_t states = 1;
+	for (int i = 0; i < m->wheelslots; ++i) if (in_table(m, i)) {
+		states *= m->alphabet_len;
+		if (states > STEP_TABLE_MAX) return 0;
+	}
+	return states;
+}
+
+/* State number of the rotations */
+static uint32_t state_of(machine *m, const steptable *t) {
+	uint32_t st = 0;
+	for (int k = t->slots; k--; ) st = st * m->alphabet_len + m->slot[t->slot[k]].rot;
+	return st;
+}
+
+/* Set the rotations of state st */
+static void set_state(machine *m, const steptable *t, uint32_t st) {
+	for (int k = 0; k < t->slots; ++k, st /= m->alphabet_len) m->slot[t->slot[k]].rot = st % m->alphabet_len;
+}
+
+/* Movement flags of the rotating slots, as post_step() sets them */
+static uint32_t moving(machine *m, const steptable *t) {
+	uint32_t mv = 0;
+	for (int k = 0; k < t->slots; ++k) m->slot[t->slot[k]].movement = false;
+	post_step(m);
+	for (int k = 0; k < t->slots; ++k) if (m->slot[t->slot[k]].movement) mv |= 1u << t->slot[k];
+	return mv;
+}
+
+/* The table for the machine's current wheels, made by stepping a scratch copy through every state */
+steptable *step_table_new(machine *m) {
+	int n = m->wheelslots, al = m->alphabet_len;
+	steptable *t = malloc(sizeof(steptable) + n * (sizeof(int) + sizeof(wheel *)));
+	t->w = (wheel **)(t + 1);
+	t->slot = (int *)(t->w + n);
+	t->slots = 0;
+	t->mask = 0;
+	for (int i = 0; i < n; ++i) if (in_table(m, i)) {
+		t->w[t->slots] = m->slot[i].w;
+		t->slot[t->slots++] = i;
+		t->mask |= 1u << i;
+	}
+	t->states = step_table_size(m);
+	t->entry = malloc(t->states * sizeof(stepentry));
+
+	wheelslot slot[n];
+	machine s = *m;
+	s.slot = slot;
+	s.steps = NULL;
+	for (int i = 0; i < n; ++i) slot[i] = m->slot[i];
+	uint32_t *mv = malloc(t->states * sizeof(uint32_t));
+	for (uint32_t st = 0; st < t->states; ++st) {
+		set_state(&s, t, st);
+		mv[st] = moving(&s, t);
+	}
+	for (uint32_t st = 0; st < t->states; ++st) {
+		set_state(&s, t, st);
+		stepentry *e = &t->entry[st];
+		e->turned = 0;
+		for (int k = 0; k < t->slots; ++k) {
+			wheelslot *sl = &slot[t->slot[k]];
+			if (!sl->fast && !(mv[st] >> t->slot[k] & 1)) continue;
+			e->turned |= 1u << t->slot[k];
+			sl->rot = (sl->rot + sl->step) % al;
+		}
+		e->next = state_of(&s, t);
+	}
+	/* The movement flags after the keypress are those of the next state */
+	for (uint32_t st = 0; st < t->states; ++st) {
+		stepentry *e = &t->entry[st];
+		e->moving = mv[e->next];
+		if (e->moving != mv[st]) e->moving |= STEP_MOVING_CHANGED;
+	}
+	free(mv);
+	return t;
+}
+
+void step_table_free(steptable *t) {
+	if (!t) return;
+	free(t->entry);
+	free(t);
+}
+
+/*
+	After rotations or wheels were set from outside: the table's state for
+	the rotations, or no table if the wheels changed.
+*/
+void step_table_sync(machine *m) {
+	steptable *t = m->steps;
+	for (int k = 0; k < t->slots; ++k) if (m->slot[t->slot[k]].w != t->w[k]) {
+		step_table_free(t);
+		m->steps = NULL;
+		m->step_count = 0;
+		return;
+	}
+	m->step_state = state_of(m, t);
+}
@@ -0,0 +1,621 @@
+/*
+	ui.c
+	ncurses user interface for the simulator
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+/*
+  Necessary define, or ncurses won't provide get_wch() with gcc -std=gnu11 
+  or c99/c11 for that matter. Strangely, the #define is not necessary 
+	without c99...
+*/
+#define _XOPEN_SOURCE_EXTENDED 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include <wchar.h>
+#include <ctype.h>
+
+#include "ui.h"
+
+/* 
+	Workaround for a stupid bug. (curses 5.9, linux 64 bit, march 2015) 
+	refresh() and friends do not display ANYTHING until after the first getch()
+	Very dumb, as I want to set up the screen and THEN wait for input.
+	curses is apparently INCAPABLE of doing this. It HAS TO have a single getch()
+	before I can display anything in windows. Incredibly annoying.
+	I don't want to start the UI with black screen until the first keypress, 
+	so the ugly solution is a single nodelay getch() before the main loop :-(
+
+  Even worse - the bug re-appear when I resize rxvt. 
+	(run rxvt locally, ssh to another host to run this software)
+	Whenever I make the rxvt smaller, the display is black until the first getch
+	Doesn't happen if I extend the rxvt. How do such odd bugs happen :-(
+*/
+
+void curses_bug_workaround() {
+	nodelay(stdscr,true);getch();nodelay(stdscr,false);
+}
+
+/*
+	ncurses-based user interface
+	Shows typed text as well as encoded/decoded text
+	Shows the code wheels and how they move	
+*/
+
+/* Draw the rotating part of one wheel */
+void draw_wheel_rot(machine *m, ui_info *ui, int slotnum) {
+	STAT_START(t);
+	wheelslot *sl = &m->slot[slotnum];
+	int x = slotnum*4 + 2;
+	/* The center column with numbers */
+	wattrset(ui->w_wheels, ui->attr_wheel_plain);
+	int y0 = (ui->layout == 0) ? m->wheelslots + 5 : m->longest_wheelname + 5;
+	for (int i = 1; i <=2; ++i) {
+		mvwprintw(ui->w_wheels, y0-i, x, "%lc", m->alphabet[(sl->rot+i) % m->alphabet_len]);
+		mvwprintw(ui->w_wheels, y0+i, x, "%lc", m->alphabet[(m->alphabet_len+sl->rot-i) % m->alphabet_len]);
+	}
+	/* The one number showing the current setting */
+	wattrset(ui->w_wheels, ui->attr_wheel_activ);
+	mvwprintw(ui->w_wheels, y0, x, "%lc", m->alphabet[sl->rot]);
+	/* Wheel sides. Possibly selected. Notch/block-pins, ring setting mark */
+	wattrset(ui->w_wheels, slotnum == ui->chosen_wheel ? ui->attr_wheelside_activ : ui->attr_wheelside_plain);
+	int al = m->alphabet_len;
+	if (sl->w->notch) for (int i = -2; i <= 2; ++i) {
+		/* Normal wheel side, or notch mark */
+		wchar_t l = sl->w->notch[(sl->rot-i+al) % al] ? L'-' : L' '; 
+		/* Normal wheel side, or ring setting mark */
+		wchar_t r = sl->ringstellung == (sl->rot - i + al) % al ? L'*' : L' '; 
+		mvwprintw(ui->w_wheels, y0 + i, x-1, "%lc", l);
+		mvwprintw(ui->w_wheels, y0 + i, x+1, "%lc", r);
+	}
+	STAT_STOP(ST_DRAW_WHEEL, t);
+}
+
+/* Draw wheel number i */
+void draw_wheel(machine *m, ui_info *ui, int i) {
+	bool highlight = ui->chosen_wheel == i;
+	wattrset(ui->w_wheels, ui->attr_wheel_activ);
+	int base_y = (ui->layout == 0) ? m->wheelslots : m->longest_wheelname;
+	mvwprintw(ui->w_wheels, base_y + 5, i*4, "     ");
+	if (!highlight) wattrset(ui->w_wheels, ui->attr_wheel_plain);
+	/* Wheel background, inactive parts */
+	for (int j = 2; j <= 6; ++j) mvwprintw(ui->w_wheels, base_y + j + 1, i*4+1, "   ");
+  if (m->slot[i].step) {
+		/* Wheel turning knobs */
+		wattrset(ui->w_wheels, highlight ? ui->attr_btnh : ui->attr_btn );
+		mvwprintw(ui->w_wheels, base_y + 8, i*4+1, " v ");
+		mvwprintw(ui->w_wheels, base_y + 2, i*4+1, " ^ ");
+		/* Wheel text */
+		draw_wheel_rot(m, ui, i);
+		/* Ring settings */
+		wattrset(ui->w_wheels, highlight ? ui->attr_lblh : ui->attr_lbl);
+		mvwprintw(ui->w_wheels, base_y + 9, i*4+1, " %lc ", m->alphabet[m->slot[i].ringstellung]);
+	}
+  /* Wheel name */ 
+	wattrset(ui->w_wheels, highlight ? ui->attr_lblh : ui->attr_lbl);
+  if (ui->layout == 0) {
+		mvwprintw(ui->w_wheels, i+1, i*3+m->wheelslots+3, "%*ls", -m->longest_wheelname, m->slot[i].w->name);
+		for (int j = 1; j < 1+m->wheelslots-i; ++j) mvwprintw(ui->w_wheels, i+j+1, 3+i*3+m->wheelslots-j, "%c", '/');
+	} else {
+
+		int nlen = m->slot[i].w->name_len;
+		for (int j = 0; j < nlen; ++j) mvwprintw(ui->w_wheels, 1+j+m->longest_wheelname-nlen, 2+i*4, "%lc", m->slot[i].w->name[j]);	
+		mvwprintw(ui->w_wheels, m->longest_wheelname+1, 2+i*4, "|");
+
+	}
+}
+
+/* Draw the set of wheels (entire window) */
+void draw_wheels(machine *m, ui_info *ui) {
+	for (int i = 0; i < m->wheelslots; ++i) draw_wheel(m, ui, i);
+	/* Machine name centered on top */
+	wattrset(ui->w_wheels, ui->attr_wheel_activ);
+	mvwprintw(ui->w_wheels, 0, (getmaxx(ui->w_wheels)-wcslen(m->name))/2, "%ls", m->name);
+	/* Ring setting heading */
+	wattrset(ui->w_wheels, A_NORMAL);
+	mvwprintw(ui->w_wheels, 9+m->wheelslots, 4*m->wheelslots, "ring setting");
+}
+
+
+void highlight_wheel(machine *m, ui_info *ui, int wheelnr) {
+	int old = ui->chosen_wheel;
+	ui->chosen_wheel = (wheelnr < m->wheelslots && wheelnr >= 0 )? wheelnr : -1;
+	if (old == ui->chosen_wheel) return; /* no change */
+	if (old >= 0) draw_wheel(m, ui, old);
+	if (ui->chosen_wheel >= 0) draw_wheel(m, ui, ui->chosen_wheel);
+	wnoutrefresh(ui->w_wheels);
+}
+
+
+void highlight_left(machine *m, ui_info *ui) {
+	int n = ui->chosen_wheel > 0 ? ui->chosen_wheel - 1 : m->wheelslots - 1;
+	highlight_wheel(m, ui, n);
+}
+
+
+void highlight_right(machine *m, ui_info *ui) {
+	int n = ui->chosen_wheel < m->wheelslots - 1 ? ui->chosen_wheel + 1 : 0;
+	highlight_wheel(m, ui, n);
+}
+
+
+/*
+	(De)cipher all of the text again, the machine is set to the start key.
+	Letters typed the same way go through the block functions together.
+	Only cells that came out different are drawn again.
+*/
+static void retype(machine *m, ui_info *ui) {
+	size_t len = gapbuf_len(ui->text);
+	symbol sym[RETYPE_BLOCK];
+	size_t at[RETYPE_BLOCK];
+	for (size_t i = 0; i < len; ) {
+		bool enc = gapbuf_at(ui->text, i)->enciphered;
+		int n = 0;
+		for (; i < len && n < RETYPE_BLOCK; ++i) {
+			textcell *c = gapbuf_at(ui->text, i);
+			if (c->enciphered != enc) break;
+			int l = alphabet_index(m, enc ? c->plain : c->coded);
+			if (l == -1) continue;
+			sym[n] = l;
+			at[n++] = i;
+		}
+		if (enc) encipher_block(m, sym, sym, n);
+		else decipher_block(m, sym, sym, n);
+		for (int k = 0; k < n; ++k) {
+			textcell *c = gapbuf_at(ui->text, at[k]);
+			wchar_t *out = enc ? &c->coded : &c->plain;
+			if (*out == m->alphabet[sym[k]]) continue;
+			*out = m->alphabet[sym[k]];
+			if (at[k] < ui->dirty_from) ui->dirty_from = at[k];
+		}
+	}
+}
+
+/*
+	A setting was changed. It goes into the start key, and the text typed
+	so far is (de)ciphered again with that key. Wheels and wiring are taken
+	from the machine as it is now, rotations from the start key. A manual
+	wheel turn is the chosen slot turned by delta from its start position.
+*/
+static void rekey(machine *m, ui_info *ui, int slot, int delta) {
+	int n = m->wheelslots, al = m->alphabet_len, rot[n];
+	for (int i = 0; i < n; ++i) {
+		rot[i] = m->slot[i].rot;
+		m->slot[i].rot = ui->start->slot[i].rot;
+	}
+	if (slot >= 0) m->slot[slot].rot = (m->slot[slot].rot + al + delta) % al;
+	step_cleanup(m);
+	keystate_save(m, ui->start);
+	retype(m, ui);
+	for (int i = 0; i < n; ++i) if (m->slot[i].rot != rot[i]) ui->wheel_dirty[i] = true;
+}
+
+/* Manual turning of the chosen code wheel */
+void wheel_turn(machine *m, ui_info *ui, int step) {
+	if (ui->chosen_wheel < 0) return;
+	if (!m->slot[ui->chosen_wheel].step) return;
+	rekey(m, ui, ui->chosen_wheel, step);
+	draw_wheel(m, ui, ui->chosen_wheel);
+	wnoutrefresh(ui->w_wheels);
+}
+
+
+/* Manual change of ring setting */
+void ringstellung(machine *m, ui_info *ui, int step) {
+	if (ui->chosen_wheel < 0) return;
+	if (!m->slot[ui->chosen_wheel].step) return;
+	int *i = &m->slot[ui->chosen_wheel].ringstellung;
+	*i = (*i + m->alphabet_len + step) % m->alphabet_len;
+	rekey(m, ui, -1, 0);
+	draw_wheel(m, ui, ui->chosen_wheel);
+	wnoutrefresh(ui->w_wheels);
+}
+
+
+/* change the highlighted code wheel (or plugboard) */
+void next_wheel(machine *m, ui_info *ui) {
+	if (ui->chosen_wheel < 0) return;
+	wheelslot *sl = &m->slot[ui->chosen_wheel];
+	if (sl->type == T_WHEEL) {
+		/* Change an ordinary wheel or reflector, to another allowed wheel */
+		do {
+			sl->w = sl->w->next_in_set;
+		} while(!sl->w->allow_slot[ui->chosen_wheel]);
+		draw_wheel(m, ui, ui->chosen_wheel);
+	} else {
+		/* change plugboard- / crossbar-settings, or rewire a wheel */
+		wint_t s[m->alphabet_len * 2];
+		echo();
+		char *err = ""; /* Short msg if they screw up */
+		for (bool done = false; !done; ) {
+			wclear(ui->w_pop);
+			if (sl->type == T_PAIRSWAP) {
+				wprintw(ui->w_pop, "%sGive plugboard swaps in the format AX CF ...\nor just enter for the identity mapping\n", err);
+				mvwgetn_wstr(ui->w_pop, 2, 0, s, (m->alphabet_len / 2) * 3);
+				identity_map(m, sl->w);
+				wchar_t *l1=s, *l2;
+				done = true; /* optimistic */
+				do { /* Each iteration parses one stecker pair */
+					while (*l1 == L' ') ++l1;
+					if (*l1) { /*  if we didn't hit \0 */
+						l2 = l1 + 1;
+						int i1 = alphabet_index(m, *l1);
+						int i2 = alphabet_index(m, *l2);
+						if (i1 == -1 || i2 == -1) {
+							*l1 = 0;
+							err = "Letter not in machine alphabet. ";
+							done = false;
+						} else {
+							/* Got a pair, and it is valid! Set up the encoding & decoding */						
+							sl->w->encode[i1] = i2;
+							sl->w->encode[i2] = i1;
+							sl->w->decode[i1] = i2;
+							sl->w->decode[i2] = i1;
+							l1 = l2 + 1;
+						}
+					}
+				} while (*l1);
+			} else {
+				wprintw(ui->w_pop, "%sType the new mapping like XYZABCDE...\nor just enter for the identity mapping\n", err);
+				mvwgetn_wstr(ui->w_pop, 2, 0, s, m->alphabet_len);
+				identity_map(m, sl->w);
+				done = true; /* Unless we get a bad string */
+				int i = 0;
+				wchar_t *l = s;
+				while (*l && i < m->alphabet_len && done) {
+					int c = alphabet_index(m, *l);
+					if (c == -1) {
+						err = "Letter not in machine alphabet. ";
+						done = false;
+					} else {
+						sl->w->encode[i] = c;
+						sl->w->decode[c] = i;
+					}
+					++i;
+					++l;
+				}
+				/* More sanity checking */
+				if (done) {
+					if (*l) {
+						err = "Too many characters. ";
+						done = false;
+					} else if (i && i < m->alphabet_len) {
+						err = "Too few characters. ";
+						done = false;
+					}
+				}
+
+			}
+		}
+		noecho();
+		wheel_tables(m, sl->w);
+		redrawwin(ui->w_code);
+		wnoutrefresh(ui->w_code);	
+
+	}
+	wnoutrefresh(ui->w_wheels);
+	rekey(m, ui, -1, 0);
+}
+
+/* encipher() or decipher() a typed letter, and mark the wheels that turned */
+static wchar_t ui_code(machine *m, ui_info *ui, bool enciphering, wchar_t c) {
+	int rot[m->wheelslots];
+	for (int i = 0; i < m->wheelslots; ++i) rot[i] = m->slot[i].rot;
+	wchar_t r = enciphering ? encipher(m, c) : decipher(m, c);
+	for (int i = 0; i < m->wheelslots; ++i) if (m->slot[i].rot != rot[i]) ui->wheel_dirty[i] = true;
+	return r;
+}
+
+/* Draw the dirty part of the text lines, and put the cursor after the text */
+static void draw_text(ui_info *ui) {
+	STAT_START(t);
+	size_t len = gapbuf_len(ui->text), from = ui->clear_text ? ui->view : ui->dirty_from;
+	if (from < ui->view) from = ui->view;	/* A rekey or retype dirties scrolled-out cells too */
+	wattrset(ui->w_code, ui->attr_plain);
+	for (size_t i = from; i < len; ++i) mvwaddnwstr(ui->w_code, 1, i - ui->view + 1, &gapbuf_at(ui->text, i)->plain, 1);
+	if (ui->clear_text) wclrtoeol(ui->w_code);
+	wattrset(ui->w_code, ui->attr_coded);
+	for (size_t i = from; i < len; ++i) mvwaddnwstr(ui->w_code, 2, i - ui->view + 1, &gapbuf_at(ui->text, i)->coded, 1);
+	if (ui->clear_text) {
+		wmove(ui->w_code, 2, len - ui->view + 1);
+		wclrtoeol(ui->w_code);
+		wmove(ui->w_code, 1, len - ui->view + 1);
+		wclrtoeol(ui->w_code);
+	}
+	wmove(ui->w_code, ui->enciphering ? 1 : 2, len - ui->view + 1);
+	ui->dirty_from = SIZE_MAX;
+	ui->clear_text = false;
+	STAT_STOP(ST_DRAW_TEXT, t);
+}
+
+/* Draw what changed since the last screen update */
+static void ui_flush(machine *m, ui_info *ui) {
+	bool wheels = false;
+	for (int i = 0; i < m->wheelslots; ++i) if (ui->wheel_dirty[i]) {
+		draw_wheel_rot(m, ui, i);
+		ui->wheel_dirty[i] = false;
+		wheels = true;
+	}
+	if (wheels) wnoutrefresh(ui->w_wheels);
+	if (ui->clear_text || ui->dirty_from != SIZE_MAX) {
+		draw_text(ui);
+		wnoutrefresh(ui->w_code);
+	}
+}
+
+/*
+	The next keypress. Keys already waiting, like a paste, are taken without
+	touching the screen. When there are no more, the changes are drawn and
+	the terminal is updated once for all of them.
+*/
+static int next_key(machine *m, ui_info *ui, wint_t *wch) {
+	bool replaying = keylog_replaying(ui->log);
+	int rc = ERR;
+	if (!replaying) {
+		nodelay(stdscr, true);
+		rc = get_wch(wch);
+		nodelay(stdscr, false);
+	}
+	if (rc == ERR) {
+		ui_flush(m, ui);
+		STAT_START(t);
+		doupdate();
+		STAT_STOP(ST_DOUPDATE, t);
+		if (replaying) return keylog_get(ui->log, wch);
+		rc = get_wch(wch);
+	}
+	if (ui->log) keylog_put(ui->log, rc, *wch);
+	return rc;
+}
+
+void interactive(machine *m, keylog *log) {
+	/* Set up the ncurses interface */
+	ui_info ui;
+	ui.log = log;
+	if (keylog_replaying(log)) keylog_screen(log);
+	else initscr();
+	start_color();
+	raw(); 
+	noecho(); 
+	keypad(stdscr, true);
+
+	/* Figure out the level of color support, choose attributes accordingly */
+	if (has_colors()) {
+		if (can_change_color()) {
+			/* Best case, programmable colors */
+			init_color(CLR_WHITEGRAY, 800, 800, 800); /* dull text */
+			init_color(CLR_DARKGRAY, 400, 400, 400);  /* highlighted metal */
+			init_color(CLR_DARKESTGRAY, 250, 250, 250); /* darkest metal */
+			init_color(CLR_BRIGHTRED, 1000, 400, 400); /* coded text */
+			init_pair(CP_WHEEL_PLAIN, CLR_WHITEGRAY, CLR_DARKESTGRAY);
+			init_pair(CP_WHEEL_ACTIV, COLOR_WHITE, CLR_DARKGRAY);
+			init_pair(CP_PLAIN, COLOR_WHITE, COLOR_BLACK);
+			init_pair(CP_CODED, CLR_BRIGHTRED, COLOR_BLACK);
+			init_pair(CP_BTN, COLOR_RED, CLR_DARKESTGRAY);
+			init_pair(CP_BTNH, COLOR_RED, CLR_DARKGRAY);	
+			init_pair(CP_WHEELSIDE_PLAIN, COLOR_BLACK, CLR_DARKESTGRAY);
+			init_pair(CP_WHEELSIDE_ACTIV, COLOR_BLACK, CLR_DARKGRAY);
+		} else {
+			/* Second best, 8 color ncurses */
+			init_pair(CP_WHEEL_PLAIN, COLOR_YELLOW, COLOR_BLUE);
+			init_pair(CP_WHEEL_ACTIV, COLOR_WHITE, COLOR_RED);
+			init_pair(CP_PLAIN, COLOR_WHITE, COLOR_BLACK);
+			init_pair(CP_CODED, COLOR_RED, COLOR_BLACK);
+			init_pair(CP_BTN, COLOR_RED, COLOR_BLUE);
+			init_pair(CP_BTNH, COLOR_BLUE, COLOR_RED);
+			init_pair(CP_WHEELSIDE_PLAIN, COLOR_BLACK, COLOR_BLUE);
+			init_pair(CP_WHEELSIDE_ACTIV, COLOR_BLACK, COLOR_RED);
+		}
+		ui.attr_plain = COLOR_PAIR(CP_PLAIN);
+		ui.attr_coded = COLOR_PAIR(CP_CODED);
+		ui.attr_wheel_plain = COLOR_PAIR(CP_WHEEL_PLAIN);
+		ui.attr_wheel_activ = COLOR_PAIR(CP_WHEEL_ACTIV) | A_BOLD;
+		ui.attr_btn = COLOR_PAIR(CP_BTN);
+		ui.attr_btnh = COLOR_PAIR(CP_BTNH);
+		ui.attr_wheelside_plain = COLOR_PAIR(CP_WHEELSIDE_PLAIN);
+		ui.attr_wheelside_activ = COLOR_PAIR(CP_WHEELSIDE_ACTIV);
+	} else {
+		/* No color fallback */
+		ui.attr_plain = A_NORMAL;
+		ui.attr_coded = A_BOLD;
+		ui.attr_wheel_plain = A_REVERSE;
+		ui.attr_wheel_activ = A_REVERSE | A_BOLD | A_UNDERLINE;
+		ui.attr_btn = A_REVERSE | A_BOLD;
+		ui.attr_btnh = ui.attr_btn;
+		ui.attr_wheelside_plain = ui.attr_wheel_plain;
+		ui.attr_wheelside_activ = ui.attr_wheel_activ;
+	}
+	ui.attr_lbl = A_NORMAL;
+	ui.attr_lblh = A_BOLD;
+	ui.chosen_wheel = -1;
+
+	/* Make the windows.
+     Two ways to print slot headings, select the lowest height:
+		 way0: (height depends on the number of slots)
+
+        UKW-B
+       /   VII
+      /   /   VI
+     /   /   /   steckerbrett
+    /   /   /   /
+
+   way1: (height depends on the longest wheelname)
+ 
+    U       V   E
+    K       I   T
+    W   V   I   W
+    |   |   |   |
+   */
+	int topheight0 = 10 + m->wheelslots;
+	int topheight1 = 10 + m->longest_wheelname;
+	ui.layout = topheight0 < topheight1 ? 0 : 1;
+	int topheight = ui.layout == 0 ? topheight0 : topheight1;
+	int longestname = strlen("ring settings");
+	if (ui.layout == 0 && longestname < m->longest_wheelname) longestname = m->longest_wheelname;
+	int topwidth = 4 * m->wheelslots + 1 + longestname;
+	int namelen = wcslen(m->name);
+	if (namelen > topwidth) topwidth = namelen;
+	ui.w_wheels = newwin(topheight, topwidth, 0, COLS-topwidth);
+	int botheight = ((LINES - topheight) / 3) * 3 - 1;
+	int botwidth = COLS;
+	ui.w_code = newwin(botheight, botwidth, topheight, 0);
+	ui.w_pop = newwin(botheight, botwidth, topheight, 0);
+	draw_wheels(m, &ui);
+
+	ui.enciphering = true;
+	ui.text = gapbuf_new();
+	ui.start = keystate_new(m);
+	ui.view = 0;
+	ui.dirty_from = SIZE_MAX;
+	ui.clear_text = false;
+	ui.wheel_dirty = calloc(m->wheelslots, sizeof(bool));
+	int maxpos = COLS - 2;
+
+	curses_bug_workaround();
+	wmove(ui.w_code, 1, 1);
+
+	/* main loop. The first event has to be the KEY_RESIZE, it creates the display! */
+	int rc = KEY_CODE_YES;
+	wint_t wch = KEY_RESIZE; 
+	for (bool active = true; active; rc = active ? next_key(m, &ui, &wch) : 0) {
+		switch (rc) {
+			case KEY_CODE_YES:		/* specials */
+				switch (wch) {
+					case KEY_F(1):
+						highlight_wheel(m, &ui, 0);
+						break;
+					case KEY_F(2):
+						highlight_wheel(m, &ui, 1);
+						break;
+					case KEY_F(3):
+						highlight_wheel(m, &ui, 2);
+						break;
+					case KEY_F(4):
+						highlight_wheel(m, &ui, 3);
+						break;
+					case KEY_F(5):
+						highlight_wheel(m, &ui, 4);
+						break;
+					case KEY_F(6):
+						highlight_wheel(m, &ui, 5);
+						break;
+					case KEY_F(7):
+						highlight_wheel(m, &ui, 6);
+						break;
+					case KEY_F(8):
+						highlight_wheel(m, &ui, 7);
+						break;
+					case KEY_F(9):
+						highlight_wheel(m, &ui, 8);
+						break;
+					case KEY_LEFT:
+						highlight_left(m, &ui);
+						break;
+					case KEY_RIGHT:
+						highlight_right(m, &ui);
+						break;
+					case KEY_F(10):
+						highlight_wheel(m, &ui, 9);
+						break;
+					case KEY_NPAGE:
+						next_wheel(m, &ui);
+						break;
+					case KEY_UP:
+						if (ui.chosen_wheel == -1) {		
+							/* switch to encoding */
+							ui.enciphering = true;
+							wmove(ui.w_code, 1, gapbuf_len(ui.text) - ui.view + 1);
+							wnoutrefresh(ui.w_code);
+						} else wheel_turn(m, &ui, -1);
+						break;
+					case KEY_DOWN:
+						if (ui.chosen_wheel == -1) {		
+							/* switch to decoding */
+							ui.enciphering = false;
+							wmove(ui.w_code, 2, gapbuf_len(ui.text) - ui.view + 1);
+							wnoutrefresh(ui.w_code);
+						} else wheel_turn(m, &ui, 1);		
+						break;
+					case KEY_RESIZE:	/* user resized the xterm - redraw all! */
+						curses_bug_workaround();//Remove, and top window blanks out
+						/* Must repaint all, as downsizing may blank the terminal */
+						
+						/* Deal with the code wheel window */
+						botheight = ((LINES - topheight) / 3) * 3 - 1;
+						botwidth = COLS;
+						wresize(ui.w_code, botheight, botwidth);
+						wresize(ui.w_pop, botheight, botwidth);
+						int oldx = getbegx(ui.w_wheels);
+						int newx = COLS-topwidth;
+						mvwin(ui.w_wheels, 0, COLS-topwidth); /* move the window */
+						/* now clear out the exposed screen area */
+						if (newx > oldx) {
+							int xlen = newx-oldx;
+							char *spc = malloc(xlen+1);
+							memset(spc, ' ', xlen);
+							spc[xlen] = 0;
+							for (int i=0; i < topheight; ++i) mvprintw(i, oldx, spc);
+							free(spc); 
+						}
+						wnoutrefresh(ui.w_wheels);
+						curses_bug_workaround(); //Remove, and the cursor will misplaced when upsizing
+						
+
+						/* Now the code text window */
+						maxpos = COLS - 2;
+						if (gapbuf_len(ui.text) - ui.view > maxpos) ui.view = gapbuf_len(ui.text) - maxpos;
+						ui.clear_text = true;
+						break;
+				}
+				break;
+			case OK:
+				if (iscntrl(wch)) switch (wch) {
+					/* ctrl tv change ring settings */
+					case 20:
+						ringstellung(m, &ui, -1);
+						break;
+					case 22:
+						ringstellung(m, &ui, 1);
+						break;
+					/* quit on ctrl+c */	
+					case 3:
+						active = false;
+						break;
+					/* unselect wheel on enter */
+						case '\n':
+							highlight_wheel(m, &ui, -1);
+							wnoutrefresh(ui.w_code);
+							break;
+				}							
+				/* plain typing */
+				else { 
+					if (ui.chosen_wheel > -1) highlight_wheel(m, &ui, -1);
+					size_t len = gapbuf_len(ui.text);
+					/* At the end of the line, scroll half a line */
+					if (len - ui.view >= maxpos) {
+						ui.view = len - maxpos / 2;
+						ui.clear_text = true;
+					}
+					textcell c = {.enciphered = ui.enciphering};
+					if (ui.enciphering) {
+						c.plain = wch;
+						c.coded = ui_code(m, &ui, true, wch);
+					} else {
+						c.coded = wch;
+						c.plain = ui_code(m, &ui, false, wch);
+					}
+					gapbuf_insert(ui.text, len, c);
+					if (len < ui.dirty_from) ui.dirty_from = len;
+					break;
+				}
+		} 
+	}
+	endwin();
+	gapbuf_free(ui.text);
+	free(ui.start);
+	free(ui.wheel_dirty);
+}
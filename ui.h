@@ -0,0 +1,81 @@
+/*
+	ui.h
+	ncurses user interface
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <ncurses.h>
+
+#include "enigma.h"
+
+/* Color pair numbers for UI */
+#define CP_WHEEL_PLAIN 20
+#define CP_WHEEL_ACTIV 21
+#define CP_PLAIN 22
+#define CP_CODED 23
+#define CP_BTN 24
+#define CP_BTNH 25
+#define CP_WHEELSIDE_PLAIN 26
+#define CP_WHEELSIDE_ACTIV 27
+
+#define CLR_WHITEGRAY   20
+#define CLR_DARKESTGRAY 21
+#define CLR_DARKGRAY    22
+#define CLR_BRIGHTRED		23
+
+/* gapbuf.c: the typed text, see there */
+typedef struct {
+	wchar_t plain, coded;
+	bool enciphered; /* Typed as plaintext */
+} textcell;
+
+typedef struct {
+	textcell *buf;
+	size_t size, gap, gap_end;
+} gapbuf;
+
+gapbuf *gapbuf_new(void);
+void gapbuf_free(gapbuf *g);
+size_t gapbuf_len(const gapbuf *g);
+textcell *gapbuf_at(gapbuf *g, size_t i);
+void gapbuf_insert(gapbuf *g, size_t pos, textcell c);
+
+/* replay.c: keystroke logs, recorded from the keyboard or replayed headless */
+typedef struct keylog keylog;
+
+keylog *keylog_record(const char *file);
+keylog *keylog_replay(const char *file);
+bool keylog_replaying(keylog *k);
+SCREEN *keylog_screen(keylog *k);
+void keylog_put(keylog *k, int rc, wint_t wch);
+int keylog_get(keylog *k, wint_t *wch);
+void keylog_report(keylog *k);
+void keylog_close(keylog *k);
+
+/* Letters per block call, when the text is (de)ciphered again after a key change */
+#define RETYPE_BLOCK 1024
+
+/* UI stuff */
+typedef struct {
+	int attr_plain, attr_coded; /* plain & enciphered text */
+	int attr_wheel_plain, attr_wheel_activ; /* wheel parts */
+	int attr_wheelside_plain, attr_wheelside_activ; 
+	int attr_btn, attr_btnh; /* wheel parts */
+	int attr_lbl, attr_lblh; /* label text */
+	int layout; /* 0 or 1, how to print slot headings. see interactive() */
+	WINDOW *w_wheels;
+	WINDOW *w_code;
+	WINDOW *w_pop;
+	int chosen_wheel;
+	bool enciphering; /* or deciphering, the typed text goes on line 1 or 2 */
+	gapbuf *text;
+	keystate *start; /* The key the text was typed with */
+	size_t view; /* First text position on screen */
+	/* Dirty flags, what to draw before the next doupdate() */
+	size_t dirty_from; /* Text from here to the end, SIZE_MAX for none */
+	bool clear_text; /* Both text lines, from view */
+	bool *wheel_dirty; /* Wheels that turned */
+	keylog *log; /* Keys recorded or replayed, or NULL */
+} ui_info;
+
+void interactive(machine *m, keylog *log);
@@ -0,0 +1,217 @@
+/*
+	utf8.c
+	utf-8 text straight to alphabet indices and back, for the bulk modes.
+
+	A utf8map is built when a machine is loaded. Code points below 0x800,
+	which covers Latin, Greek and Cyrillic alphabets, are looked up in a
+	direct table, the rest in a small hash table. Each alphabet character
+	also has its utf-8 encoding ready for output. No locale functions or
+	wide characters are involved. alphabet_index() uses the same tables,
+	so alphabets of thousands of characters are looked up in constant time.
+
+	Runs of ascii are classified 16 bytes at a time with SSE2 and SSSE3,
+	when the compiler targets them (-march=native). Blocks without any
+	alphabet characters pass through without further work.
+
+	© 2015 Helge Hafting, licenced under the GPL
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "enigma.h"
+
+/* Store the utf-8 encoding of cp in out, return its length */
+static int encode(uint32_t cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xC0 | cp >> 6;
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xE0 | cp >> 12;
+		out[1] = 0x80 | (cp >> 6 & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | cp >> 18;
+	out[1] = 0x80 | (cp >> 12 & 0x3F);
+	out[2] = 0x80 | (cp >> 6 & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+/*
+	Decode the utf-8 character at p, with n bytes available.
+	Returns its length, 0 if a valid start is cut off at the end,
+	or -1 if it is not valid utf-8 (overlong, surrogate, out of range...)
+*/
+static inline int decode(const unsigned char *p, size_t n, uint32_t *cp) {
+	unsigned char c = p[0];
+	int len;
+	if (c < 0xC2) return -1;
+	else if (c < 0xE0) len = 2, *cp = c & 0x1F;
+	else if (c < 0xF0) len = 3, *cp = c & 0x0F;
+	else if (c < 0xF5) len = 4, *cp = c & 0x07;
+	else return -1;
+	for (int k = 1; k < len; ++k) {
+		if ((size_t)k == n) return 0;
+		unsigned char b = p[k];
+		if ((b & 0xC0) != 0x80) return -1;
+		if (k == 1 && ((c == 0xE0 && b < 0xA0) || (c == 0xED && b >= 0xA0) ||
+		               (c == 0xF0 && b < 0x90) || (c == 0xF4 && b >= 0x90))) return -1;
+		*cp = *cp << 6 | (b & 0x3F);
+	}
+	return len;
+}
+
+static inline uint32_t hash_cp(uint32_t cp) {
+	return cp * 2654435761u;
+}
+
+/* Alphabet index of a code point, -1 if it is not in the alphabet */
+static inline int index_of(const utf8map *u, uint32_t cp) {
+	if (cp < 0x800) return u->low[cp];
+	for (uint32_t h = hash_cp(cp) & u->hash_mask; u->hash_idx[h] >= 0; h = (h + 1) & u->hash_mask) {
+		if (u->hash_cp[h] == cp) return u->hash_idx[h];
+	}
+	return -1;
+}
+
+/* The translation tables for the machine alphabet */
+utf8map *utf8_map(machine *m) {
+	int al = m->alphabet_len;
+	uint32_t hsize = 1;
+	while (hsize < 2u * al) hsize *= 2;
+	utf8map *u = calloc(1, sizeof(utf8map) + al * sizeof(*u->enc) + al + hsize * (sizeof(uint32_t) + sizeof(int32_t)));
+	u->enc = (void *)(u + 1);
+	u->hash_cp = (uint32_t *)(u->enc + al);
+	u->hash_idx = (int32_t *)(u->hash_cp + hsize);
+	u->enc_len = (uint8_t *)(u->hash_idx + hsize);
+	u->hash_mask = hsize - 1;
+	memset(u->low, 255, sizeof(u->low));
+	memset(u->hash_idx, 255, hsize * sizeof(int32_t));
+	for (int i = 0; i < al; ++i) {
+		uint32_t cp = m->alphabet[i];
+		u->enc_len[i] = encode(cp, u->enc[i]);
+		/* A duplicate keeps the first position, see read_alphabet() */
+		if (index_of(u, cp) >= 0) continue;
+		if (cp < 0x80) u->ascii_rows[cp & 0x0F] |= 1 << (cp >> 4);
+		if (cp < 0x800) {
+			u->low[cp] = i;
+			continue;
+		}
+		uint32_t h = hash_cp(cp) & u->hash_mask;
+		while (u->hash_idx[h] >= 0) h = (h + 1) & u->hash_mask;
+		u->hash_cp[h] = cp;
+		u->hash_idx[h] = i;
+	}
+	for (int i = 0; i < 16; ++i) u->ascii_members |= u->ascii_rows[i];
+	return u;
+}
+
+/*
+	Bit k set if the 16 bytes at p are all ascii and byte k is in the
+	alphabet. Returns -1 if some byte is not ascii.
+*/
+static inline int ascii_block(const utf8map *u, const unsigned char *p) {
+#if defined(__SSSE3__)
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+	if (_mm_movemask_epi8(x)) return -1;
+	if (!u->ascii_members) return 0;
+	/* Bitmap lookup: row from the low nibble, bit from the high one */
+	__m128i rows = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)u->ascii_rows), _mm_and_si128(x, _mm_set1_epi8(0x0F)));
+	__m128i bits = _mm_shuffle_epi8(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0),
+	                                _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0F)));
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(rows, bits), _mm_setzero_si128())) & 0xFFFF;
+#else
+	uint64_t a, b;
+	memcpy(&a, p, 8);
+	memcpy(&b, p + 8, 8);
+	if ((a | b) & 0x8080808080808080ULL) return -1;
+	if (!u->ascii_members) return 0;
+	int mask = 0;
+	for (int k = 0; k < 16; ++k) if (u->low[p[k]] >= 0) mask |= 1 << k;
+	return mask;
+#endif
+}
+
+/*
+	Find the alphabet characters in utf-8 text. At most max characters are
+	consumed, and a character cut off at the end of in is left for the next
+	call unless this is the final part of the input. Bytes that are not
+	valid utf-8 count as one character each.
+	The alphabet index of each character found goes in sym, and its byte
+	offset in pos. Both may be NULL, to just count them.
+	Returns the number of alphabet characters, *used and *chars are set to
+	the number of bytes and characters consumed.
+*/
+size_t utf8_scan(const utf8map *u, const char *in, size_t len, bool final, size_t max,
+                 symbol *sym, uint32_t *pos, size_t *used, size_t *chars) {
+	const unsigned char *p = (const unsigned char *)in;
+	size_t i = 0, nc = 0, ns = 0;
+	while (i < len && nc < max) {
+		if (len - i >= 16 && max - nc >= 16) {
+			int mask = ascii_block(u, p + i);
+			if (mask >= 0) {
+				for (; mask; mask &= mask - 1) {
+					int k = __builtin_ctz(mask);
+					if (sym) {
+						sym[ns] = u->low[p[i + k]];
+						pos[ns] = i + k;
+					}
+					++ns;
+				}
+				i += 16;
+				nc += 16;
+				continue;
+			}
+		}
+		uint32_t cp = p[i];
+		int n = cp < 0x80 ? 1 : decode(p + i, len - i, &cp);
+		if (!n) {
+			if (!final) break;
+			n = -1; /* truncated at end of file */
+		}
+		++nc;
+		if (n < 0) {
+			++i;
+			continue;
+		}
+		int l = index_of(u, cp);
+		if (l >= 0) {
+			if (sym) {
+				sym[ns] = l;
+				pos[ns] = i;
+			}
+			++ns;
+		}
+		i += n;
+	}
+	*used = i;
+	*chars = nc;
+	STAT_ADD(ST_UTF8, ns);
+	return ns;
+}
+
+/* Position of a character in the machine alphabet, or -1 */
+int alphabet_index(machine *m, wchar_t wc) {
+	STAT_COUNT(ST_LOOKUP);
+	return wc < 0 ? -1 : index_of(m->utf8, wc);
+}
+
+/* Store the utf-8 encoding of alphabet character s in out, return its length */
+int utf8_put(const utf8map *u, symbol s, char *out) {
+	memcpy(out, u->enc[s], u->enc_len[s]);
+	return u->enc_len[s];
+}
+
+/* utf-8 length of the character starting with byte c, which must be valid */
+int utf8_len(unsigned char c) {
+	return c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+}